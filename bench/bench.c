@@ -0,0 +1,379 @@
+/** bench.c --- throughput and syscalls of io engines over loopback.
+ *
+ * Copyright (C) 2014 Yang,Ying-chao
+ *
+ * Author: Yang,Ying-chao <yangyingchao@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Starts range_server, then for each io engine and number of connections
+ * fetches the same amount of data, split into one ranged GET per
+ * connection, through a single connection group: the same path as
+ * downloads of mget, without files (data is dropped once counted). A
+ * download can't use more than 254 connections, hence groups are driven
+ * here directly.
+ *
+ * Throughput, syscalls counted by connections (as reported by mget -Y) and
+ * CPU time of this process are printed for every run. Pool is disabled so
+ * that every run connects anew.
+ */
+
+#include "libmget.h"
+#include "connection.h"
+#include "mget_macros.h"
+#include "netutils.h"
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define RECV_SIZE  (64 * 1024)  // buffer of each connection.
+#define MAX_RUNS   16
+
+extern io_engine g_engine;
+extern char **environ;
+
+typedef struct _bench_conn {
+    const url_info *ui;
+    uint64 start;               // range of this connection,
+    uint64 len;
+    uint64 got;                 // and body bytes received of it.
+    bool   header_done;
+    int    hlen;
+    char   hdr[1024];
+    char   buf[RECV_SIZE];
+} bench_conn;
+
+typedef struct _bench_engine {
+    char        key;
+    io_engine   engine;
+    const char *name;
+} bench_engine;
+
+static const bench_engine engines[] = {
+    {'s', IE_SELECT, "select"},
+#ifdef HAVE_EPOLL
+    {'e', IE_EPOLL, "epoll"},
+#endif
+#ifdef HAVE_IO_URING
+    {'u', IE_URING, "io_uring"},
+#endif
+    {0, IE_DEFAULT, NULL}
+};
+
+static void  usage(const char *prog);
+static pid_t server_start(const char *path, uint64 size, int *port);
+static bool  bench_run(const url_info *ui, int nc, uint64 size);
+static int   bench_write(connection *conn, void *priv);
+static int   bench_read(connection *conn, void *priv);
+static int   bench_get_buffer(connection *conn, void *priv, char **buf,
+                              uint32 *size);
+static int   bench_recv_done(connection *conn, int rd, void *priv);
+static uint64 cpu_ms();
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-s size-in-MB] [-c connections,...] "
+            "[-e engines] range_server\n"
+            "\t-s:  data fetched by every run, default: 512.\n"
+            "\t-c:  numbers of connections, default: 8,64,512.\n"
+            "\t-e:  engines to run, any of 's' (select), 'e' (epoll) and "
+            "'u' (io_uring), default: all built.\n", prog);
+    exit(1);
+}
+
+/* Spawns range_server at path serving size bytes, returns its pid and port
+ * it listens on, or -1.
+ */
+static pid_t server_start(const char *path, uint64 size, int *port)
+{
+    int fds[2];
+    if (pipe(fds) == -1)
+        return -1;
+
+    char sz[32];
+    snprintf(sz, sizeof(sz), "%llu", (unsigned long long) (size >> 20));
+    char *argv[] = {(char *) path, "-s", sz, NULL};
+
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&fa, fds[0]);
+
+    pid_t pid = -1;
+    int err = posix_spawn(&pid, path, &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    close(fds[1]);
+    if (err) {
+        fprintf(stderr, "Failed to start %s: %s\n", path, strerror(err));
+        close(fds[0]);
+        return -1;
+    }
+
+    FILE *fp = fdopen(fds[0], "r");
+    if (!fp || fscanf(fp, "port: %d", port) != 1) {
+        fprintf(stderr, "%s didn't tell its port.\n", path);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        pid = -1;
+    }
+    if (fp)
+        fclose(fp);
+    else
+        close(fds[0]);
+    return pid;
+}
+
+static int bench_write(connection *conn, void *priv)
+{
+    bench_conn *bc = (bench_conn *) priv;
+    char req[256];
+
+    // Sent again from start if connection is moved to another address.
+    bc->header_done = false;
+    bc->hlen = 0;
+    bc->got = 0;
+    int len = snprintf(req, sizeof(req),
+                       "GET %s HTTP/1.1\r\nHost: %s\r\n"
+                       "Range: bytes=%llu-%llu\r\n\r\n",
+                       bc->ui->uri, bc->ui->host,
+                       (unsigned long long) bc->start,
+                       (unsigned long long) (bc->start + bc->len - 1));
+    if (conn->co.write(conn, req, len, NULL) != len)
+        return COF_FAILED;
+    return COF_FINISHED;
+}
+
+static int bench_read(connection *conn, void *priv)
+{
+    bench_conn *bc = (bench_conn *) priv;
+    if (bc->header_done) {
+        int rd = conn->co.read(conn, bc->buf,
+                               (uint32) MIN(bc->len - bc->got, RECV_SIZE),
+                               NULL);
+        return bench_recv_done(conn, rd, priv);
+    }
+
+    int rd = conn->co.read(conn, bc->hdr + bc->hlen,
+                           sizeof(bc->hdr) - 1 - bc->hlen, NULL);
+    if (rd <= 0)
+        return rd;
+
+    bc->hlen += rd;
+    bc->hdr[bc->hlen] = '\0';
+    char *end = strstr(bc->hdr, "\r\n\r\n");
+    if (!end)
+        return bc->hlen < (int) sizeof(bc->hdr) - 1 ? rd : COF_FAILED;
+    if (strncmp(bc->hdr, "HTTP/1.1 206", 12)) {
+        fprintf(stderr, "Unexpected response: %.*s\n",
+                (int) (end - bc->hdr), bc->hdr);
+        return COF_FAILED;
+    }
+
+    bc->header_done = true;
+    rd = bc->hlen - (int) (end + 4 - bc->hdr);
+    return rd ? bench_recv_done(conn, rd, priv) : COF_AGAIN;
+}
+
+static int bench_get_buffer(connection *conn, void *priv, char **buf,
+                            uint32 *size)
+{
+    bench_conn *bc = (bench_conn *) priv;
+    if (!bc->header_done)
+        return COF_AGAIN;
+    if (bc->got >= bc->len)
+        return COF_FINISHED;
+
+    *buf = bc->buf;
+    *size = (uint32) MIN(bc->len - bc->got, RECV_SIZE);
+    return 0;
+}
+
+static int bench_recv_done(connection *conn, int rd, void *priv)
+{
+    bench_conn *bc = (bench_conn *) priv;
+    if (rd > 0) {
+        bc->got += rd;
+        if (bc->got >= bc->len)
+            return COF_FINISHED;
+    } else if (rd == -1 && errno == EAGAIN) {
+        rd = COF_AGAIN;
+    }
+    return rd;
+}
+
+/* Fetches size bytes of ui with nc connections of one group, returns false
+ * if not all of them arrived.
+ */
+static bool bench_run(const url_info *ui, int nc, uint64 size)
+{
+    bool stop = false;
+    connection_group *sg = connection_group_create(cg_all, &stop);
+    bench_conn *bcs = ZALLOC(bench_conn, nc);
+    if (!sg || !bcs)
+        return false;
+
+    uint64 each = size / nc;
+    for (int i = 0; i < nc; ++i) {
+        bench_conn *bc = bcs + i;
+        bc->ui = ui;
+        bc->start = each * i;
+        bc->len = i == nc - 1 ? size - bc->start : each;
+
+        connection *conn = connection_get(ui, true);
+        if (!conn) {
+            fprintf(stderr, "Failed to create connection %d.\n", i);
+            break;
+        }
+
+        conn->recv_data  = bench_read;
+        conn->write_data = bench_write;
+        conn->get_buffer = bench_get_buffer;
+        conn->recv_done  = bench_recv_done;
+        conn->priv       = bc;
+        connection_add_to_group(sg, conn);
+    }
+
+    connection_perform(sg);
+    connection_group_destroy(sg);
+
+    bool ok = true;
+    for (int i = 0; i < nc; ++i)
+        ok = ok && bcs[i].got == bcs[i].len;
+    free(bcs);
+    return ok;
+}
+
+static uint64 cpu_ms()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (uint64) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000 +
+        (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000;
+}
+
+int main(int argc, char *argv[])
+{
+    uint64      size   = 512ULL << 20;
+    const char *keys   = "seu";
+    int         ncs[MAX_RUNS] = {8, 64, 512};
+    int         nr_nc  = 3;
+    int         opt;
+
+    while ((opt = getopt(argc, argv, "s:c:e:h")) != -1) {
+        switch (opt) {
+            case 's':
+                size = strtoull(optarg, NULL, 10) << 20;
+                break;
+            case 'c': {
+                nr_nc = 0;
+                for (char *p = strtok(optarg, ","); p && nr_nc < MAX_RUNS;
+                     p = strtok(NULL, ","))
+                    if ((ncs[nr_nc] = atoi(p)) > 0)
+                        nr_nc++;
+                break;
+            }
+            case 'e':
+                keys = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || !size || !nr_nc)
+        usage(argv[0]);
+
+    int port = 0;
+    pid_t pid = server_start(argv[optind], size, &port);
+    if (pid == -1)
+        return 1;
+
+    char url[64];
+    url_info *ui = NULL;
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/bench", port);
+    if (!parse_url(url, &ui)) {
+        fprintf(stderr, "Failed to parse url: %s\n", url);
+        kill(pid, SIGTERM);
+        return 1;
+    }
+
+    set_pool_limits(-1, 0);
+
+    printf("%llu MB per run from %s\n\n", (unsigned long long) (size >> 20),
+           url);
+    printf("%-9s %6s %9s %12s %9s %9s %9s %9s %8s\n", "engine", "conns",
+           "MB/s", "syscalls/MB", "reads", "writes", "polls", "epoll_ctl",
+           "cpu ms");
+
+    int failed = 0;
+    for (const bench_engine *e = engines; e->name; ++e) {
+        if (!strchr(keys, e->key))
+            continue;
+
+        g_engine = e->engine;
+        for (int i = 0; i < nr_nc; ++i) {
+            io_stats s0, s1;
+            connection_io_stats(&s0);
+            uint64 cpu = cpu_ms();
+            uint64 t0  = get_monotonic_ms();
+
+            bool ok = bench_run(ui, ncs[i], size);
+
+            uint64 ms = MAX(get_monotonic_ms() - t0, 1);
+            cpu = cpu_ms() - cpu;
+            connection_io_stats(&s1);
+
+            uint64 reads  = s1.reads - s0.reads;
+            uint64 writes = s1.writes - s0.writes;
+            uint64 polls  = s1.polls - s0.polls + s1.waits - s0.waits;
+            uint64 ctls   = s1.ctls - s0.ctls;
+            double mb     = (double) (s1.bytes - s0.bytes) / 1048576;
+            printf("%-9s %6d %9.1f %12.1f %9llu %9llu %9llu %9llu %8llu%s\n",
+                   e->name, ncs[i], mb * 1000 / ms,
+                   mb > 0 ? (reads + writes + polls + ctls) / mb : 0.0,
+                   (unsigned long long) reads, (unsigned long long) writes,
+                   (unsigned long long) polls, (unsigned long long) ctls,
+                   (unsigned long long) cpu, ok ? "" : "  (incomplete)");
+            fflush(stdout);
+            if (!ok)
+                failed++;
+        }
+    }
+
+    url_info_destroy(ui);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return failed ? 1 : 0;
+}
+
+/*
+ * Editor modelines
+ *
+ * Local Variables:
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * fill-column: 78
+ * End:
+ *
+ * vim: set noet ts=4 sw=4:
+ */
@@ -0,0 +1,444 @@
+/** group_bench.c --- cost of walking members of a connection group.
+ *
+ * Copyright (C) 2014 Yang,Ying-chao
+ *
+ * Author: Yang,Ying-chao <yangyingchao@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Measures what one iteration of the select loop costs in user space for
+ * three layouts of group members, without syscalls:
+ *
+ *  list:  intrusive singly linked list, fields as connection_p had them
+ *         before members were kept in an array: hot fields spread over two
+ *         cache lines, finished members are still walked.
+ *  array: what connection.c does: array of pointers to connection_p, hot
+ *         fields packed after public part, finished members compacted
+ *         behind live ones.
+ *  index: hot fields of all members in one contiguous array, walked by
+ *         index; cold fields in another array reached by a stable handle,
+ *         compaction swaps hot entries and updates handle -> index map.
+ *
+ * Every iteration builds read/write sets from all live members, then
+ * dispatches ready ones (one in eight, random), which touch a cold field.
+ * "steady" keeps all members live, "drain" lets all of them finish at
+ * random iterations of the run, as chunks of a download do. "cold" flushes
+ * caches before each iteration, as receiving data does in real loops.
+ *
+ * Members are 448 bytes (sizeof(connection_p) on x86_64) and allocated
+ * between other objects, in random order, as pool reuse makes them.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MEMBER_SIZE  448
+#define PUBLIC_SIZE  88         // sizeof(connection).
+#define ITERATIONS   256
+#define FLUSH_SIZE   (32 << 20)
+#define MAX_MEMBERS  4096
+#define READY_RATE   8          // one in READY_RATE live members is ready.
+
+#define WT_READ      1
+#define WT_WRITE     2
+
+typedef uint64_t fdmask[MAX_MEMBERS / 64 + 1];
+
+#define MASK_SET(M, I)    ((M)[(I) / 64] |= 1ULL << ((I) % 64))
+#define MASK_ISSET(M, I)  ((M)[(I) / 64] & (1ULL << ((I) % 64)))
+
+/* Layout before members were kept in array. */
+typedef struct _list_member {
+    char pub[PUBLIC_SIZE];
+    char rco[40];
+    struct _list_member *next;
+    int sock;
+    int port;
+    char *host;
+    void *addr;
+    void *priv;
+    bool connected, active, busy, nowait, throttled, resolved, connecting;
+    bool handshaking, promote, parked, tls_waited, early_data, fastopen;
+    int hs_wait;
+    int io_wait;
+    void *he;
+    void *waiter;
+    bool queued;
+    int slot;
+    int eprotocol;
+    uint32_t features;
+    int expt;
+    int phase;
+    uint64_t cold[1];           // tm_bytes and the rest.
+} list_member;
+
+/* Layout of connection_p now. */
+typedef struct _array_member {
+    char pub[PUBLIC_SIZE];
+    int sock;
+    bool active, connected, busy, throttled, resolved, connecting;
+    bool handshaking, parked, queued;
+    int hs_wait;
+    int io_wait;
+    int expt;
+    uint32_t features;
+    void *waiter;
+    void *priv;
+    uint64_t cold[1];
+} array_member;
+
+/* Hot part of index layout, cold part stays where handle puts it. */
+typedef struct _hot_member {
+    int sock;
+    bool active, connected, busy, throttled, resolved, connecting;
+    bool handshaking, parked, queued;
+    int hs_wait;
+    int io_wait;
+    int expt;
+    uint32_t features;
+    int handle;                 // index of cold part.
+    void *waiter;
+} hot_member;
+
+typedef struct _cold_member {
+    uint64_t cold[(MEMBER_SIZE - sizeof(hot_member)) / 8];
+} cold_member;
+
+typedef struct _layout {
+    const char *name;
+    void  (*setup) (int n);
+    int   (*iterate) (int iter);  // returns live members walked.
+    void  (*teardown) ();
+} layout;
+
+static int      g_n;
+static int      g_done_at[MAX_MEMBERS];   // iteration member finishes in.
+static int      g_order[MAX_MEMBERS];     // order members join group.
+static bool     g_drain;
+static fdmask   g_ready[ITERATIONS];      // sockets kernel reports ready.
+static void    *g_garbage[MAX_MEMBERS * 4];
+static int      g_nr_garbage;
+static char    *g_flush;
+static uint64_t g_sink;
+
+static list_member  *l_head;
+static list_member  *l_all[MAX_MEMBERS];
+static array_member *a_members[MAX_MEMBERS];
+static int           a_live;
+static hot_member   *x_hot;
+static cold_member  *x_cold;
+static int          *x_index;           // handle -> index of hot entry.
+static int           x_live;
+
+static uint64_t now_ns();
+static void  *scattered_alloc(size_t size);
+static void   garbage_free();
+static void   list_setup(int n);
+static int    list_iterate(int iter);
+static void   list_teardown();
+static void   array_setup(int n);
+static int    array_iterate(int iter);
+static void   array_teardown();
+static void   index_setup(int n);
+static int    index_iterate(int iter);
+static void   index_teardown();
+static double measure(const layout *l, int n, bool drain, bool cold);
+
+static const layout layouts[] = {
+    {"list", list_setup, list_iterate, list_teardown},
+    {"array", array_setup, array_iterate, array_teardown},
+    {"index", index_setup, index_iterate, index_teardown},
+};
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Allocates size bytes after some other objects, as in a busy heap. */
+static void *scattered_alloc(size_t size)
+{
+    for (int i = rand() % 4; i > 0 && g_nr_garbage < MAX_MEMBERS * 4; i--)
+        g_garbage[g_nr_garbage++] = malloc(64 + rand() % 2048);
+    return calloc(1, size);
+}
+
+static void garbage_free()
+{
+    while (g_nr_garbage)
+        free(g_garbage[--g_nr_garbage]);
+}
+
+static void list_setup(int n)
+{
+    l_head = NULL;
+    for (int i = 0; i < n; ++i) {
+        list_member *m = scattered_alloc(MEMBER_SIZE);
+        m->sock = i;
+        m->active = m->connected = true;
+        m->expt = WT_READ;
+        l_all[i] = m;
+    }
+    for (int i = 0; i < n; ++i) {
+        list_member *m = l_all[g_order[i]];
+        m->next = l_head;
+        l_head = m;
+    }
+}
+
+static int list_iterate(int iter)
+{
+    fdmask rfds, wfds;
+    int walked = 0;
+    memset(rfds, 0, sizeof(rfds));
+    memset(wfds, 0, sizeof(wfds));
+
+    for (list_member *m = l_head; m; m = m->next) {
+        walked++;
+        if (!m->active || m->waiter)
+            continue;
+        if (m->connecting || m->hs_wait == WT_WRITE || m->io_wait == WT_WRITE)
+            MASK_SET(wfds, m->sock);
+        else if ((m->expt & WT_READ) && !m->throttled)
+            MASK_SET(rfds, m->sock);
+    }
+
+    for (list_member *m = l_head; m; m = m->next) {
+        if (!m->active || !MASK_ISSET(rfds, m->sock) ||
+            !MASK_ISSET(g_ready[iter], m->sock))
+            continue;
+        m->cold[0] += 1000;
+        if (g_drain && g_done_at[m->sock] <= iter)
+            m->active = false;
+    }
+    return walked;
+}
+
+static void list_teardown()
+{
+    for (int i = 0; i < g_n; ++i)
+        free(l_all[i]);
+}
+
+static void array_setup(int n)
+{
+    array_member *all[MAX_MEMBERS];
+    for (int i = 0; i < n; ++i) {
+        array_member *m = scattered_alloc(MEMBER_SIZE);
+        m->sock = i;
+        m->active = m->connected = true;
+        m->expt = WT_READ;
+        all[i] = m;
+    }
+    for (int i = 0; i < n; ++i)
+        a_members[i] = all[g_order[i]];
+    a_live = n;
+}
+
+static int array_iterate(int iter)
+{
+    fdmask rfds, wfds;
+    int walked = a_live;
+    memset(rfds, 0, sizeof(rfds));
+    memset(wfds, 0, sizeof(wfds));
+
+    for (int i = 0; i < a_live; ++i) {
+        array_member *m = a_members[i];
+        if (!m->active || m->waiter)
+            continue;
+        if (m->connecting || m->hs_wait == WT_WRITE || m->io_wait == WT_WRITE)
+            MASK_SET(wfds, m->sock);
+        else if ((m->expt & WT_READ) && !m->throttled)
+            MASK_SET(rfds, m->sock);
+    }
+
+    for (int i = 0; i < a_live; ++i) {
+        array_member *m = a_members[i];
+        if (!m->active || !MASK_ISSET(rfds, m->sock) ||
+            !MASK_ISSET(g_ready[iter], m->sock))
+            continue;
+        m->cold[0] += 1000;
+        if (g_drain && g_done_at[m->sock] <= iter)
+            m->active = false;
+    }
+
+    // group_compact()
+    for (int i = 0; i < a_live;) {
+        array_member *m = a_members[i];
+        if (m->active || m->resolved) {
+            i++;
+            continue;
+        }
+        a_members[i] = a_members[--a_live];
+        a_members[a_live] = m;
+    }
+    return walked;
+}
+
+static void array_teardown()
+{
+    for (int i = 0; i < g_n; ++i)
+        free(a_members[i]);
+}
+
+static void index_setup(int n)
+{
+    x_hot = calloc(n, sizeof(hot_member));
+    x_cold = calloc(n, sizeof(cold_member));
+    x_index = calloc(n, sizeof(int));
+    for (int i = 0; i < n; ++i) {
+        hot_member *m = x_hot + i;
+        m->sock = g_order[i];
+        m->active = m->connected = true;
+        m->expt = WT_READ;
+        m->handle = i;
+        x_index[i] = i;
+    }
+    x_live = n;
+}
+
+static int index_iterate(int iter)
+{
+    fdmask rfds, wfds;
+    int walked = x_live;
+    memset(rfds, 0, sizeof(rfds));
+    memset(wfds, 0, sizeof(wfds));
+
+    for (int i = 0; i < x_live; ++i) {
+        hot_member *m = x_hot + i;
+        if (!m->active || m->waiter)
+            continue;
+        if (m->connecting || m->hs_wait == WT_WRITE || m->io_wait == WT_WRITE)
+            MASK_SET(wfds, m->sock);
+        else if ((m->expt & WT_READ) && !m->throttled)
+            MASK_SET(rfds, m->sock);
+    }
+
+    for (int i = 0; i < x_live; ++i) {
+        hot_member *m = x_hot + i;
+        if (!m->active || !MASK_ISSET(rfds, m->sock) ||
+            !MASK_ISSET(g_ready[iter], m->sock))
+            continue;
+        x_cold[m->handle].cold[0] += 1000;
+        if (g_drain && g_done_at[m->sock] <= iter)
+            m->active = false;
+    }
+
+    for (int i = 0; i < x_live;) {
+        if (x_hot[i].active || x_hot[i].resolved) {
+            i++;
+            continue;
+        }
+        hot_member tmp = x_hot[i];
+        x_hot[i] = x_hot[--x_live];
+        x_hot[x_live] = tmp;
+        x_index[x_hot[i].handle] = i;
+        x_index[tmp.handle] = x_live;
+    }
+    return walked;
+}
+
+static void index_teardown()
+{
+    free(x_hot);
+    free(x_cold);
+    free(x_index);
+}
+
+/* Returns ns an iteration takes on average over the run. */
+static double measure(const layout *l, int n, bool drain, bool cold)
+{
+    g_n = n;
+    g_drain = drain;
+    srand(n);
+    for (int i = 0; i < n; ++i) {
+        g_order[i] = i;
+        g_done_at[i] = rand() % ITERATIONS;
+    }
+    for (int i = n - 1; i > 0; --i) {
+        int j = rand() % (i + 1);
+        int t = g_order[i];
+        g_order[i] = g_order[j];
+        g_order[j] = t;
+    }
+    memset(g_ready, 0, sizeof(g_ready));
+    for (int it = 0; it < ITERATIONS; ++it)
+        for (int i = 0; i < n; ++i)
+            if (rand() % READY_RATE == 0)
+                MASK_SET(g_ready[it], i);
+
+    l->setup(n);
+    uint64_t total = 0;
+    for (int it = 0; it < ITERATIONS; ++it) {
+        if (cold)
+            for (int i = 0; i < FLUSH_SIZE; i += 64)
+                g_flush[i]++;
+        uint64_t t0 = now_ns();
+        g_sink += l->iterate(it);
+        total += now_ns() - t0;
+    }
+    l->teardown();
+    garbage_free();
+    return (double) total / ITERATIONS;
+}
+
+int main(int argc, char *argv[])
+{
+    static const int counts[] = {64, 512, 4096};
+
+    g_flush = calloc(1, FLUSH_SIZE);
+    if (!g_flush)
+        return 1;
+
+    printf("ns per iteration of %d, averaged; members: %d bytes\n\n",
+           ITERATIONS, MEMBER_SIZE);
+    printf("%-7s %7s %12s %12s %12s %12s\n", "layout", "members",
+           "steady warm", "steady cold", "drain warm", "drain cold");
+    for (int c = 0; c < (int) (sizeof(counts) / sizeof(counts[0])); ++c) {
+        for (int i = 0; i < (int) (sizeof(layouts) / sizeof(layouts[0]));
+             ++i) {
+            const layout *l = layouts + i;
+            printf("%-7s %7d %12.0f %12.0f %12.0f %12.0f\n", l->name,
+                   counts[c], measure(l, counts[c], false, false),
+                   measure(l, counts[c], false, true),
+                   measure(l, counts[c], true, false),
+                   measure(l, counts[c], true, true));
+        }
+    }
+
+    free(g_flush);
+    return g_sink ? 0 : 1;
+}
+
+/*
+ * Editor modelines
+ *
+ * Local Variables:
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * fill-column: 78
+ * End:
+ *
+ * vim: set noet ts=4 sw=4:
+ */
@@ -0,0 +1,357 @@
+/** range_server.c --- loopback HTTP server of ranged GETs, for benchmarks.
+ *
+ * Copyright (C) 2014 Yang,Ying-chao
+ *
+ * Author: Yang,Ying-chao <yangyingchao@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Every path names the same file of given size, its content is generated
+ * from memory, so that disks are out of measurement. It answers HEAD, GET
+ * and GET with "Range: bytes=a-b" (or "a-"), keeps connections alive
+ * unless asked to close, and serves all of them from one epoll loop.
+ *
+ * Port it listens on (picked by kernel unless -p is given) is printed to
+ * stdout as "port: N".
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE   (1 << 20)  // content repeats every block.
+#define MAX_REQUEST  4096
+#define MAX_EVENTS   256
+
+typedef struct _client {
+    int      fd;
+    char     req[MAX_REQUEST];
+    int      rlen;              // bytes of request received.
+    char     hdr[256];          // header of response,
+    int      hlen;
+    int      hoff;              // and bytes of it sent.
+    uint64_t pos;               // next byte of body to send,
+    uint64_t end;               // and end of body, exclusive.
+    bool     close;             // close once response is sent.
+} client;
+
+static char     g_block[BLOCK_SIZE];
+static uint64_t g_size = 1ULL << 30;
+static int      g_epfd = -1;
+
+static void usage(const char *prog);
+static int  listen_on(int port);
+static void client_accept(int lfd);
+static void client_close(client *c);
+static void client_read(client *c);
+static void client_write(client *c);
+static bool request_parse(client *c, int len);
+static void client_watch(client *c, uint32_t events);
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-p port] [-s size-in-MB]\n", prog);
+    exit(1);
+}
+
+static int listen_on(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd == -1)
+        return -1;
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(sa);
+    if (bind(fd, (struct sockaddr *) &sa, len) == -1 ||
+        listen(fd, 1024) == -1 ||
+        getsockname(fd, (struct sockaddr *) &sa, &len) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    printf("port: %d\n", ntohs(sa.sin_port));
+    fflush(stdout);
+    return fd;
+}
+
+static void client_watch(client *c, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(g_epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void client_accept(int lfd)
+{
+    int fd;
+    while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK)) != -1) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        client *c = calloc(1, sizeof(client));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+
+        c->fd = fd;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            close(fd);
+            free(c);
+        }
+    }
+}
+
+static void client_close(client *c)
+{
+    close(c->fd);               // removed from epoll with it.
+    free(c);
+}
+
+/* Parses request of len bytes in c->req and prepares response to it,
+ * returns false if it is malformed.
+ */
+static bool request_parse(client *c, int len)
+{
+    char *line = c->req;
+    bool  head = strncmp(line, "HEAD ", 5) == 0;
+    if (!head && strncmp(line, "GET ", 4) != 0)
+        return false;
+
+    bool     ranged = false;
+    uint64_t start  = 0;
+    uint64_t last   = g_size - 1;
+
+    c->close = strstr(line, " HTTP/1.0\r\n") != NULL;
+    for (char *p = strstr(line, "\r\n"); p && p < c->req + len;
+         p = strstr(p, "\r\n")) {
+        p += 2;
+        if (!strncasecmp(p, "Range: bytes=", 13)) {
+            char *e = NULL;
+            start = strtoull(p + 13, &e, 10);
+            if (*e != '-')
+                return false;
+            if (e[1] >= '0' && e[1] <= '9')
+                last = strtoull(e + 1, NULL, 10);
+            if (last >= g_size)
+                last = g_size - 1;
+            ranged = true;
+        } else if (!strncasecmp(p, "Connection: close", 17)) {
+            c->close = true;
+        }
+    }
+
+    if (ranged && start > last) {
+        c->hlen = snprintf(c->hdr, sizeof(c->hdr),
+                           "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                           "Content-Range: bytes */%llu\r\n"
+                           "Content-Length: 0\r\n\r\n",
+                           (unsigned long long) g_size);
+        c->pos = c->end = 0;
+    } else if (ranged) {
+        c->hlen = snprintf(c->hdr, sizeof(c->hdr),
+                           "HTTP/1.1 206 Partial Content\r\n"
+                           "Accept-Ranges: bytes\r\n"
+                           "Content-Range: bytes %llu-%llu/%llu\r\n"
+                           "Content-Length: %llu\r\n\r\n",
+                           (unsigned long long) start,
+                           (unsigned long long) last,
+                           (unsigned long long) g_size,
+                           (unsigned long long) (last - start + 1));
+        c->pos = start;
+        c->end = last + 1;
+    } else {
+        c->hlen = snprintf(c->hdr, sizeof(c->hdr),
+                           "HTTP/1.1 200 OK\r\n"
+                           "Accept-Ranges: bytes\r\n"
+                           "Content-Length: %llu\r\n\r\n",
+                           (unsigned long long) g_size);
+        c->pos = 0;
+        c->end = g_size;
+    }
+
+    if (head)
+        c->pos = c->end;
+    c->hoff = 0;
+    return true;
+}
+
+static void client_read(client *c)
+{
+    int rd = recv(c->fd, c->req + c->rlen, MAX_REQUEST - 1 - c->rlen, 0);
+    if (rd == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (rd <= 0) {
+        client_close(c);
+        return;
+    }
+
+    c->rlen += rd;
+    c->req[c->rlen] = '\0';
+    char *end = strstr(c->req, "\r\n\r\n");
+    if (!end) {
+        if (c->rlen == MAX_REQUEST - 1)
+            client_close(c);
+        return;
+    }
+
+    int len = (int) (end + 4 - c->req);
+    if (!request_parse(c, len)) {
+        client_close(c);
+        return;
+    }
+
+    c->rlen = 0;                // requests are not pipelined by mget.
+    client_write(c);
+}
+
+/* Sends response until socket is full, then waits for it to drain. */
+static void client_write(client *c)
+{
+    while (c->hoff < c->hlen) {
+        int wr = send(c->fd, c->hdr + c->hoff, c->hlen - c->hoff,
+                      MSG_NOSIGNAL);
+        if (wr == -1 && errno == EINTR)
+            continue;
+        if (wr == -1 && errno == EAGAIN)
+            goto wait;
+        if (wr <= 0)
+            goto err;
+        c->hoff += wr;
+    }
+
+    while (c->pos < c->end) {
+        uint64_t off = c->pos % BLOCK_SIZE;
+        uint64_t len = BLOCK_SIZE - off;
+        if (len > c->end - c->pos)
+            len = c->end - c->pos;
+        ssize_t wr = send(c->fd, g_block + off, len, MSG_NOSIGNAL);
+        if (wr == -1 && errno == EINTR)
+            continue;
+        if (wr == -1 && errno == EAGAIN)
+            goto wait;
+        if (wr <= 0)
+            goto err;
+        c->pos += wr;
+    }
+
+    if (c->close)
+        goto err;
+    c->hlen = 0;
+    client_watch(c, EPOLLIN);
+    return;
+
+wait:
+    client_watch(c, EPOLLOUT);
+    return;
+
+err:
+    client_close(c);
+}
+
+int main(int argc, char *argv[])
+{
+    int port = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:s:h")) != -1) {
+        switch (opt) {
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 's':
+                g_size = strtoull(optarg, NULL, 10) << 20;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (!g_size)
+        usage(argv[0]);
+
+    for (int i = 0; i < BLOCK_SIZE; ++i)
+        g_block[i] = (char) (i * 7 + (i >> 12));
+
+    signal(SIGPIPE, SIG_IGN);
+    int lfd = listen_on(port);
+    if (lfd == -1 || (g_epfd = epoll_create1(0)) == -1) {
+        perror("range_server");
+        return 1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;         // listening socket.
+    epoll_ctl(g_epfd, EPOLL_CTL_ADD, lfd, &ev);
+
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        int n = epoll_wait(g_epfd, events, MAX_EVENTS, -1);
+        if (n == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            return 1;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            client *c = (client *) events[i].data.ptr;
+            if (!c)
+                client_accept(lfd);
+            else if (events[i].events & (EPOLLERR | EPOLLHUP))
+                client_close(c);
+            else if (c->hlen)
+                client_write(c);
+            else
+                client_read(c);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Editor modelines
+ *
+ * Local Variables:
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * fill-column: 78
+ * End:
+ *
+ * vim: set noet ts=4 sw=4:
+ */
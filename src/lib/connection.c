@@ -27,17 +27,38 @@
 #include "data_utlis.h"
 #include "mget_config.h"
 #include "mget_types.h"
+#include "coordinator.h"
+#include "dns_cache.h"
 #include "fileutils.h"
+#include "resolver.h"
+#include "scavenger.h"
+#include "source_addr.h"
+#include "spread.h"
+#include "timer_wheel.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#include <poll.h>
+#endif
+
 #ifdef SSL_SUPPORT
 #include "plugin/ssl/ssl.h"
 #endif
@@ -46,20 +67,10 @@ typedef struct addrinfo address;
 
 typedef enum _connection_feature {
     sf_keep_alive = 1,
+    sf_nowait_read = 1 << 1,    // read() can be issued without waiting.
+    sf_ktls = 1 << 2,           // TLS records are decrypted by kernel.
 } connection_feature;
 
-typedef struct _addr_entry {
-    int size;                   /* total size of this entry... */
-    address *addr;              /* addrinfo pointer. */
-
-    int ai_family;              /* Protocol family for socket.  */
-    int ai_socktype;            /* Socket type.  */
-    int ai_protocol;            /* Protocol for socket.  */
-
-    socklen_t ai_addrlen;       /* Length of socket address.  */
-    char buffer[0];             /* Buffer of sockaddr.  */
-} addr_entry;
-
 typedef enum _expected_operation
 {
     eow = 1,
@@ -68,100 +79,321 @@ typedef enum _expected_operation
 } expected_operation;
 
 
+typedef struct _pool_link {
+    struct _pool_link *prev;
+    struct _pool_link *next;
+} pool_link;
+
+// What connection is waiting for, each phase has its own timeout.
+typedef enum _timeout_phase {
+    tp_none = 0,                // not timed: idle in pool, or resolving.
+    tp_connect,                 // TCP connect and TLS handshake.
+    tp_first_byte,              // request sent, waiting for response.
+    tp_idle,                    // receiving, waiting for more data.
+} timeout_phase;
+
 typedef struct _connection_p {
     connection conn;
-    connection_operations rco;  // real operators..
-    slist_head lst;
+    // Hot: looked at for each member by every iteration of event loops.
     int sock;
-    int port;
-    char *host;
-    address *addr;
-    void *priv;
-    bool connected;
     bool active;
+    bool connected;
     bool busy;
+    bool throttled;             // bandwidth used up, removed from read set.
+    bool resolved;              // host was resolved asynchronously.
+    bool connecting;            // non-blocking connect is in progress.
+    bool handshaking;           // TLS handshake is in progress.
+    bool parked;                // TLS handshake waits for session of others.
+    bool queued;                // waits for a slot of shared budget.
+    int hs_wait;                // WT_READ/WT_WRITE, waited by handshake.
+    int io_wait;                // WT_READ/WT_WRITE TLS waits for to go on.
     expected_operation expt;
-    int last_access;            // last connected..
+    uint32 features;            // refer to connection_feature
+    dns_waiter *waiter;         // not NULL if host is being resolved.
+    void *priv;
+
+    // Cold: used when connection makes progress, or by options.
+    connection_operations rco;  // real operators..
+    int port;
+    char *host;
+    address *addr;
+    bool promote;               // put addr first in dns cache once connected.
+    bool tls_waited;            // was parked, won't be parked again.
+    bool early_data;            // first request may be sent as early data.
+    bool fastopen;              // connect deferred to first write by TFO.
+    address *he;                // addresses to try if connect fails.
+    int slot;                   // slot of shared budget, 0 if none.
+    url_protocol eprotocol;
+    timeout_phase phase;
+    uint64 phase_since;         // when current phase started, in ms.
+    timer_node timer;           // current phase times out at its deadline.
+    uint64 tm_bytes;            // received in current throughput sample.
+    uint64 tm_since;            // when current throughput sample started.
+    struct _token_bucket *bucket;   // per-host bandwidth limit.
+    struct _connection_group *group;
+    struct _pool_host *phost;   // interned host, NULL if name is too long.
+    pool_link hlink;            // link in idle list of phost.
+    pool_link llink;            // link in global LRU list of idle ones.
+    uint32 idle_since;          // when it was put into pool, in ms.
+    spread_ref spread;          // where it is, in spread mode.
+    source_addr *source;        // local address it is bound to.
+    char *zc_map;               // mapping of socket for zero-copy receive.
+    char *zc_base;              // mapping of file that reads go into,
+    int zc_fd;                  // and the file, written from zc_map.
+    uint64 zc_mapped;           // received by mapping pages of socket.
+    uint64 zc_copied;           // received by copying, zero-copy enabled.
+    uint32 scav_at;             // when its rtt was sampled by scavenger.
+    uint64 rx_bytes;            // received in current BDP sample.
+    uint32 rx_since;            // when current BDP sample started, in ms.
+    int rcvbuf;                 // receive buffer set from BDP, 0 if not.
 } connection_p;
 
+/* Members of a group are kept in an array: event loops walk it several times
+ * per iteration, finished members are moved behind live ones so that only
+ * live ones are walked. Finished ones are still members, they are put back
+ * into pool when group is destroyed.
+ */
 struct _connection_group {
     int cnt;                    // count of sockets.
+    int live;                   // members[0, live) are not finished.
+    int cap;                    // capacity of members.
     bool *cflag;                // control flag.
     uint32 type;                // refer to cgtype
-    slist_head *lst;            // list of sockets.
+    connection_p **members;
+    timer_wheel *wheel;         // deadlines of connections.
 };
 
-typedef struct _connection_cache {
-    int count;
-    slist_head *lst;
-} ccache;
+#define GROUP_MIN_CAP   16
 
-
+#define GROUP_FOREACH(I, G)   for (int I = 0; I < (G)->live; I++)
 
+/* Keep-alive pool: hosts are interned into pool_host once and connections
+ * remember their host, so that getting or putting a connection does not need
+ * to build a key. Idle connections are linked into the list of their host
+ * (most recently used first) and into a global LRU list, they are closed
+ * when idle for too long, or to make room for newer ones.
+ *
+ * Hosts also keep round trip time, response time and throughput measured by
+ * their connections, timeouts of connections are derived from them.
+ */
+typedef struct _pool_host {
+    uint32 id;
+    char *host;
+    int port;
+    int idle;                   // number of idle connections.
+    pool_link conns;            // idle connections of this host.
+    uint32 srtt;                // smoothed rtt in us, 0 if not measured.
+    uint32 rttvar;              // variation of rtt, in us.
+    uint32 ttfb;                // smoothed time to first byte, in ms.
+    uint64 rate;                // smoothed throughput of a connection.
+    uint64 tls_lead_until;      // full TLS handshake is in flight until, ms.
+    bool tls_no_resume;         // no TLS session got from it to wait for.
+} pool_host;
+
+#define TMO_RTO_INIT        1000    // rto of hosts not measured, in ms.
+#define TMO_RTO_MIN         200     // in ms, as TCP.
+#define TMO_FACTOR          4       // timeout is that times of expected.
+#define TMO_IDLE_BYTES      (16 * K) // bytes expected between two reads.
+#define TMO_MIN_MS          3000
+#define TMO_MAX_MS          60000
+#define TMO_SAMPLE_MS       1000    // interval to sample throughput.
 
-#define ALLOC_ADDR_ENTRY(X)                         \
-    (addr_entry*)XALLOC(sizeof(addr_entry) + (X))
+
 
-#ifdef DEBUG
-#define OUT_ADDR(X) fprintf(stderr, "entry->" #X ": %d\n", entry->ai_##X)
-#else
-#define OUT_ADDR(X)
-#endif
 
 
 #define print_address(X)   inet_ntoa ((X)->data.d4)
 
 #define CONN2CONNP(X) (connection_p*)(X)
-#define LIST2PCONN(X) (connection_p*)((char*)X - offsetof(connection_p, lst))
+#define CONN_PENDING(X) ((X)->connecting || (X)->handshaking)
+#define CONN_WAITING(X) ((X)->waiter || (X)->queued)    // no socket yet.
+#define HLINK2PCONN(X) (connection_p*)((char*)X - offsetof(connection_p, hlink))
+#define LLINK2PCONN(X) (connection_p*)((char*)X - offsetof(connection_p, llink))
+#define TLINK2PCONN(X) (connection_p*)((char*)X - offsetof(connection_p, timer))
 
 
 #define TIME_OUT      5
 
-#define MAX_CONNS_PER_HOST  32
+#define POOL_PER_HOST       32  // default max idle connections of a host.
+#define POOL_IDLE_TIMEOUT   30  // default seconds to keep idle connections.
+#define POOL_MAX_IDLE       128 // max idle connections of all hosts.
+
+// Max number of reads issued for one connection per wakeup, so a fast
+// connection won't starve others.
+#define MAX_DRAIN_READS     16
+
 host_cache_type g_hct = HC_DEFAULT;
-static hash_table *g_conn_cache = NULL;
+io_engine g_engine = IE_DEFAULT;
+static hash_table *g_pool_hosts = NULL;  // host:port -> pool_host.
+static pool_link g_pool_lru = { &g_pool_lru, &g_pool_lru }; // newest first.
+static int g_pool_idle = 0;     // number of idle connections in pool.
+static uint32 g_pool_ids = 0;
+static int pool_per_host = POOL_PER_HOST;
+static int pool_idle_timeout = POOL_IDLE_TIMEOUT;
+static pool_stats g_pool_stats;
+static io_stats g_io_stats;
+static bool g_io_report = false; // report syscalls per MB at cleanup.
 static byte_queue *dq = NULL;   // drop queue
-static hash_table *addr_cache = NULL;
+static bool addr_cache = false;  // dns cache is opened.
+static uint32 dns_entries = 0;  // size of dns cache, 0 means default.
+static uint32 dns_ttl = 0;
+static struct sockaddr_un g_unix;   // all hosts are reached through it,
+static socklen_t g_unix_len = 0;    // if length is not 0.
+static bool g_fastopen = false;  // TCP Fast Open.
+static uint32 g_tfo_data = 0;   // connections that sent data in SYN.
+static uint32 g_tfo_fallback = 0;   // deferred, but fell back.
+static bool g_zerocopy = false;  // TCP zero-copy receive.
+static uint64 g_zc_mapped = 0;  // sum of zc_mapped of closed connections.
+static uint64 g_zc_copied = 0;
+
+// Size of socket mapped for zero-copy receive, reads smaller than
+// ZEROCOPY_MIN are copied: remapping costs more than copying then.
+#define ZEROCOPY_MAP_SIZE   (2 * M)
+#define ZEROCOPY_MIN        (64 * K)
+
+
+/* Options applied to sockets before they are connected, filled by
+ * set_socket_tuning() from profile.
+ */
+typedef struct _sock_tuning {
+    bool nodelay;               // don't delay requests (Nagle).
+    bool measure;               // size receive buffer from measured BDP.
+    int rcvbuf;                 // fixed receive buffer, 0: autotuned.
+    int keepalive;              // idle seconds before probes, 0: disabled.
+    char congestion[16];        // congestion control, empty for default.
+} sock_tuning;
+
+#define TUNE_KEEPALIVE      60  // default seconds idle before probes.
+#define TUNE_KEEPCNT        4   // unanswered probes before dropping.
+#define TUNE_SAMPLE_MS      1000    // interval to measure BDP.
+#define TUNE_RCVBUF_MAX     (64 * M)
+
+static sock_tuning g_tuning = { true, false, 0, TUNE_KEEPALIVE, "" };
+static int rcvbuf_hint = 0;     // largest receive buffer set from BDP.
+
+#define SAVE_BUF_SIZE   (256 * K)   // buffer of save_to_fd, if not spliced.
+#define SAVE_PIPE_SIZE  (1 * M)     // size of pipe used by splice.
+
+static char *save_buf = NULL;
+#ifdef HAVE_SPLICE
+static int splice_pipe[2] = { -1, -1 };
+static int splice_pipe_size = 0;
+static bool splice_disabled = false;    // not supported by sockets.
+static bool splice_copy = false;        // not supported by output file.
+#endif
+
 
-static int bw_limit = -1;       // band-width limit.
+/* Token bucket of bandwidth limiter: tokens are bytes, refilled at rate
+ * bytes per second. Tokens may go negative if more data was read than
+ * allowed, following reads are delayed until the debt is paid.
+ */
+typedef struct _token_bucket {
+    int64 rate;                 // bytes per second, 0 means unlimited.
+    int64 tokens;
+    uint32 last;                // last refilled, in ms.
+} token_bucket;
+
+#define BW_TICK_MS      50      // interval to recheck throttled connections.
+#define TLS_PARK_TICK_MS   20   // interval to recheck parked connections.
+#define BW_MIN_READ     (4 * K) // smallest read when bandwidth is shared.
+
+static token_bucket g_bucket;   // global bandwidth limit.
+
+static int64 host_limit = 0;    // per-host bandwidth limit.
+static hash_table *g_host_buckets = NULL;
+static int wake_fd = -1;        // eventfd used to wake up event loop.
+static int resolver_tag;        // marks resolver fd in epoll events.
+static int tls_parked = 0;      // number of parked connections.
+static int coord_queued = 0;    // connections waiting for slots.
+static bool coord_opened = false;
+static int shared_conns = 0;    // caps of all processes, 0: no cap.
+static int64 shared_limit = 0;
+
+#define COORD_TICK_MS   100     // interval to recheck queued connections.
+#define COORD_WAIT_MS   300000  // max time to wait for a slot, if blocking.
 
 
 /* Address entry related. */
-static address *addrentry_to_address(addr_entry * entry);
-static addr_entry *address_to_addrentry(address * addr);
-static void addr_entry_destroy(void *entry);
+static address *record_to_address(const dns_record * rec);
+static void addr_cache_update(const char *host, int port, address * infos,
+                              address * winner);
+static address *address_dup(const address * rp);
+static void address_free(address * addr);
+static address *address_make(const struct sockaddr *sa, socklen_t len);
+static void connection_setup(connection_p * conn, bool async);
+static int connect_resolved(const char *host, int port, address * infos,
+                            address ** winner);
+static bool connect_next(connection_p * conn);
+static int connection_establish(connection_p * pconn);
+static void connection_resolved(struct addrinfo *infos, int err,
+                                void *user_data);
+static address *spread_addresses(connection_p * conn, const char *host,
+                                 int port);
+static bool spread_balance(connection_p * conn);
+static void account_recv(connection_p * conn, int size);
+static void socket_tune(int sock);
+static void timer_set(connection_p * conn, timeout_phase phase);
+static void timer_cancel(connection_p * conn);
+static void tls_forget(connection_p * conn);
 
 /* Generic socket operations */
 
-static int connection_save_to_fd(connection *conn, int out);
+static int connection_save_to_fd(connection *conn, int out, uint32 size);
 
 /* tcp socket operations */
 static int tcp_connection_read(connection * conn, char *buf,
                                uint32 size, void *priv);
+static int tcp_connection_save_to_fd(connection * conn, int out,
+                                     uint32 size);
 static int tcp_connection_write(connection * conn, const char *buf,
                                 uint32 size, void *priv);
+#ifdef TCP_ZEROCOPY_RECEIVE
+static int zerocopy_connection_read(connection * conn, char *buf,
+                                    uint32 size, void *priv);
+static void zerocopy_write(connection_p * conn, char *buf, uint32 len);
+#endif
+static void zerocopy_unmap(connection_p * conn);
 
 // TODO: Remove this ifdef!
 #if 0
 static void tcp_connection_close(connection * conn, char *buf,
                                  uint32 size, void *priv);
 #endif // End of #if 0
-static bool validate_connection(connection_p * pconn);
+static bool connection_alive(connection_p * pconn);
 
 #ifdef SSL_SUPPORT
 static int secure_connection_read(connection * conn, char *buf,
                                   uint32 size, void *priv);
 static int secure_connection_write(connection * conn, const char *buf,
                                    uint32 size, void *priv);
+static int ktls_connection_read(connection * conn, char *buf,
+                                uint32 size, void *priv);
+static void secure_connection_close(connection * conn, void *priv);
+static void secure_setup(connection_p * pconn);
 #endif
 
 static int mget_connection_read(connection * conn, char *buf,
                                 uint32 size, void *priv);
 static int mget_connection_write(connection * conn, const char *buf,
                                  uint32 size, void *priv);
+static int mget_connection_save_to_fd(connection * conn, int out,
+                                      uint32 size);
 static void limit_bandwidth(connection_p * conn, int size);
+static bool bandwidth_ready(connection_p * pconn);
+static int64 bandwidth_quota(connection_p * pconn);
+static token_bucket *host_bucket(const char *host, int port);
+static int coord_slot_get(const char *host, int port, bool async);
+static int coord_dispatch(connection_group * group, bool * started);
+#define bandwidth_limited()   (g_bucket.rate || host_limit || \
+                               scavenger_limited() || coord_limited())
 
 static int do_perform_select(connection_group * group);
+#ifdef HAVE_EPOLL
+static int do_perform_epoll(connection_group * group);
+#endif
+#ifdef HAVE_IO_URING
+static int do_perform_uring(connection_group * group);
+#endif
 
 static int connect_to(int ai_family, int ai_socktype,
                       int ai_protocol,
@@ -171,629 +403,2834 @@ static int connect_to(int ai_family, int ai_socktype,
 static bool try_connect(int sock, const struct sockaddr *addr,
                         socklen_t addrlen, int timeout);
 
-static char *get_host_key(const char *host, int port);
 
-static int create_nonblocking_socket();
+static int create_nonblocking_socket(int family);
+
+static int unix_connect();
 
 
 static void connection_destroy(void* conn)
 {
     PDEBUG("cleaning connetion: %p\n", conn);
     connection_p *pconn = (connection_p *) conn;
+    if (pconn->waiter)
+        resolver_cancel(pconn->waiter);
+    if (pconn->queued)
+        coord_queued--;
+    coord_release(pconn->slot);
+    tls_forget(pconn);
     if (pconn->rco.close)
         (*pconn->rco.close)(conn, pconn->priv);
+    zerocopy_unmap(pconn);      // it keeps socket open.
+    if (pconn->zc_mapped || pconn->zc_copied) {
+        mlog(VERBOSE, "Connection %p: %llu bytes received by mapping socket, "
+             "%llu copied.\n", pconn, (unsigned long long) pconn->zc_mapped,
+             (unsigned long long) pconn->zc_copied);
+        g_zc_mapped += pconn->zc_mapped;
+        g_zc_copied += pconn->zc_copied;
+    }
+    if (pconn->sock != -1)
+        close(pconn->sock);
 
+    spread_detach(&pconn->spread);
+    source_detach(&pconn->source);
     FIF(pconn->host);
-    if (pconn->addr)
-        FIF(pconn->addr->ai_addr);
-    FIF(pconn->addr);
+    address_free(pconn->addr);
+    address_free(pconn->he);
     FIF(pconn);
 }
 
-static void ccache_destroy(void* ptr)
+static void pool_host_destroy(void* ptr)
 {
-    if (!ptr)
-        return;
-
-    ccache* cache = (ccache*)ptr;
-    slist_head* p = cache->lst;
-    while (p) {
-        connection_p* pc = LIST2PCONN(p);
-        p = p->next;
-        connection_destroy(pc);
+    pool_host *ph = (pool_host *) ptr;
+    if (ph) {
+        FIF(ph->host);
+        FIF(ph);
     }
-
-    FIF(cache);
 }
 
-connection *connection_get(const url_info* ui, bool async)
+static inline void plink_add(pool_link* head, pool_link* l)
 {
-    PDEBUG ("Getting connection for  %s\n", url_info_stringify(ui));
-    connection_p *conn = NULL;
-    addr_entry *entry = NULL;
+    l->prev = head;
+    l->next = head->next;
+    head->next->prev = l;
+    head->next = l;
+}
 
-    if (!ui || (!ui->host && !ui->addr)) {
-        PDEBUG("invalid ui.\n");
-        goto ret;
-    }
+static inline void plink_del(pool_link* l)
+{
+    l->prev->next = l->next;
+    l->next->prev = l->prev;
+    l->prev = l->next = NULL;
+}
 
-    if (!dq) {                  // init this drop queue.
-        dq = bq_init(1024);
-    }
+/* Returns interned host of host:port, creates it if not exist yet. */
+static pool_host *pool_host_get(const char *host, int port)
+{
+    char key[320];
+    if (snprintf(key, sizeof(key), "%s:%d", host, port) >= (int) sizeof(key))
+        return NULL;
 
-    if (!g_conn_cache) {
-        g_conn_cache = hash_table_create(64, ccache_destroy);
-        assert(g_conn_cache);
+    if (!g_pool_hosts) {
+        g_pool_hosts = hash_table_create(64, pool_host_destroy);
+        assert(g_pool_hosts);
     }
 
-    if (ui->addr) {
-        conn = ZALLOC1(connection_p);
-        struct sockaddr_in sa;
-        bzero(&sa, sizeof sa);
-        sa.sin_family = AF_INET;
-        sa.sin_port = htons(ui->port);
-        sa.sin_addr = ui->addr->data.d4;
-        PDEBUG("trying to connect to %s port %u\n",
-               print_address(ui->addr), ui->port);
-        conn->sock = connect_to(AF_INET, SOCK_STREAM, 0,
-                                (struct sockaddr *) &sa, sizeof sa,
-                                async ? 0 : TIME_OUT);
-        if (conn->sock == -1) {
-            perror("connect");
-            close(conn->sock);
-            goto err;
-        }
-    } else {
-        char *host_key = get_host_key(ui->host, ui->port);
-        if (!host_key) {
-            goto alloc;
-        }
-
-        ccache *cache = HASH_ENTRY_GET(ccache, g_conn_cache, host_key);
-        FIF(host_key);
-        PDEBUG("cache: %p, count: %d, lst: %p\n", cache,
-               cache ? cache->count : 0, cache ? cache->lst : NULL);
-
-        if (cache && cache->count && cache->lst) {
-            conn = LIST2PCONN(cache->lst);
-            cache->lst = cache->lst->next;
-            cache->count--;
-            conn->lst.next = NULL;
-            if (!validate_connection(conn)) {
-                goto connect;
-            }
-            PDEBUG("\nRusing connection: %p\n", conn);
-            goto post_connected;
-        }
-
-  alloc:
-        conn = ZALLOC1(connection_p);
-        static shm_region *shm_rptr = NULL;
-        if (!addr_cache) {
-            if (g_hct == HC_BYPASS)
-                goto alloc_addr_cache;
-
-            char key[64] = { '\0' };
-            sprintf(key, "/libmget_%s_uid_%d", VERSION_STRING, getuid());
-            shm_rptr = shm_region_open(key);
-            if (shm_rptr)
-                addr_cache = hash_table_create_from_buffer(shm_rptr->buf, SHM_LENGTH);
-            if (!addr_cache) {
-          alloc_addr_cache:;
-                addr_cache = hash_table_create(64, addr_entry_destroy);
-                assert(addr_cache);
-            }
-        }
-
-        if (g_hct == HC_DEFAULT) {
-            char *key = get_host_key(ui->host, ui->port);
-            entry = GET_HASH_ENTRY(addr_entry, addr_cache, key);
-            FIF(key);
+    pool_host *ph = HASH_ENTRY_GET(pool_host, g_pool_hosts, key);
+    if (!ph) {
+        ph = ZALLOC1(pool_host);
+        ph->id   = ++g_pool_ids;
+        ph->host = strdup(host);
+        ph->port = port;
+        ph->conns.prev = ph->conns.next = &ph->conns;
+        if (!HASH_TABLE_INSERT(g_pool_hosts, key, ph, sizeof(void *))) {
+            pool_host_destroy(ph);
+            return NULL;
         }
+        PDEBUG("interned host #%u: %s\n", ph->id, key);
+    }
 
-        if (entry) {
-            mlog(QUIET, "Using cached address...\n");
-            conn->addr = addrentry_to_address(entry);
-      connect:
-            PDEBUG("Connecting to: %s:%d\n", ui->host, ui->port);
-
-            conn->sock = connect_to(conn->addr->ai_family,
-                                    conn->addr->ai_socktype,
-                                    conn->addr->ai_protocol,
-                                    conn->addr->ai_addr,
-                                    conn->addr->ai_addrlen,
-                                    async ? 0 : TIME_OUT);
-            if (conn->sock == -1) {
-                perror("Failed to connect");
-                goto hint;
-            }
-        } else {
-            mlog(QUIET, "Can't find cached address..\n");
-      hint:;
-            address hints;
-
-            memset(&hints, 0, sizeof(hints));
-            hints.ai_family = AF_INET;  //AF_UNSPEC;
-            hints.ai_socktype = SOCK_STREAM;
-            hints.ai_flags = 0;
-            hints.ai_protocol = 0;
-            mlog(ALWAYS, "Resolving host: %s ...\n", ui->host);
-            struct addrinfo *infos = NULL;
-            int ret = getaddrinfo(ui->host, ui->sport, &hints, &infos);
-
-            PDEBUG(": ret = %d, error: %s\n", ret, strerror(errno));
-
-            if (ret)
-                goto err;
-            address *rp = NULL;
+    return ph;
+}
 
-            for (rp = infos; rp != NULL; rp = rp->ai_next) {
-                PDEBUG("Connecting to %s:%u\n", ui->host, ui->port);
-                conn->sock = connect_to(rp->ai_family, rp->ai_socktype,
-                                        rp->ai_protocol,
-                                        rp->ai_addr, rp->ai_addrlen,
-                                        TIME_OUT);
-                if (conn->sock != -1) {
-                    PDEBUG("Connected ...\n");
+/* Takes pconn out of pool. */
+static void pool_detach(connection_p* pconn)
+{
+    plink_del(&pconn->hlink);
+    plink_del(&pconn->llink);
+    pconn->phost->idle--;
+    g_pool_idle--;
+}
 
-                    conn->connected = true;
-                    break;
-                }
-                conn->sock = -1;
-                PDEBUG("rp: %p\n", rp->ai_next);
-            }
+static void pool_evict(connection_p* pconn)
+{
+    PDEBUG("evicting connection: %p of host #%u\n", pconn, pconn->phost->id);
+    pool_detach(pconn);
+    g_pool_stats.evicted++;
+    connection_destroy(pconn);
+}
 
-            if (rp != NULL) {
-                char *key = get_host_key(ui->host, ui->port);
-                entry = address_to_addrentry(rp);
-                conn->addr = entry->addr;
-                if (!hash_table_update(addr_cache, key, entry,
-                                       entry->size)) {
-                    addr_entry_destroy(entry);
-                    fprintf(stderr, "Failed to insert cache: %s\n",
-                            ui->host);
-                } else {
-                    // Only update cache to shm when it is not used by others.
-                    // This is just for optimization, and it does not hurt
-                    // much if one or two cache is missing...
-                    if (shm_rptr && !shm_rptr->busy && g_hct != HC_BYPASS) {
-                        shm_rptr->busy = true;
-                        shm_rptr->len = dump_hash_table(addr_cache,
-                                                        shm_rptr->buf,
-                                                        SHM_LENGTH);
-                        shm_rptr->busy = false;
-                    }
-                }
-                FIF(key);
-            } else {
-                goto err;
-            }
-        }
+/* Closes connections that have been idle for too long, oldest first. */
+static void pool_expire(uint32 now)
+{
+    while (g_pool_lru.prev != &g_pool_lru) {
+        connection_p *pconn = LLINK2PCONN(g_pool_lru.prev);
+        if (now - pconn->idle_since < (uint32) pool_idle_timeout * 1000)
+            break;
+        pool_evict(pconn);
     }
+}
 
-post_connected:;
-    if (conn) {
-        if (ui->host && !conn->host) {
-            conn->host = strdup(ui->host);
-        }
-
-        PDEBUG("sock(%d) %p connected to %s. \n", conn->sock, conn,
-               conn->host);
-
-        conn->connected   = true;
-        conn->port        = ui->port;
-        conn->active      = true;
-        conn->last_access = get_time_s();
-        switch (ui->eprotocol) {
-            case HTTPS: {
-                connection_make_secure(&conn->conn);
-                break;
-            }
-            default: {
-                conn->rco.write = tcp_connection_write;
-                conn->rco.read  = tcp_connection_read;
-                break;
-            }
+/* Returns most recently used idle connection of ph that is still alive. */
+static connection_p *pool_take(pool_host* ph)
+{
+    pool_expire((uint32) get_monotonic_ms());
+    while (ph->idle) {
+        connection_p *pconn = HLINK2PCONN(ph->conns.next);
+        pool_detach(pconn);
+        if (connection_alive(pconn)) {
+            g_pool_stats.hits++;
+            return pconn;
         }
-        conn->rco.save_to_fd = connection_save_to_fd;
-        conn->conn.co.write  = mget_connection_write;
-        conn->conn.co.read   = mget_connection_read;
 
-        PDEBUG ("C: %p, P: %p, W: %p, R: %p\n",
-                conn,
-                &conn->rco,conn->rco.write, conn->rco.read);
-        goto ret;
+        PDEBUG("connection %p was closed by peer.\n", pconn);
+        g_pool_stats.stale++;
+        connection_destroy(pconn);
     }
 
-err:
-    fprintf(stderr, "Failed to get proper host address for: %s\n",
-            ui->host);
-    FIF(entry);
-    FIF(conn->host);
-    FIF(conn);
-    conn = NULL;
-ret:
-    PDEBUG("return connection: %p\n", conn);
-    if (conn)
-        conn->expt = eo_all;
-
-    return (connection *) conn;
+    g_pool_stats.misses++;
+    return NULL;
 }
 
-void connection_put(connection * conn)
+/* Moves idle connection src taken from pool into dst, which has no socket
+ * yet: dst keeps callbacks set by protocol and its place in group and in
+ * shared budget, src is freed.
+ */
+static void pool_adopt(connection_p* dst, connection_p* src)
 {
-    if (!conn)
-        return;
-
-    connection_p *pconn = (connection_p *) conn;
-    if (!pconn->host) {
-        goto clean;
-    }
-    pconn->lst.next = NULL;
+    connection pub = dst->conn;
+    struct _connection_group *group = dst->group;
+    int slot = dst->slot;
+
+    FIF(dst->host);
+    *dst = *src;
+    dst->conn  = pub;
+    dst->group = group;
+    dst->slot  = slot;
+    FIF(src);
+}
 
-    char *host_key = NULL;
-    int ret = asprintf(&host_key, "%s:%d", pconn->host, pconn->port);
-    if (!ret) {
-        goto clean;
+static void pool_flush()
+{
+    while (g_pool_lru.next != &g_pool_lru) {
+        connection_p *pconn = LLINK2PCONN(g_pool_lru.next);
+        pool_detach(pconn);
+        connection_destroy(pconn);
     }
+}
 
-    ccache *cache = HASH_ENTRY_GET(ccache, g_conn_cache, host_key);
-    if (!cache) {
-        cache = ZALLOC1(ccache);
-        PDEBUG("allocating new ccahe: %p\n", cache);
+/* Returns retransmission timeout of host in ms, computed as TCP does. */
+static uint64 host_rto(const pool_host* ph)
+{
+    if (!ph || !ph->srtt)
+        return TMO_RTO_INIT;
+    return MAX((ph->srtt + 4 * (uint64) ph->rttvar) / 1000, TMO_RTO_MIN);
+}
 
-        cache->count++;
-        cache->lst = &pconn->lst;
+static void host_update_rtt(pool_host* ph, uint32 rtt, uint32 var)
+{
+    if (!ph || !rtt)
+        return;
 
-        HASH_TABLE_INSERT(g_conn_cache, host_key, cache, sizeof(void *));
-    } else if (cache->count >= MAX_CONNS_PER_HOST) {
-        goto clean;
+    if (!ph->srtt) {
+        ph->srtt = rtt;
+        ph->rttvar = var;
     } else {
-        cache->count++;
-        PDEBUG("increasing: %d\n", cache->count);
-        pconn->lst.next = cache->lst;
-        cache->lst = &pconn->lst;
+        ph->srtt = (ph->srtt * 7 + rtt) / 8;
+        ph->rttvar = (ph->rttvar * 3 + var) / 4;
     }
-
-    FIF(host_key);
-    PDEBUG("return with connection put to cache\n");
-
-    return;
-
-    //@todo: convert this conn_p to connection_p_list and cache it.
-clean:
-    connection_destroy(conn);
-    PDEBUG("leave with connection cleared...\n");
 }
 
-
-int connection_perform(connection_group * group)
+/* Feeds rtt of conn into its host, as measured by kernel if possible, or by
+ * time spent on connect.
+ */
+static void host_sample_rtt(connection_p* conn)
 {
-    PDEBUG("enter, sg: %p\n", group);
-    if (!group || !group->cnt)
-        return -1;
-
-    return do_perform_select(group);
+#ifdef TCP_INFO
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    XZERO(ti);
+    if (!getsockopt(conn->sock, IPPROTO_TCP, TCP_INFO, &ti, &len))
+        host_update_rtt(conn->phost, ti.tcpi_rtt, ti.tcpi_rttvar);
+#else
+    if (conn->phase == tp_connect) {
+        uint64 rtt = (get_monotonic_ms() - conn->phase_since) * 1000;
+        host_update_rtt(conn->phost, (uint32) rtt, (uint32) rtt / 2);
+    }
+#endif
 }
 
-
-connection_group *connection_group_create(uint32 type, bool * flag)
+/* Returns true if connect of sock is deferred by TCP Fast Open: SYN is sent
+ * along with first write, and socket is writable before that.
+ */
+static bool fastopen_deferred(int sock)
 {
-    connection_group *group = ZALLOC1(connection_group);
-
-    group->cflag = flag;
-    group->type = type;
-
-    return group;
+#if defined(TCP_FASTOPEN_CONNECT) && defined(TCP_INFO)
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    return g_fastopen &&
+        !getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &len) &&
+        ti.tcpi_state == TCP_SYN_SENT;
+#else
+    return false;
+#endif
 }
 
-void connection_group_destroy(connection_group * group)
+/* Called when first data is received by connection whose connect was
+ * deferred: rtt can be sampled now, and whether server took data in SYN.
+ */
+static void fastopen_account(connection_p* conn)
 {
-    slist_head *g = group->lst;
-
-    while (g) {
-        slist_head *ng = g->next;
-        connection_p *pconn = LIST2PCONN(g);
-        connection_put((connection *) pconn);
-        g = ng;
-    }
+#if defined(TCP_FASTOPEN_CONNECT) && defined(TCP_INFO)
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    conn->fastopen = false;
+    if (getsockopt(conn->sock, IPPROTO_TCP, TCP_INFO, &ti, &len))
+        return;
 
-    FIF(group);
+    host_update_rtt(conn->phost, ti.tcpi_rtt, ti.tcpi_rttvar);
+    if (ti.tcpi_options & TCPI_OPT_SYN_DATA)
+        g_tfo_data++;
+    else
+        g_tfo_fallback++;
+#endif
 }
 
-void connection_add_to_group(connection_group * group, connection * conn)
+/* Feeds throughput of conn since its sample started into its host. */
+static void host_sample_rate(connection_p* conn, uint64 now)
 {
-    PDEBUG("enter with group: (%p), conn: (%p)\n", group, conn);
-    if (conn && group) {
-        group->cnt++;
-        connection_p *pconn = CONN2CONNP(conn);
-        PDEBUG("pconn->lst: %p\n", pconn->lst);
-
-        pconn->lst.next = group->lst;
-        group->lst = &pconn->lst;
-        PDEBUG("Socket: %p added to group: %p, current count: %d\n",
-               conn, group, group->cnt);
+    pool_host *ph = conn->phost;
+    uint64 elapsed = now - conn->tm_since;
+    if (ph && elapsed) {
+        uint64 rate = conn->tm_bytes * 1000 / elapsed;
+        ph->rate = ph->rate ? (ph->rate * 3 + rate) / 4 : MAX(rate, 1);
     }
+    conn->tm_since = now;
+    conn->tm_bytes = 0;
 }
 
-bool timed_wait(int sock, int type, int delay)
+/* Returns ms conn may spend in phase: a few times of what is expected from
+ * rtt, response time and throughput measured on its host.
+ */
+static uint64 phase_timeout(const connection_p* conn, timeout_phase phase)
 {
-    fd_set r, w, err;
-
-    FD_ZERO(&r);
-    FD_ZERO(&w);
-    FD_ZERO(&err);
-    FD_SET(sock, &err);
+    const pool_host *ph = conn->phost;
+    uint64 expected = host_rto(ph);
+    if (phase == tp_first_byte)
+        expected += ph && ph->ttfb ? ph->ttfb : TMO_RTO_INIT;
+    else if (phase == tp_idle && ph && ph->rate)
+        expected += TMO_IDLE_BYTES * 1000 / ph->rate;
+
+    return MIN(MAX(expected * TMO_FACTOR, TMO_MIN_MS), TMO_MAX_MS);
+}
 
-    if (type & WT_READ)
-        FD_SET(sock, &r);
+/* Called when receiving conn seems stalled: throughput of data it got since
+ * last sample may be too low for current deadline (it was not measured
+ * before, for example). Returns true if deadline is extended.
+ */
+static bool timer_resample(connection_p* conn, uint64 now)
+{
+    if (conn->phase != tp_idle || !conn->tm_bytes || !conn->tm_since)
+        return false;
 
-    if (type & WT_WRITE)
-        FD_SET(sock, &w);
+    uint64 old = phase_timeout(conn, tp_idle);
+    host_sample_rate(conn, now);
+    uint64 timeout = phase_timeout(conn, tp_idle);
+    if (timeout <= old)
+        return false;
 
-    struct timeval tv;
-    tv.tv_sec = delay;
-    tv.tv_usec = 0;
+    conn->timer.deadline += timeout - old;
+    return conn->timer.deadline > now;
+}
 
-    int ret = select(sock + 1, &r, &w, &err, delay == -1 ? NULL : &tv);
-    if (ret < 0) {
-        mlog(ALWAYS, "select fail: %s\n", strerror(errno));
-        return false;
-    } else if (!ret) {
-        mlog(ALWAYS, "Connection timed out...\n");
-        return false;
+/* Called when timer of conn reaches its slot: it is inserted again unless
+ * conn timed out.
+ */
+static timer_verdict timer_fire(timer_node* node, uint64 now)
+{
+    connection_p *conn = TLINK2PCONN(node);
+    if (conn->phase == tp_none || !conn->active)
+        return tv_drop;
+
+    if (conn->timer.deadline > now || timer_resample(conn, now))
+        return tv_requeue;
+    if (conn->throttled) {
+        // waiting for bandwidth, not for peer.
+        conn->timer.deadline = now + phase_timeout(conn, conn->phase);
+        return tv_requeue;
     }
+    return tv_expire;
+}
 
-    return true;
+/* Puts conn into wheel of its group, unless its slot is reached before its
+ * deadline already.
+ */
+static void timer_link(connection_p* conn)
+{
+    timer_wheel *tw = conn->group ? conn->group->wheel : NULL;
+    if (!tw || conn->phase == tp_none)
+        timer_cancel(conn);
+    else
+        timer_wheel_schedule(tw, &conn->timer);
 }
 
-void set_global_bandwidth(int limit)
+/* Starts phase of conn, and its deadline. */
+void timer_set(connection_p* conn, timeout_phase phase)
 {
-    if (limit > 1024) {
-        bw_limit = limit;
-    }
+    uint64 now = get_monotonic_ms();
+    conn->phase = phase;
+    conn->phase_since = now;
+    conn->timer.deadline = now + phase_timeout(conn, phase);
+    timer_link(conn);
 }
 
-
-// local functions
-address *addrentry_to_address(addr_entry * entry)
+void timer_cancel(connection_p* conn)
 {
-    address *addr = NULL;
-    if (entry && (addr = ZALLOC1(address))) {
-        addr->ai_family = entry->ai_family;
-        addr->ai_socktype = entry->ai_socktype;
-        addr->ai_protocol = entry->ai_protocol;
-        addr->ai_addrlen = entry->ai_addrlen;
-        addr->ai_addr = ZALLOC1(struct sockaddr);
+    timer_wheel_remove(conn->group ? conn->group->wheel : NULL, &conn->timer);
+}
 
-        memcpy(addr->ai_addr, entry->buffer, addr->ai_addrlen);
-        entry->addr = addr;
-    }
-    return addr;
+/* Returns a connection of group that timed out, NULL if none. */
+static connection_p *timer_expired(connection_group* group)
+{
+    static const char *phases[] = { "", "connect", "response", "receive" };
+    timer_node *node = timer_wheel_expired(group->wheel);
+    if (!node)
+        return NULL;
+
+    connection_p *conn = TLINK2PCONN(node);
+    mlog(VERBOSE, "Connection %p to %s timed out in %s after %llu ms.\n",
+         conn, conn->host, phases[conn->phase],
+         (unsigned long long) (get_monotonic_ms() - conn->phase_since));
+    return conn;
 }
 
-addr_entry *address_to_addrentry(address * addr)
+/* Updates deadline of conn and measurements of its host after size bytes
+ * are received.
+ */
+static void timeout_account(connection_p* conn, int size)
 {
-    addr_entry *entry = NULL;
-    if (addr && (entry = ALLOC_ADDR_ENTRY(addr->ai_addrlen))) {
-        entry->size = sizeof(*entry) + addr->ai_addrlen;
-        entry->ai_family = addr->ai_family;
-        entry->ai_socktype = addr->ai_socktype;
-        entry->ai_protocol = addr->ai_protocol;
-        entry->ai_addrlen = addr->ai_addrlen;
-        memcpy(entry->buffer, addr->ai_addr, addr->ai_addrlen);
+    if (!conn || size <= 0)
+        return;
+
+    uint64 now = get_monotonic_ms();
+    pool_host *ph = conn->phost;
+    if (conn->phase == tp_first_byte && ph) {
+        uint32 ttfb = (uint32) (now - conn->phase_since);
+        ph->ttfb = ph->ttfb ? (ph->ttfb * 7 + ttfb) / 8 : MAX(ttfb, 1);
+    }
 
-        OUT_ADDR(family);
-        OUT_ADDR(socktype);
-        OUT_ADDR(protocol);
-        OUT_BIN(entry->buffer, entry->ai_addrlen);
+    if (conn->phase != tp_idle) {
+        timer_set(conn, tp_idle);
+    } else {
+        conn->timer.deadline = now + phase_timeout(conn, tp_idle);
+        timer_link(conn);
+    }
 
-        // update entry->addr to itself.
-        void *ptr = addrentry_to_address(entry);
-        PDEBUG("ptr: %p -- %p\n", entry->addr, ptr);
+    if (!conn->tm_since) {
+        conn->tm_since = now;
+        conn->tm_bytes = 0;
     }
+    conn->tm_bytes += size;
 
-    return entry;
+    if (now - conn->tm_since >= TMO_SAMPLE_MS) {
+        host_sample_rate(conn, now);
+        host_sample_rtt(conn);
+    }
 }
 
-void addr_entry_destroy(void *entry)
+/* Connects conn to host: reuses an idle connection of host, connects to
+ * unix socket, or connects to addresses of host, which are resolved in
+ * background if async. Returns false if it fails. If it returns true,
+ * host is being resolved if conn->waiter is set, connection_setup() should
+ * be called otherwise. conn->eprotocol and conn->phost should be set.
+ */
+static bool connection_open(connection_p* conn, const char* host, int port,
+                            const char* sport, bool async)
 {
-    addr_entry *e = (addr_entry *) entry;
+    dns_record rec;
+    pool_host *ph = conn->phost;
+    connection_p *idle = NULL;
+    if (ph && pool_per_host && (idle = pool_take(ph))) {
+        PDEBUG("Reusing connection: %p of host #%u\n", idle, ph->id);
+        pool_adopt(conn, idle);
+        return true;
+    }
 
-    if (e) {
-        free(e);
+    if (g_unix_len) {
+        conn->sock = unix_connect();
+        if (conn->sock == -1)
+            return false;
+        conn->addr = address_make((struct sockaddr *) &g_unix, g_unix_len);
+        return true;
     }
-}
 
-int connection_save_to_fd(connection *conn, int out)
-{
-    if (!conn)
-        return COF_INVALID;
+    if (!addr_cache) {
+        // Private cache is used if host cache is bypassed, addresses
+        // resolved are still shared by connections of this process.
+        char key[64] = { '\0' };
+        sprintf(key, "/libmget_dns_%s_uid_%d", VERSION_STRING, getuid());
+        dns_cache_open(g_hct == HC_BYPASS ? NULL : key, dns_entries,
+                       dns_ttl);
+        addr_cache = true;
+    }
 
-    char buf[4096];
-    int s = conn->co.read(conn, buf, 4096, NULL);
-    if (s > 0) {
-        s = (int)write(out, buf, s);
+    if (g_hct == HC_DEFAULT && dns_cache_get(host, port, &rec)) {
+        mlog(QUIET, "Using cached address...\n");
+        conn->he = record_to_address(&rec);
+        spread_update(host, port, conn->he);
     }
 
-    return s;
-}
+    // In spread mode, the address with fewest connections comes first.
+    address *spread = spread_addresses(conn, host, port);
+    if (spread) {
+        address_free(conn->he);
+        conn->he = spread;
+    }
 
-int tcp_connection_read(connection * conn, char *buf,
-                        uint32 size, void *priv)
-{
-    int rd = COF_INVALID;
-    connection_p* pconn = (connection_p*) conn;
-    if (pconn && pconn->sock && buf) {
+    if (conn->he) {
+        PDEBUG("Connecting to: %s:%d\n", host, port);
 
-        // double check to ensure there are something to read.
-        if (!timed_wait(pconn->sock, WT_READ, -1)) {
-            mlog(ALWAYS, "Nothing to read: (%d):%s\n",
-                 errno, strerror(errno));
-            return 0;
+        // Addresses are tried one by one, the one worked last time
+        // (or the one picked by spread mode) comes first.
+        if (async) {
+            conn->promote = true;
+            if (!connect_next(conn)) {
+                perror("Failed to connect");
+                spread_detach(&conn->spread);
+                goto hint;
+            }
+        } else {
+            address *rp = NULL;
+            conn->sock = connect_resolved(host, port, conn->he, &rp);
+            if (!rp) {
+                address_free(conn->he);
+                conn->he = NULL;
+                spread_detach(&conn->spread);
+                goto hint;
+            }
+
+            dns_cache_promote(host, port, rp->ai_addr, rp->ai_addrlen);
+            conn->addr = address_dup(rp);
+            address_free(conn->he);
+            conn->he = NULL;
+        }
+    } else {
+        mlog(QUIET, "Can't find cached address..\n");
+  hint:;
+        // Resolve in background, connection_perform() starts connecting
+        // once address is known.
+        if (async && !conn->waiter) {
+            conn->sock        = -1;
+            if (!conn->host)
+                conn->host    = strdup(host);
+            conn->port        = port;
+            conn->active      = true;
+            conn->waiter      = resolver_lookup(host, sport, AF_UNSPEC,
+                                                connection_resolved, conn);
+            if (conn->waiter) {
+                mlog(VERBOSE, "Resolving host in background: %s ...\n",
+                     host);
+                return true;
+            }
         }
 
-        rd = read(pconn->sock, buf, size);
-        if (rd == -1) {
-            PDEBUG("rd: %d, sock: %d, errno: (%d) - %s\n",
-                   rd, pconn->sock, errno, strerror(errno));
-            if (errno == EAGAIN) {      // nothing to read, normal if non-blocking
-                rd = COF_AGAIN;
-            } else {
-                mlog(ALWAYS, "Read connection:"
-                     " %p returns -1, (%d): %s.\n",
-                     pconn, errno, strerror(errno));
-                rd = COF_FAILED;
+        address hints;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = 0;
+        hints.ai_protocol = 0;
+        mlog(ALWAYS, "Resolving host: %s ...\n", host);
+        struct addrinfo *infos = NULL;
+        int ret = getaddrinfo(host, sport, &hints, &infos);
+
+        PDEBUG(": ret = %d, error: %s\n", ret, strerror(errno));
+
+        if (ret)
+            return false;
+        address *rp = NULL;
+
+        PDEBUG("Connecting to %s:%u\n", host, port);
+        conn->sock = connect_resolved(host, port, infos, &rp);
+        if (rp != NULL) {
+            PDEBUG("Connected ...\n");
+            conn->connected = true;
+            conn->addr = address_dup(rp);
+            addr_cache_update(host, port, infos, rp);
+            spread_update(host, port, infos);
+            freeaddrinfo(infos);
+        } else {
+            freeaddrinfo(infos);
+            return false;
+        }
+    }
+    return true;
+}
+
+connection *connection_get(const url_info* ui, bool async)
+{
+    PDEBUG ("Getting connection for  %s\n", url_info_stringify(ui));
+    connection_p *conn = NULL;
+
+    if (!ui || (!ui->host && !ui->addr)) {
+        PDEBUG("invalid ui.\n");
+        goto ret;
+    }
+
+    if (!dq) {                  // init this drop queue.
+        dq = bq_init(1024);
+    }
+
+    if (ui->addr) {
+        conn = ZALLOC1(connection_p);
+        struct sockaddr_storage ss;
+        socklen_t len = sizeof(struct sockaddr_in);
+        bzero(&ss, sizeof ss);
+#ifdef ENABLE_IPV6
+        if (ui->addr->family == AF_INET6) {
+            struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *) &ss;
+            sa6->sin6_family = AF_INET6;
+            sa6->sin6_port = htons(ui->port);
+            sa6->sin6_addr = ui->addr->data.d6;
+            len = sizeof(*sa6);
+        } else
+#endif
+        {
+            struct sockaddr_in *sa = (struct sockaddr_in *) &ss;
+            sa->sin_family = AF_INET;
+            sa->sin_port = htons(ui->port);
+            sa->sin_addr = ui->addr->data.d4;
+            PDEBUG("trying to connect to %s port %u\n",
+                   print_address(ui->addr), ui->port);
+        }
+        conn->sock = connect_to(ss.ss_family, SOCK_STREAM, 0,
+                                (struct sockaddr *) &ss, len,
+                                async ? 0 : TIME_OUT);
+        if (conn->sock == -1) {
+            perror("connect");
+            close(conn->sock);
+            goto err;
+        }
+        conn->connecting = async;
+    } else {
+        pool_host *ph = pool_host_get(ui->host, ui->port);
+        int slot = coord_slot_get(ui->host, ui->port, async);
+        if (slot < 0 && async) {
+            // Started once a slot is freed by others, see coord_dispatch().
+            mlog(VERBOSE, "Waiting for a connection slot of %s ...\n",
+                 ui->host);
+            conn = ZALLOC1(connection_p);
+            conn->phost     = ph;
+            conn->sock      = -1;
+            conn->host      = strdup(ui->host);
+            conn->port      = ui->port;
+            conn->eprotocol = ui->eprotocol;
+            conn->active    = true;
+            conn->queued    = true;
+            coord_queued++;
+            goto ret;
+        } else if (slot < 0) {
+            goto err;
+        }
+
+        conn = ZALLOC1(connection_p);
+        conn->phost     = ph;
+        conn->slot      = slot;
+        conn->port      = ui->port;
+        conn->eprotocol = ui->eprotocol;
+        if (!connection_open(conn, ui->host, ui->port, ui->sport, async))
+            goto err;
+        if (conn->waiter)
+            goto ret;
+    }
+
+    if (conn) {
+        if (ui->host && !conn->host) {
+            conn->host = strdup(ui->host);
+        }
+
+        PDEBUG("sock(%d) %p connected to %s. \n", conn->sock, conn,
+               conn->host);
+
+        conn->port      = ui->port;
+        conn->eprotocol = ui->eprotocol;
+        connection_setup(conn, async);
+        goto ret;
+    }
+
+err:
+    fprintf(stderr, "Failed to get proper host address for: %s\n",
+            ui->host);
+    if (conn) {
+        spread_detach(&conn->spread);
+        coord_release(conn->slot);
+        FIF(conn->host);
+        FIF(conn);
+        conn = NULL;
+    }
+ret:
+    PDEBUG("return connection: %p\n", conn);
+    if (conn)
+        conn->expt = eo_all;
+
+    return (connection *) conn;
+}
+
+static void record_add(dns_record* rec, const address* rp)
+{
+    if (rec->naddr >= DNS_CACHE_ADDRS || rp->ai_socktype != SOCK_STREAM ||
+        rp->ai_addrlen > sizeof(rec->addrs[0].u))
+        return;
+
+    dns_addr *a = &rec->addrs[rec->naddr++];
+    a->family = rp->ai_family;
+    a->len    = rp->ai_addrlen;
+    memcpy(&a->u, rp->ai_addr, rp->ai_addrlen);
+}
+
+/* Puts resolved addresses of host into dns cache, winner (if known) comes
+ * first.
+ */
+static void addr_cache_update(const char* host, int port, address* infos,
+                              address* winner)
+{
+    dns_record rec;
+    rec.naddr = 0;
+    if (winner)
+        record_add(&rec, winner);
+    for (address *rp = infos; rp; rp = rp->ai_next) {
+        if (rp != winner)
+            record_add(&rec, rp);
+    }
+
+    dns_cache_put(host, port, &rec);
+}
+
+static address *address_make(const struct sockaddr* sa, socklen_t len)
+{
+    address *addr = ZALLOC1(address);
+    addr->ai_family   = sa->sa_family;
+    addr->ai_socktype = SOCK_STREAM;
+    addr->ai_addrlen  = len;
+    addr->ai_addr     = (struct sockaddr *) ZALLOC(char, len);
+    memcpy(addr->ai_addr, sa, len);
+    return addr;
+}
+
+/* Converts cached addresses into list of address, see address_free(). */
+static address *record_to_address(const dns_record* rec)
+{
+    address *head = NULL;
+    address **pp = &head;
+    for (int i = 0; i < rec->naddr; i++) {
+        *pp = address_make(&rec->addrs[i].u.sa, rec->addrs[i].len);
+        pp = &(*pp)->ai_next;
+    }
+    return head;
+}
+
+#define HE_ATTEMPT_DELAY   250  // ms, "Connection Attempt Delay" of RFC 8305.
+#define HE_MAX_ATTEMPTS    16
+
+/* Orders addresses as RFC 8305 suggests: address families are interleaved,
+ * starting with family (or family of the first address, IPv6 normally as
+ * sorted by getaddrinfo, if it is AF_UNSPEC).
+ */
+static int he_sort(address* infos, int family, address** out, int max)
+{
+    address *first[HE_MAX_ATTEMPTS];
+    address *other[HE_MAX_ATTEMPTS];
+    int nf = 0, no = 0, n = 0;
+
+    if (family == AF_UNSPEC)
+        family = infos->ai_family;
+    for (address *rp = infos; rp; rp = rp->ai_next) {
+        if (rp->ai_family == family) {
+            if (nf < max)
+                first[nf++] = rp;
+        } else if (no < max) {
+            other[no++] = rp;
+        }
+    }
+
+    for (int i = 0; n < max && (i < nf || i < no); i++) {
+        if (i < nf)
+            out[n++] = first[i];
+        if (i < no && n < max)
+            out[n++] = other[i];
+    }
+    return n;
+}
+
+/* Happy Eyeballs: starts connecting to next address every HE_ATTEMPT_DELAY
+ * ms (or immediately if previous attempt failed), until one of them is
+ * established. Returns connected socket, or -1.
+ */
+static int he_connect(address* infos, address** winner, int timeout)
+{
+    address       *addrs[HE_MAX_ATTEMPTS];
+    struct pollfd  pfds[HE_MAX_ATTEMPTS];
+    int            n       = he_sort(infos, AF_UNSPEC, addrs,
+                                     HE_MAX_ATTEMPTS);
+    int            started = 0;
+    int            pending = 0;
+    int            sock    = -1;
+    uint32         start   = (uint32) get_monotonic_ms();
+
+    while (sock == -1) {
+        if (started < n) {
+            address *rp = addrs[started];
+            pfds[started].fd = -1;
+            pfds[started].events = POLLOUT;
+            pfds[started].revents = 0;
+
+            int fd = create_nonblocking_socket(rp->ai_family);
+            if (fd != -1) {
+                if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+                    sock = fd;
+                    *winner = rp;
+                    started++;
+                    break;
+                } else if (errno == EINPROGRESS) {
+                    pfds[started].fd = fd;
+                    pending++;
+                } else {
+                    PDEBUG("connect failed: %s\n", strerror(errno));
+                    close(fd);
+                }
             }
-        } else if (!rd) {
-            mlog(QUIET, "Read connection: "
-                 "%p, sock: %d returns 0, connection closed...\n",
-                 pconn, pconn->sock);
-            pconn->connected = false;
-            rd = COF_CLOSED;
+            started++;
+        }
+
+        if (!pending) {
+            if (started < n)
+                continue;
+            break;
+        }
+
+        int left = timeout * 1000 -
+                   (int) ((uint32) get_monotonic_ms() - start);
+        if (left <= 0)
+            break;
+
+        int r = poll(pfds, started, started < n ?
+                     MIN(HE_ATTEMPT_DELAY, left) : left);
+        if (r == -1 && errno != EINTR)
+            break;
+
+        for (int i = 0; r > 0 && i < started; i++) {
+            if (pfds[i].fd == -1 || !pfds[i].revents)
+                continue;
+
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) ||
+                err) {
+                PDEBUG("attempt %d failed: %s\n", i, strerror(err));
+                close(pfds[i].fd);
+                pfds[i].fd = -1;
+                pending--;
+                continue;
+            }
+
+            sock = pfds[i].fd;
+            pfds[i].fd = -1;
+            *winner = addrs[i];
+            break;
         }
     }
 
-    return rd;
+    for (int i = 0; i < started; i++) {
+        if (pfds[i].fd != -1)
+            close(pfds[i].fd);
+    }
+
+    if (sock != -1)
+        mlog(VERBOSE, "Connected using IPv%d.\n",
+             (*winner)->ai_family == AF_INET6 ? 6 : 4);
+    return sock;
 }
 
-int tcp_connection_write(connection * conn, const char *buf,
-                         uint32 size, void *priv)
+/* Returns address family that worked for host last time, or AF_UNSPEC. */
+static int cached_family(const char* host, int port)
 {
-    connection_p *pconn = (connection_p *) conn;
+    dns_record rec;
+    if (dns_cache_get(host, port, &rec))
+        return rec.addrs[0].family;
+    return AF_UNSPEC;
+}
 
-    if (pconn && pconn->sock && buf) {
-        PDEBUG("begin write, conn: %p, sock: %d ....\n",
-               pconn, pconn->sock);
-        int wd = (int)write(pconn->sock, buf, size);
-        PDEBUG("%d bytes written\n", wd);
-        if (wd < 0) {
-            PDEBUG("failed to write to sock: %d, (%d):%s\n",
-                   pconn->sock, errno, strerror(errno));
+/* Connects to one of resolved addresses. If address family which works for
+ * this host is known (cached by previous connections), its addresses are
+ * tried directly, otherwise both families are raced by he_connect().
+ * Returns socket and sets winner to address connected, or returns -1.
+ */
+static int connect_resolved(const char* host, int port, address* infos,
+                            address** winner)
+{
+    int family = cached_family(host, port);
+    *winner = NULL;
+    for (address *rp = infos; family != AF_UNSPEC && rp; rp = rp->ai_next) {
+        if (rp->ai_family != family)
+            continue;
+
+        int sock = connect_to(rp->ai_family, rp->ai_socktype,
+                              rp->ai_protocol, rp->ai_addr, rp->ai_addrlen,
+                              TIME_OUT);
+        if (sock != -1) {
+            *winner = rp;
+            return sock;
         }
+    }
 
+    return he_connect(infos, winner, TIME_OUT);
+}
 
-        return wd;
+static address *address_dup(const address* rp)
+{
+    address *addr = ZALLOC1(address);
+    addr->ai_family   = rp->ai_family;
+    addr->ai_socktype = rp->ai_socktype;
+    addr->ai_protocol = rp->ai_protocol;
+    addr->ai_addrlen  = rp->ai_addrlen;
+    addr->ai_addr     = (struct sockaddr *) ZALLOC(char, rp->ai_addrlen);
+    memcpy(addr->ai_addr, rp->ai_addr, rp->ai_addrlen);
+    return addr;
+}
+
+/* Frees list of addresses created by address_dup(). */
+static void address_free(address* addr)
+{
+    while (addr) {
+        address *next = addr->ai_next;
+        FIF(addr->ai_addr);
+        FIF(addr);
+        addr = next;
     }
-    return 0;
 }
 
-// TODO: Remove this ifdef!
-#if 0
-void tcp_connection_close(connection * conn, char *buf,
-                          uint32 size, void *priv)
+/* Starts non-blocking connect to next address of conn->he, the one which
+ * was tried is kept in conn->addr. Returns false if none is left.
+ */
+static bool connect_next(connection_p* conn)
 {
+    while (conn->he) {
+        address *rp = conn->he;
+        conn->he = rp->ai_next;
+        rp->ai_next = NULL;
+        address_free(conn->addr);
+        conn->addr = rp;
+
+        conn->sock = connect_to(rp->ai_family, rp->ai_socktype,
+                                rp->ai_protocol, rp->ai_addr,
+                                rp->ai_addrlen, 0);
+        if (conn->sock != -1) {
+            conn->connecting = true;
+            timer_set(conn, tp_connect);
+            return true;
+        }
+    }
+    return false;
 }
-#endif // End of #if 0
 
 #ifdef SSL_SUPPORT
-int secure_connection_read(connection * conn, char *buf,
-                           uint32 size, void *priv)
+/* Chunk connections to a host connect at the same time, none of them could
+ * resume TLS session of others if they shook hands at once. So the first
+ * one to connect leads with a full handshake, the others are parked (wait
+ * for nothing) until its session is cached, and resume it. Parking ends
+ * after TLS_LEAD_RTOS anyway, in case host gives no session at all.
+ */
+#define TLS_LEAD_RTOS      3
+
+/* Returns true if handshake of conn should wait for session of others. */
+static bool tls_park(connection_p* pconn)
 {
-    connection_p *pconn = (connection_p *) conn;
+    pool_host *ph = pconn->phost;
+    if (pconn->parked)
+        return true;
+    if (!ph || ph->tls_no_resume || pconn->tls_waited ||
+        ssl_has_session(pconn->host, pconn->port))
+        return false;
 
-    if (pconn && pconn->sock && buf) {
-        return secure_socket_read(pconn->sock, buf, size, pconn->priv);
+    uint64 now = get_monotonic_ms();
+    if (ph->tls_lead_until <= now) {
+        ph->tls_lead_until = now + TLS_LEAD_RTOS * host_rto(ph);
+        return false;
     }
-    return 0;
+
+    PDEBUG("sock(%d) %p parked until session of %s is got.\n",
+           pconn->sock, pconn, pconn->host);
+    pconn->parked = true;
+    pconn->hs_wait = 0;
+    tls_parked++;
+    return true;
 }
 
-int secure_connection_write(connection * conn, const char *buf,
-                            uint32 size, void *priv)
+/* Returns true if parked conn should go on with its handshake, it is
+ * waiting for socket to be writable then.
+ */
+static bool tls_unpark(connection_p* pconn)
 {
-    connection_p *pconn = (connection_p *) conn;
+    pool_host *ph = pconn->phost;
+    if (!ssl_has_session(pconn->host, pconn->port)) {
+        if (ph->tls_lead_until > get_monotonic_ms())
+            return false;
+        if (ph->tls_lead_until && !ph->tls_no_resume) {
+            mlog(VERBOSE, "No TLS session got from %s, handshakes are not "
+                 "serialized.\n", pconn->host);
+            ph->tls_no_resume = true;
+        }
+    }
 
-    if (pconn && pconn->sock && buf) {
-        return secure_socket_write(pconn->sock, (char*)buf, size, pconn->priv);
+    tls_forget(pconn);
+    pconn->tls_waited = true;
+    pconn->hs_wait = WT_WRITE;
+    timer_set(pconn, tp_connect);   // time spent parked is not counted.
+    return true;
+}
+#endif
+
+static void tls_forget(connection_p* pconn)
+{
+    if (pconn->parked) {
+        pconn->parked = false;
+        tls_parked--;
+    }
+}
+
+/* Connections got by connection_get(ui, true) are established by event
+ * loops: it is called when socket is ready, checks result of non-blocking
+ * connect (tries next address if it failed), and drives TLS handshake.
+ * Returns 0 once connection is established, COF_AGAIN if it should be
+ * called again when socket is ready for conn->hs_wait, or COF_FAILED.
+ * Note: conn->sock is changed if another address is tried.
+ */
+static int connection_establish(connection_p* pconn)
+{
+    if (pconn->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(pconn->sock, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+            err = errno;
+        if (err) {
+            // Old socket is closed after new one is created, so that event
+            // loops can tell socket was changed by its number.
+            PDEBUG("failed to connect %s: %s\n", pconn->host, strerror(err));
+            spread_fail(&pconn->spread, pconn->addr);
+            int sock = pconn->sock;
+            bool ok = connect_next(pconn);
+            close(sock);
+            if (!ok) {
+                mlog(ALWAYS, "Failed to connect to host: %s - %s\n",
+                     pconn->host, strerror(err));
+                return COF_FAILED;
+            }
+            pconn->hs_wait = WT_WRITE;
+            return COF_AGAIN;
+        }
+
+        PDEBUG("sock(%d) %p connected to %s.\n", pconn->sock, pconn,
+               pconn->host);
+        pconn->connecting = false;
+        pconn->fastopen = fastopen_deferred(pconn->sock);
+        if (!pconn->fastopen)   // nothing is sent yet otherwise.
+            host_sample_rtt(pconn);
+        address_free(pconn->he);
+        pconn->he = NULL;
+        spread_attach(&pconn->spread, pconn->host, pconn->port,
+                      pconn->addr);
+        source_attach(&pconn->source, pconn->sock);
+        if (pconn->handshaking)
+            timer_set(pconn, tp_connect);
+        if (pconn->promote) {
+            dns_cache_promote(pconn->host, pconn->port, pconn->addr->ai_addr,
+                              pconn->addr->ai_addrlen);
+            pconn->promote = false;
+        }
+    }
+
+#ifdef SSL_SUPPORT
+    if (pconn->handshaking) {
+        bool early = false;
+        if (!pconn->priv) {
+            if (tls_park(pconn))
+                return COF_AGAIN;
+            ssl_init();
+            pconn->priv = ssl_create(pconn->sock, pconn->host, pconn->port);
+            pconn->rco.close = secure_connection_close;
+
+            // Request is sent along with handshake, which is finished by
+            // first read then.
+            early = pconn->early_data && ssl_start_early(pconn->priv);
+        }
+
+        int ret = early ? 0 : ssl_handshake(pconn->priv);
+        if (ret < 0) {
+            mlog(ALWAYS, "TLS handshake with %s failed.\n", pconn->host);
+            if (pconn->phost)   // don't keep others waiting.
+                pconn->phost->tls_lead_until = 0;
+            return COF_FAILED;
+        } else if (ret > 0) {
+            pconn->hs_wait = ret;
+            return COF_AGAIN;
+        }
+
+        PDEBUG("sock(%d) %p handshake finished.\n", pconn->sock, pconn);
+        pconn->handshaking = false;
+        secure_setup(pconn);
     }
+#endif
+
+    timer_set(pconn, tp_first_byte);
     return 0;
 }
 
-bool secure_connection_has_more(connection * conn, void *priv)
+/* Sets up operations of a connected socket based on protocol, TLS handshake
+ * is left to event loop if async is true.
+ */
+static void connection_setup(connection_p* conn, bool async)
 {
-    connection_p *pconn = (connection_p *) conn;
-    if (pconn && priv) {
-        return secure_socket_has_more(0, priv);
+    PDEBUG("sock(%d) %p connected to %s. \n", conn->sock, conn,
+           conn->host);
+
+    conn->connected   = true;
+    conn->active      = true;
+    conn->bucket = host_limit ? host_bucket(conn->host, conn->port) : NULL;
+    if (!conn->connecting) {
+        spread_attach(&conn->spread, conn->host, conn->port,
+                      conn->addr);
+        source_attach(&conn->source, conn->sock);
     }
-    return false;
+    if (conn->rco.read)         // reused from pool, already set up.
+        goto ops;
+
+    switch (conn->eprotocol) {
+        case HTTPS: {
+#ifdef SSL_SUPPORT
+            if (async) {
+                conn->handshaking = true;
+                break;
+            }
+#endif
+            connection_make_secure(&conn->conn);
+            break;
+        }
+        default: {
+            conn->rco.write      = tcp_connection_write;
+            conn->rco.read       = tcp_connection_read;
+#ifdef TCP_ZEROCOPY_RECEIVE
+            if (g_zerocopy)
+                conn->rco.read   = zerocopy_connection_read;
+#endif
+            conn->rco.save_to_fd = tcp_connection_save_to_fd;
+            conn->features |= sf_nowait_read;
+            break;
+        }
+    }
+ops:
+    if (CONN_PENDING(conn))
+        conn->hs_wait = WT_WRITE;
+    timer_set(conn, CONN_PENDING(conn) ? tp_connect : tp_first_byte);
+    if (!conn->rco.save_to_fd)
+        conn->rco.save_to_fd = connection_save_to_fd;
+    conn->conn.co.write      = mget_connection_write;
+    conn->conn.co.read       = mget_connection_read;
+    conn->conn.co.save_to_fd = mget_connection_save_to_fd;
+
+    PDEBUG ("C: %p, P: %p, W: %p, R: %p\n",
+            conn,
+            &conn->rco,conn->rco.write, conn->rco.read);
 }
 
-void secure_connection_close(connection * conn, void *priv)
+/* Called by resolver_dispatch() when host of conn is resolved, connection
+ * is made inactive if it fails to connect. connection_perform() picks it up
+ * by checking conn->resolved.
+ */
+static void connection_resolved(struct addrinfo* infos, int err,
+                                void* user_data)
 {
-    connection_p *pconn = (connection_p *) conn;
-    if (pconn && priv) {
-        ssl_destroy(priv);
+    connection_p *conn = (connection_p *) user_data;
+    conn->waiter   = NULL;
+    conn->resolved = true;
+    if (err) {
+        mlog(ALWAYS, "Failed to resolve host: %s - %s\n",
+             conn->host, gai_strerror(err));
+        conn->active = false;
+        return;
+    }
+
+    // Addresses are tried one by one by event loop, starting with the family
+    // that worked last time, or with the one picked by spread mode.
+    address *addrs[HE_MAX_ATTEMPTS];
+    address **pp = &conn->he;
+    int n = he_sort(infos, cached_family(conn->host, conn->port), addrs,
+                    HE_MAX_ATTEMPTS);
+    addr_cache_update(conn->host, conn->port, infos, NULL);
+    spread_update(conn->host, conn->port, infos);
+    if ((conn->he = spread_addresses(conn, conn->host, conn->port)))
+        n = 0;
+    for (int i = 0; i < n; i++) {
+        *pp = address_dup(addrs[i]);
+        pp = &(*pp)->ai_next;
+    }
+
+    if (!connect_next(conn)) {
+        mlog(ALWAYS, "Failed to connect to host: %s\n", conn->host);
+        conn->active = false;
+        return;
+    }
+
+    conn->promote = true;
+    connection_setup(conn, true);
+}
+
+/* Returns addresses of host to connect to in spread mode, see spread_pick(),
+ * NULL if it is off or host has less than two addresses.
+ */
+static address *spread_addresses(connection_p* conn, const char* host,
+                                 int port)
+{
+    spread_node *nodes[DNS_CACHE_ADDRS];
+    int n = spread_pick(&conn->spread, host, port, nodes, DNS_CACHE_ADDRS);
+    address *head = NULL;
+    address **pp = &head;
+    for (int i = 0; i < n; i++) {
+        socklen_t len = 0;
+        const struct sockaddr *sa = spread_node_addr(nodes[i], &len);
+        *pp = address_make(sa, len);
+        pp = &(*pp)->ai_next;
     }
+    return head;
+}
+
+/* Moves conn to the fastest node of its host, if its own node is much
+ * slower. It reconnects to new node, and sends request of current job again
+ * once connected: write_data is called again. The old address is kept as
+ * fallback. Returns true if connection was moved.
+ */
+static bool spread_balance(connection_p* conn)
+{
+    spread_node *best = spread_faster(&conn->spread);
+    if (!best)
+        return false;
+
+    socklen_t len = 0;
+    const struct sockaddr *sa = spread_node_addr(best, &len);
+    int sock = connect_to(sa->sa_family, SOCK_STREAM, 0, sa, len, 0);
+    spread_move(&conn->spread, best, conn->host, sock != -1);
+    if (sock == -1)
+        return false;
+
+    // Old socket is closed after new one is created, so that event loops
+    // can tell socket was changed by its number.
+    if (conn->rco.close)
+        conn->rco.close(&conn->conn, conn->priv);
+    conn->priv = NULL;
+    zerocopy_unmap(conn);
+    close(conn->sock);
+    conn->sock = sock;
+    source_detach(&conn->source);   // attached again once connected.
+    address_free(conn->he);
+    conn->he = conn->addr;
+    conn->addr = address_make(sa, len);
+    conn->connecting = true;
+#ifdef SSL_SUPPORT
+    conn->handshaking = conn->eprotocol == HTTPS;
+#endif
+    conn->hs_wait = WT_WRITE;
+    conn->io_wait = 0;
+    conn->expt = eo_all;
+    conn->rx_since = 0;
+    conn->rcvbuf = 0;
+    conn->tm_since = 0;
+    timer_set(conn, tp_connect);
+    return true;
+}
+
+void connection_put(connection * conn)
+{
+    if (!conn)
+        return;
+
+    connection_p *pconn = (connection_p *) conn;
+    timer_cancel(pconn);
+    pconn->phase = tp_none;
+    pool_host *ph = pconn->phost;
+    if (!ph || !pool_per_host || pconn->sock == -1 || !pconn->connected ||
+        CONN_WAITING(pconn) || CONN_PENDING(pconn)) {
+        goto clean;
+    }
+    pconn->group     = NULL;
+    pconn->throttled = false;
+    pconn->busy      = false;
+    pconn->io_wait   = 0;
+    pconn->resolved  = false;
+    spread_detach(&pconn->spread);  // idle ones are not counted.
+    source_detach(&pconn->source);
+    coord_release(pconn->slot); // nor do they hold slots.
+    pconn->slot = 0;
+    zerocopy_unmap(pconn);      // pages mapped are not held when idle.
+    pconn->zc_base = NULL;      // nor is file of its last download.
+
+    uint32 now = (uint32) get_monotonic_ms();
+    pool_expire(now);
+    if (ph->idle >= pool_per_host) {
+        pool_evict(HLINK2PCONN(ph->conns.prev));
+    } else if (g_pool_idle >= POOL_MAX_IDLE) {
+        pool_evict(LLINK2PCONN(g_pool_lru.prev));
+    }
+
+    pconn->idle_since = now;
+    plink_add(&ph->conns, &pconn->hlink);
+    plink_add(&g_pool_lru, &pconn->llink);
+    ph->idle++;
+    g_pool_idle++;
+    PDEBUG("connection %p put to pool, host #%u has %d idle.\n",
+           pconn, ph->id, ph->idle);
+    return;
+
+clean:
+    connection_destroy(conn);
+    PDEBUG("leave with connection cleared...\n");
+}
+
+
+int connection_perform(connection_group * group)
+{
+    PDEBUG("enter, sg: %p\n", group);
+    if (!group || !group->cnt)
+        return -1;
+
+    switch (g_engine) {
+        case IE_SELECT: {
+            return do_perform_select(group);
+        }
+        case IE_URING: {
+#ifdef HAVE_IO_URING
+            return do_perform_uring(group);
+#else
+            mlog(VERBOSE, "io_uring is not supported, using default...\n");
+#endif
+            // fall through
+        }
+        default: {
+#ifdef HAVE_EPOLL
+            return do_perform_epoll(group);
+#else
+            if (g_engine == IE_EPOLL)
+                mlog(VERBOSE, "epoll is not supported, using select...\n");
+            return do_perform_select(group);
+#endif
+        }
+    }
+}
+
+void connection_wakeup()
+{
+#ifdef HAVE_EPOLL
+    if (wake_fd != -1) {
+        uint64 v = 1;
+        // async-signal-safe, nothing to do if it fails.
+        if (write(wake_fd, &v, sizeof(v)) == -1)
+            ;
+    }
+#endif
+}
+
+
+connection_group *connection_group_create(uint32 type, bool * flag)
+{
+    connection_group *group = ZALLOC1(connection_group);
+
+    group->cflag = flag;
+    group->type = type;
+    group->wheel = timer_wheel_create(timer_fire);
+
+    return group;
+}
+
+void connection_group_destroy(connection_group * group)
+{
+    for (int i = group->cnt - 1; i >= 0; i--) {
+        connection_p *pconn = group->members[i];
+        // Group stopped early, response may still be on the way.
+        if (pconn->active)
+            pconn->connected = false;
+        connection_put((connection *) pconn);
+    }
+
+    FIF(group->members);
+    timer_wheel_destroy(group->wheel);
+    FIF(group);
+}
+
+void connection_add_to_group(connection_group * group, connection * conn)
+{
+    PDEBUG("enter with group: (%p), conn: (%p)\n", group, conn);
+    if (conn && group) {
+        if (group->cnt == group->cap) {
+            int cap = MAX(group->cap * 2, GROUP_MIN_CAP);
+            connection_p **members =
+                XREALLOC(group->members, cap * sizeof(connection_p *));
+            if (!members) {
+                mlog(ALWAYS, "Failed to add connection to group: %s\n",
+                     strerror(errno));
+                return;
+            }
+            group->members = members;
+            group->cap = cap;
+        }
+
+        connection_p *pconn = CONN2CONNP(conn);
+        pconn->group = group;
+        timer_set(pconn, CONN_WAITING(pconn) ? tp_none :
+                  CONN_PENDING(pconn) ? tp_connect : tp_first_byte);
+
+        // Finished members are behind live ones, move the first of them.
+        if (group->live < group->cnt)
+            group->members[group->cnt] = group->members[group->live];
+        group->members[group->live++] = pconn;
+        group->cnt++;
+        PDEBUG("Socket: %p added to group: %p, current count: %d\n",
+               conn, group, group->cnt);
+    }
+}
+
+bool timed_wait(int sock, int type, int delay)
+{
+    fd_set r, w, err;
+
+    FD_ZERO(&r);
+    FD_ZERO(&w);
+    FD_ZERO(&err);
+    FD_SET(sock, &err);
+
+    if (type & WT_READ)
+        FD_SET(sock, &r);
+
+    if (type & WT_WRITE)
+        FD_SET(sock, &w);
+
+    struct timeval tv;
+    tv.tv_sec = delay;
+    tv.tv_usec = 0;
+
+    int ret = select(sock + 1, &r, &w, &err, delay == -1 ? NULL : &tv);
+    g_io_stats.waits++;
+    if (ret < 0) {
+        mlog(ALWAYS, "select fail: %s\n", strerror(errno));
+        return false;
+    } else if (!ret) {
+        mlog(ALWAYS, "Connection timed out...\n");
+        return false;
+    }
+
+    return true;
+}
+
+void set_global_bandwidth(int limit)
+{
+    g_bucket.rate = MAX(limit, 0);
+    g_bucket.tokens = 0;
+    g_bucket.last = (uint32) get_monotonic_ms();
+}
+
+void set_host_bandwidth(int limit)
+{
+    host_limit = MAX(limit, 0);
+}
+
+void set_pool_limits(int per_host, int idle_timeout)
+{
+    if (per_host)
+        pool_per_host = per_host > 0 ? per_host : 0;
+    if (idle_timeout > 0)
+        pool_idle_timeout = idle_timeout;
+}
+
+void set_dns_cache(int entries, int ttl)
+{
+    if (entries > 0)
+        dns_entries = entries;
+    if (ttl > 0)
+        dns_ttl = ttl;
+}
+
+void set_socket_tuning(int profile, int rcvbuf, const char* congestion,
+                       int keepalive)
+{
+    XZERO(g_tuning);
+    switch (profile) {
+        case SP_NONE: {
+            break;
+        }
+        case SP_LFN: {
+            g_tuning.measure = true;
+            strcpy(g_tuning.congestion, "bbr");
+            // fall through
+        }
+        default: {
+            g_tuning.nodelay   = true;
+            g_tuning.keepalive = TUNE_KEEPALIVE;
+            break;
+        }
+    }
+
+    if (rcvbuf > 0) {
+        g_tuning.rcvbuf  = rcvbuf;
+        g_tuning.measure = false;
+    }
+    if (congestion)
+        snprintf(g_tuning.congestion, sizeof(g_tuning.congestion), "%s",
+                 congestion);
+    if (keepalive)
+        g_tuning.keepalive = MAX(keepalive, 0);
+}
+
+void set_fast_open(bool enable)
+{
+    g_fastopen = enable;
+}
+
+void set_shared_limits(int conns, int limit)
+{
+    shared_conns = MAX(conns, 0);
+    shared_limit = MAX(limit, 0);
+    if (shared_conns || shared_limit || coord_opened) {
+        char key[64] = { '\0' };
+        sprintf(key, "/libmget_coord_%s_uid_%d", VERSION_STRING, getuid());
+        coord_opened = coord_open(key, shared_conns, shared_limit);
+    }
+}
+
+/* Takes a slot of shared budget for a new connection to host, blocking
+ * callers wait for one. Returns slot, 0 if not capped, or -1.
+ */
+static int coord_slot_get(const char* host, int port, bool async)
+{
+    int slot = coord_acquire(host, port);
+    if (slot >= 0 || async)
+        return slot;
+
+    mlog(VERBOSE, "Waiting for a connection slot of %s ...\n", host);
+    uint64 start = get_monotonic_ms();
+    while (slot < 0 && get_monotonic_ms() - start < COORD_WAIT_MS) {
+        usleep(COORD_TICK_MS * 1000);
+        slot = coord_acquire(host, port);
+    }
+    if (slot < 0)
+        mlog(ALWAYS, "No connection slot of %s is freed in %d seconds.\n",
+             host, COORD_WAIT_MS / 1000);
+    return slot;
+}
+
+void set_zerocopy_receive(bool enable)
+{
+#ifdef TCP_ZEROCOPY_RECEIVE
+    g_zerocopy = enable;
+#else
+    if (enable)
+        mlog(ALWAYS, "TCP zero-copy receive is not supported.\n");
+#endif
+}
+
+void set_unix_socket(const char* path)
+{
+    g_unix_len = 0;
+    if (!path || !*path)
+        return;
+
+    if (strlen(path) >= sizeof(g_unix.sun_path)) {
+        mlog(ALWAYS, "Path of unix socket is too long: %s\n", path);
+        return;
+    }
+
+    XZERO(g_unix);
+    g_unix.sun_family = AF_UNIX;
+    strcpy(g_unix.sun_path, path);
+    g_unix_len = offsetof(struct sockaddr_un, sun_path) + strlen(path) + 1;
+}
+
+void connection_pool_stats(pool_stats* stats)
+{
+    if (stats)
+        *stats = g_pool_stats;
+}
+
+void connection_io_stats(io_stats* stats)
+{
+    if (stats)
+        *stats = g_io_stats;
+}
+
+void set_io_stats(bool enable)
+{
+    g_io_report = enable;
+}
+
+/* Seconds a connection not in a group waits for its socket: timeout of its
+ * phase, as connections in a group get from timer wheel.
+ */
+static int sync_timeout(const connection_p* pconn)
+{
+    timeout_phase phase = pconn->phase == tp_none ? tp_first_byte :
+        pconn->phase;
+    return (int) ((phase_timeout(pconn, phase) + 999) / 1000);
+}
+
+/* Sockets are non-blocking. Connections in a group are driven by event loops,
+ * which only read or write once socket is ready, and get COF_AGAIN if it is
+ * not ready after all. Connections not in a group are used synchronously,
+ * they wait here for socket when it is not ready, then try again. errno is
+ * set to ETIMEDOUT if socket is not ready in time.
+ */
+static bool sync_wait(connection_p* pconn, int type)
+{
+    if (errno != EAGAIN || pconn->group)
+        return false;
+    if (timed_wait(pconn->sock, type, sync_timeout(pconn)))
+        return true;
+
+    errno = ETIMEDOUT;
+    return false;
+}
+
+
+// local functions
+/* Reads into a large buffer and writes it out, used if data can't be
+ * spliced (TLS, for example). Reads return at most one TLS record, more
+ * reads are issued as long as they won't block, so that buffer is written
+ * with a single syscall.
+ */
+int connection_save_to_fd(connection *conn, int out, uint32 size)
+{
+    connection_p *pconn = (connection_p *) conn;
+    if (!pconn || !pconn->rco.read)
+        return COF_INVALID;
+
+    if (!save_buf)
+        save_buf = ZALLOC(char, SAVE_BUF_SIZE);
+
+    size = MIN(size, SAVE_BUF_SIZE);
+    uint32 total = 0;
+    while (total < size) {
+        if (total) {
+            struct pollfd pfd = { pconn->sock, POLLIN, 0 };
+            if (!(pconn->rco.has_more &&
+                  pconn->rco.has_more(conn, pconn->priv)) &&
+                poll(&pfd, 1, 0) != 1)
+                break;
+        }
+
+        int rd = pconn->rco.read(conn, save_buf + total, size - total,
+                                 pconn->priv);
+        if (rd <= 0) {
+            if (!total)
+                return rd;
+            break;
+        }
+        total += rd;
+    }
+
+    if (!safe_write(out, save_buf, total)) {
+        mlog(ALWAYS, "Failed to write to fd: %d - %s\n", out,
+             strerror(errno));
+        return COF_ABORT;
+    }
+    return (int) total;
+}
+
+int tcp_connection_read(connection * conn, char *buf,
+                        uint32 size, void *priv)
+{
+    int rd = COF_INVALID;
+    connection_p* pconn = (connection_p*) conn;
+    if (pconn && pconn->sock && buf) {
+        do {
+            rd = read(pconn->sock, buf, size);
+            g_io_stats.reads++;
+        } while (rd == -1 && sync_wait(pconn, WT_READ));
+
+        if (rd == -1) {
+            PDEBUG("rd: %d, sock: %d, errno: (%d) - %s\n",
+                   rd, pconn->sock, errno, strerror(errno));
+            if (errno == EAGAIN) {      // nothing to read, normal if non-blocking
+                rd = COF_AGAIN;
+            } else {
+                mlog(ALWAYS, "Read connection:"
+                     " %p returns -1, (%d): %s.\n",
+                     pconn, errno, strerror(errno));
+                rd = COF_FAILED;
+            }
+        } else if (!rd) {
+            mlog(QUIET, "Read connection: "
+                 "%p, sock: %d returns 0, connection closed...\n",
+                 pconn, pconn->sock);
+            pconn->connected = false;
+            rd = COF_CLOSED;
+        }
+    }
+
+    return rd;
+}
+
+#ifdef TCP_ZEROCOPY_RECEIVE
+/* Maps socket of conn for zero-copy receive, falls back to copying for good
+ * if it can't be mapped (not TCP, or not supported by kernel).
+ */
+static bool zerocopy_map(connection_p* conn)
+{
+    void *map = mmap(NULL, ZEROCOPY_MAP_SIZE, PROT_READ, MAP_SHARED,
+                     conn->sock, 0);
+    if (map == MAP_FAILED) {
+        mlog(VERBOSE, "Socket %d can't be mapped: %s, copying data.\n",
+             conn->sock, strerror(errno));
+        conn->rco.read = tcp_connection_read;
+        return false;
+    }
+
+    conn->zc_map = (char *) map;
+    return true;
+}
+
+/* Writes len bytes mapped at conn->zc_map into file of conn at position of
+ * buf. Whatever can't be written is copied through mapping of file instead,
+ * since it has been taken from socket already.
+ */
+static void zerocopy_write(connection_p* conn, char *buf, uint32 len)
+{
+    off_t  offset = (off_t) (buf - conn->zc_base);
+    uint32 done   = 0;
+    while (done < len) {
+        ssize_t wr = pwrite(conn->zc_fd, conn->zc_map + done, len - done,
+                            offset + done);
+        if (wr > 0)
+            done += (uint32) wr;
+        else if (wr == -1 && errno == EINTR)
+            continue;
+        else {
+            mlog(VERBOSE, "Failed to write mapped pages to file: %s, "
+                 "copying.\n", strerror(errno));
+            memcpy(buf + done, conn->zc_map + done, len - done);
+            break;
+        }
+    }
+}
+
+/* Receives with TCP_ZEROCOPY_RECEIVE: whole pages of payload queued on
+ * socket are mapped into conn->zc_map instead of being copied by kernel,
+ * then written into file by pwrite(). That still copies them once, into page
+ * cache, but inside kernel, and without faulting in mapping of file. Bytes
+ * not filling a page (head of unaligned segments, tail of queue) are copied,
+ * as hinted by recv_skip_hint.
+ *
+ * Reads not given a file (connection_set_file) are copied: pages mapped
+ * would only be copied from mapping of socket again.
+ */
+int zerocopy_connection_read(connection * conn, char *buf,
+                             uint32 size, void *priv)
+{
+    connection_p *pconn = (connection_p *) conn;
+    if (!pconn || !pconn->sock || !buf)
+        return COF_INVALID;
+
+    static uint32 page = 0;
+    if (!page)
+        page = (uint32) sysconf(_SC_PAGESIZE);
+
+    uint32 want = MIN(size, ZEROCOPY_MAP_SIZE) / page * page;
+    if (!pconn->zc_base || buf < pconn->zc_base || want < ZEROCOPY_MIN ||
+        (!pconn->zc_map && !zerocopy_map(pconn)))
+        goto copy;
+
+    struct tcp_zerocopy_receive zc;
+    socklen_t len = sizeof(zc);
+    XZERO(zc);
+    zc.address = (uint64) (uintptr_t) pconn->zc_map;
+    zc.length = want;
+    g_io_stats.reads++;
+    if (getsockopt(pconn->sock, IPPROTO_TCP, TCP_ZEROCOPY_RECEIVE, &zc,
+                   &len) == -1) {
+        if (errno == EAGAIN && pconn->group)
+            return COF_AGAIN;
+        if (errno != EAGAIN)
+            PDEBUG("TCP_ZEROCOPY_RECEIVE failed: %s\n", strerror(errno));
+        goto copy;              // waits there if used synchronously.
+    }
+
+    if (zc.length) {
+        zerocopy_write(pconn, buf, zc.length);
+        pconn->zc_mapped += zc.length;
+        return (int) zc.length;
+    }
+    if (zc.recv_skip_hint)
+        size = MIN(size, zc.recv_skip_hint);
+
+copy:;
+    int rd = tcp_connection_read(conn, buf, size, priv);
+    if (rd > 0)
+        pconn->zc_copied += rd;
+    return rd;
+}
+#endif
+
+/* Unmaps socket of conn, which holds socket open and pages last mapped. */
+static void zerocopy_unmap(connection_p* conn)
+{
+    if (conn->zc_map) {
+        munmap(conn->zc_map, ZEROCOPY_MAP_SIZE);
+        conn->zc_map = NULL;
+    }
+}
+
+#ifdef HAVE_SPLICE
+/* Creates pipe shared by all splices, it is always emptied after use. */
+static bool splice_pipe_open()
+{
+    if (splice_pipe[0] != -1)
+        return true;
+
+    if (pipe2(splice_pipe, O_CLOEXEC) == -1) {
+        mlog(VERBOSE, "Failed to create pipe: %s\n", strerror(errno));
+        splice_disabled = true;
+        return false;
+    }
+
+    if (fcntl(splice_pipe[1], F_SETPIPE_SZ, SAVE_PIPE_SIZE) == -1)
+        PDEBUG("Failed to resize pipe: %s\n", strerror(errno));
+    splice_pipe_size = fcntl(splice_pipe[1], F_GETPIPE_SZ);
+    if (splice_pipe_size <= 0)
+        splice_pipe_size = 64 * K;
+    return true;
+}
+
+static void splice_pipe_close()
+{
+    if (splice_pipe[0] != -1) {
+        close(splice_pipe[0]);
+        close(splice_pipe[1]);
+        splice_pipe[0] = splice_pipe[1] = -1;
+    }
+}
+
+/* Moves size bytes in splice_pipe to out, copies them if out can't be
+ * spliced to. Returns false if failed, pipe is dropped then.
+ */
+static bool splice_pipe_drain(int out, size_t size)
+{
+    while (size > 0) {
+        ssize_t w = splice_copy ? -1 :
+                splice(splice_pipe[0], NULL, out, NULL, size, SPLICE_F_MOVE);
+        if (w > 0) {
+            size -= w;
+            continue;
+        }
+        if (w == -1 && errno == EINTR && !splice_copy)
+            continue;
+        if (w == -1 && errno == EINVAL && !splice_copy) {
+            mlog(VERBOSE, "Can't splice to fd: %d, copying instead.\n", out);
+            splice_copy = true;
+        }
+        if (!splice_copy)
+            break;
+
+        char buf[4096];
+        ssize_t rd = read(splice_pipe[0], buf, MIN(size, sizeof(buf)));
+        if (rd <= 0 || !safe_write(out, buf, rd))
+            break;
+        size -= rd;
+    }
+
+    if (size > 0) {
+        mlog(ALWAYS, "Failed to write to fd: %d - %s\n", out,
+             strerror(errno));
+        splice_pipe_close();
+        return false;
+    }
+    return true;
+}
+#endif
+
+/* Zero-copy receive of plain TCP: data is spliced from socket to file
+ * through a pipe, without being copied into user space.
+ */
+int tcp_connection_save_to_fd(connection * conn, int out, uint32 size)
+{
+#ifdef HAVE_SPLICE
+    connection_p* pconn = (connection_p*) conn;
+    if (!pconn || splice_disabled || !splice_pipe_open())
+        return connection_save_to_fd(conn, out, size);
+
+    ssize_t rd;
+    do {
+        rd = splice(pconn->sock, NULL, splice_pipe[1], NULL,
+                    MIN(size, (uint32) splice_pipe_size),
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        g_io_stats.reads++;
+    } while (rd == -1 && sync_wait(pconn, WT_READ));
+
+    if (rd == -1) {
+        if (errno == EAGAIN || errno == EINTR)
+            return COF_AGAIN;
+        if (errno == EINVAL || errno == ENOSYS) {
+            mlog(VERBOSE, "splice is not supported, using read/write.\n");
+            splice_disabled = true;
+            return connection_save_to_fd(conn, out, size);
+        }
+        if (errno == EIO && (pconn->features & sf_ktls))
+            return connection_save_to_fd(conn, out, size);  // not data.
+        mlog(ALWAYS, "Read connection: %p returns -1, (%d): %s.\n",
+             pconn, errno, strerror(errno));
+        return COF_FAILED;
+    } else if (!rd) {
+        mlog(QUIET, "Read connection: %p, sock: %d returns 0, "
+             "connection closed...\n", pconn, pconn->sock);
+        pconn->connected = false;
+        return COF_CLOSED;
+    }
+
+    return splice_pipe_drain(out, rd) ? (int) rd : COF_ABORT;
+#else
+    return connection_save_to_fd(conn, out, size);
+#endif
+}
+
+int tcp_connection_write(connection * conn, const char *buf,
+                         uint32 size, void *priv)
+{
+    connection_p *pconn = (connection_p *) conn;
+
+    if (pconn && pconn->sock && buf) {
+        PDEBUG("begin write, conn: %p, sock: %d ....\n",
+               pconn, pconn->sock);
+        int wd;
+        do {
+            wd = (int)write(pconn->sock, buf, size);
+            g_io_stats.writes++;
+        } while (wd == -1 && sync_wait(pconn, WT_WRITE));
+        PDEBUG("%d bytes written\n", wd);
+        if (wd < 0) {
+            PDEBUG("failed to write to sock: %d, (%d):%s\n",
+                   pconn->sock, errno, strerror(errno));
+        }
+
+
+        return wd;
+    }
+    return 0;
+}
+
+// TODO: Remove this ifdef!
+#if 0
+void tcp_connection_close(connection * conn, char *buf,
+                          uint32 size, void *priv)
+{
+}
+#endif // End of #if 0
+
+#ifdef SSL_SUPPORT
+/* TLS never waits for socket in event loops: COF_AGAIN is returned and
+ * conn->io_wait tells event loops what to watch for. Connections not in a
+ * group are used synchronously, they wait here instead.
+ */
+int secure_connection_read(connection * conn, char *buf,
+                           uint32 size, void *priv)
+{
+    connection_p *pconn = (connection_p *) conn;
+
+    if (pconn && pconn->sock && buf) {
+        int rd;
+        while ((rd = secure_socket_read(pconn->sock, buf, size,
+                                        pconn->priv)) == COF_AGAIN) {
+            g_io_stats.reads++;
+            pconn->io_wait = secure_socket_want(pconn->priv);
+            if (pconn->group)
+                return rd;
+            if (!timed_wait(pconn->sock, pconn->io_wait,
+                            sync_timeout(pconn)))
+                return COF_FAILED;
+        }
+
+        g_io_stats.reads++;
+        pconn->io_wait = secure_socket_want(pconn->priv);
+        return rd;
+    }
+    return 0;
+}
+
+int secure_connection_write(connection * conn, const char *buf,
+                            uint32 size, void *priv)
+{
+    connection_p *pconn = (connection_p *) conn;
+
+    if (pconn && pconn->sock && buf) {
+        int wd = secure_socket_write(pconn->sock, (char*)buf, size,
+                                     pconn->priv);
+        g_io_stats.writes++;
+        pconn->io_wait = secure_socket_want(pconn->priv);
+        return wd;
+    }
+    return 0;
+}
+
+/* With kernel TLS, socket gives plaintext of data records and is read as a
+ * plain TCP one. SSL is left with records it decrypted before kernel took
+ * over, with control records (plain reads fail with EIO on them), and with
+ * waiting for socket.
+ */
+int ktls_connection_read(connection * conn, char *buf,
+                         uint32 size, void *priv)
+{
+    connection_p *pconn = (connection_p *) conn;
+
+    if (pconn && pconn->sock && buf) {
+        if (!secure_socket_has_more(pconn->sock, pconn->priv)) {
+            int rd = recv(pconn->sock, buf, size, MSG_DONTWAIT);
+            g_io_stats.reads++;
+            if (rd > 0) {
+                pconn->io_wait = 0;
+                return rd;
+            } else if (!rd) {
+                mlog(QUIET, "Read connection: %p, sock: %d returns 0, "
+                     "connection closed...\n", pconn, pconn->sock);
+                pconn->connected = false;
+                return COF_CLOSED;
+            } else if (errno != EIO && errno != EAGAIN && errno != EINTR) {
+                mlog(ALWAYS, "Read connection: %p returns -1, (%d): %s.\n",
+                     pconn, errno, strerror(errno));
+                return COF_FAILED;
+            }
+        }
+
+        return secure_connection_read(conn, buf, size, priv);
+    }
+    return 0;
+}
+
+bool secure_connection_has_more(connection * conn, void *priv)
+{
+    connection_p *pconn = (connection_p *) conn;
+    if (pconn && priv) {
+        return secure_socket_has_more(0, priv);
+    }
+    return false;
+}
+
+void secure_connection_close(connection * conn, void *priv)
+{
+    connection_p *pconn = (connection_p *) conn;
+    if (pconn && priv) {
+        ssl_destroy(priv);
+    }
+}
+#endif
+
+/* Returns true if socket of a pooled connection is still open: nothing can
+ * be read without blocking. EOF, errors and pending data all make it
+ * unusable, data left by a previous request can only be garbage for a new
+ * one.
+ */
+bool connection_alive(connection_p * pconn)
+{
+    if (!pconn->connected || pconn->sock == -1)
+        return false;
+
+    char c;
+    ssize_t ret = recv(pconn->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+#define close_connection(x) do {                \
+        if (x->waiter) {                        \
+            resolver_cancel(x->waiter);         \
+            x->waiter = NULL;                   \
+        }                                       \
+        if (x->queued) {                        \
+            x->queued = false;                  \
+            coord_queued--;                     \
+        }                                       \
+        coord_release(x->slot);                 \
+        x->slot = 0;                            \
+        timer_cancel(x);                        \
+        tls_forget(x);                          \
+        close(x->sock);                         \
+        x->sock = -1;                           \
+        x->active = false;                      \
+        x->connected = false;                   \
+    } while (0)
+
+/* Called when connection has finished its job, asks protocol for more work,
+ * for example, part of a chunk that is still being downloaded by another
+ * connection. Returns true if connection is active again, and it expects to
+ * send a new request.
+ */
+static bool reschedule_connection(connection_p* pconn)
+{
+    connection* conn = &pconn->conn;
+    if (pconn->sock == -1 || !conn->connection_reschedule_func ||
+        scavenger_retire(pconn->group ? pconn->group->live : 0) ||
+        !conn->connection_reschedule_func(conn, conn->priv))
+        return false;
+
+    PDEBUG("conn: %p, socket: %d rescheduled.\n", pconn, pconn->sock);
+    pconn->active = true;
+    pconn->connected = true;
+    pconn->expt = eo_all;
+    timer_set(pconn, tp_first_byte);
+    return true;
+}
+
+/* Updates state of connection based on return value of recv_data, returns
+ * true if this connection is removed from group. In spread mode, connection
+ * may be moved to another address, its socket is changed then.
+ */
+static bool finish_recv(connection_p* pconn, int ret)
+{
+    switch (ret) {
+        case COF_CLOSED:
+        case COF_FAILED: {
+            close_connection(pconn);
+        }
+        case COF_FINISHED: {
+            if (ret == COF_FINISHED && reschedule_connection(pconn)) {
+                // Nothing is in flight, cheapest time to move.
+                spread_balance(pconn);
+                return false;
+            }
+
+            // Socket of a finished one is kept connected, to be put into
+            // pool with group; closed ones were disconnected above.
+            PDEBUG("remove conn: %p socket: %d, ret: %d...\n",
+                   pconn, pconn->sock, ret);
+            timer_cancel(pconn);
+            coord_release(pconn->slot); // idle until put into pool.
+            pconn->slot = 0;
+            pconn->active = false;
+            pconn->expt ^= eor;
+            return true;
+        }
+        case COF_ABORT: {
+            exit(1);
+            break;
+        }
+        default: {
+            spread_balance(pconn);
+            break;
+        }
+    }
+    return false;
+}
+
+/* Adds socket of connection being established to fd sets it waits for. */
+static void select_watch_pending(connection_p* pconn, fd_set* rfds,
+                                 fd_set* wfds, fd_set* efds)
+{
+    if (pconn->hs_wait & WT_READ)
+        FD_SET(pconn->sock, rfds);
+    if (pconn->hs_wait & WT_WRITE)
+        FD_SET(pconn->sock, wfds);
+    FD_SET(pconn->sock, efds);
+}
+
+/* Starts queued connections of group that get slots now, as connection_get()
+ * does. Those whose host is being resolved are picked up by event loops once
+ * resolved, others are marked resolved and picked up by the same code, when
+ * *started is set. Returns number of connections failed to start, which are
+ * closed.
+ */
+static int coord_dispatch(connection_group* group, bool* started)
+{
+    int failed = 0;
+    GROUP_FOREACH(i, group) {
+        connection_p *conn = group->members[i];
+        if (!conn->queued || !conn->active)
+            continue;
+
+        int slot = coord_acquire(conn->host, conn->port);
+        if (slot < 0)
+            break;              // others are likely of the same host.
+
+        PDEBUG("conn: %p got slot %d of %s\n", conn, slot, conn->host);
+        char service[8];
+        snprintf(service, sizeof(service), "%d", conn->port);
+        char *host = strdup(conn->host);
+        conn->queued = false;
+        coord_queued--;
+        conn->slot = slot;
+        if (!connection_open(conn, host, conn->port, service, true)) {
+            close_connection(conn);
+            failed++;
+        } else if (!conn->waiter) {
+            connection_setup(conn, true);
+            conn->expt = eo_all;
+            conn->resolved = true;
+            *started = true;
+        }
+        FIF(host);
+    }
+    return failed;
+}
+
+/* Moves members finished in this iteration behind live ones. Those resolved
+ * but not active are kept until event loop has counted them.
+ */
+static void group_compact(connection_group* group)
+{
+    for (int i = 0; i < group->live;) {
+        connection_p *pconn = group->members[i];
+        if (pconn->active || pconn->resolved) {
+            i++;
+            continue;
+        }
+
+        // Order of members does not matter, swap it with last live one.
+        group->members[i] = group->members[--group->live];
+        group->members[group->live] = pconn;
+    }
+}
+
+/* Returns ms event loops may wait for events, -1 if no need to wake up. */
+static int engine_wait_ms(connection_group* group)
+{
+    int wait = timer_wheel_wait(group->wheel, get_monotonic_ms());
+    if (bandwidth_limited() && (wait < 0 || wait > BW_TICK_MS))
+        wait = BW_TICK_MS;
+    if (tls_parked && (wait < 0 || wait > TLS_PARK_TICK_MS))
+        wait = TLS_PARK_TICK_MS;
+    if (coord_queued && (wait < 0 || wait > COORD_TICK_MS))
+        wait = COORD_TICK_MS;
+    return wait;
+}
+
+int do_perform_select(connection_group* group)
+{
+    if (!(group->type & cg_all)) {
+        mlog(ALWAYS, "Connection timed out...\n");
+        return 0;
+    }
+
+    int maxfd = 0;
+    int cnt = group->cnt;
+
+    fd_set rfds;
+    FD_ZERO(&rfds);
+    fd_set wfds;
+    FD_ZERO(&wfds);
+    fd_set efds;
+    FD_ZERO(&efds);
+
+    GROUP_FOREACH(i, group) {
+        connection_p *pconn = group->members[i];
+        // make sure no pending data left.
+        if (pconn->rco.has_more) {
+            while (pconn->rco.has_more(&pconn->conn, pconn->priv)) {
+                 pconn->conn.recv_data((connection *) pconn, pconn->conn.priv);
+            }
+        }
+
+        if (pconn->sock && !CONN_WAITING(pconn)) {
+            if ((group->type & cg_read) && pconn->conn.recv_data)
+                FD_SET(pconn->sock, &rfds);
+
+            if ((group->type & cg_write) && pconn->conn.write_data)
+                FD_SET(pconn->sock, &wfds);
+
+            FD_SET(pconn->sock, &efds);
+            maxfd = maxfd > pconn->sock ? maxfd : pconn->sock;
+        }
+    }
+
+    maxfd++;
+
+#ifdef HAVE_EPOLL
+    if (wake_fd == -1)
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+
+    int nfds = 0;
+    int rfd = resolver_fd();
+    struct timeval tv;
+    while (!(*(group->cflag))) {
+        if (rfd != -1) {
+            FD_SET(rfd, &rfds);
+            maxfd = MAX(maxfd, rfd + 1);
+        }
+        if (wake_fd != -1) {
+            FD_SET(wake_fd, &rfds);
+            maxfd = MAX(maxfd, wake_fd + 1);
+        }
+
+        // Without wake_fd, control flag can only be checked periodically.
+        int wait = engine_wait_ms(group);
+        if (wake_fd == -1 && (wait < 0 || wait > 1000))
+            wait = 1000;
+        tv.tv_sec = wait / 1000;
+        tv.tv_usec = (wait % 1000) * 1000;
+        nfds = select(maxfd, &rfds, &wfds, &efds, wait < 0 ? NULL : &tv);
+        g_io_stats.polls++;
+        if (nfds == -1) {
+            fprintf(stderr, "Failed to select: %s\n", strerror(errno));
+            break;
+        }
+        if (wake_fd != -1 && FD_ISSET(wake_fd, &rfds)) {
+            uint64 v;
+            if (read(wake_fd, &v, sizeof(v)) == -1)
+                ;
+            FD_CLR(wake_fd, &rfds);
+            nfds--;
+        }
+        if (nfds == 0) {
+            PDEBUG("timed out...\n");
+            GROUP_FOREACH(i, group) {
+                connection_p *pconn = group->members[i];
+                if (pconn->active && !CONN_WAITING(pconn)) {
+                    if (CONN_PENDING(pconn)) {
+                        select_watch_pending(pconn, &rfds, &wfds, &efds);
+                    } else if (!pconn->throttled ||
+                               bandwidth_ready(pconn)) {
+                        FD_SET(pconn->sock, &rfds);
+                        if (pconn->io_wait & WT_WRITE)
+                            FD_SET(pconn->sock, &wfds);
+                    }
+                }
+            }
+        } else {
+            GROUP_FOREACH(i, group) {
+                connection_p *pconn = group->members[i];
+                int ret = 0;
+
+                if (!pconn->active || CONN_WAITING(pconn)) {
+                    continue;
+                }
+                if (CONN_PENDING(pconn)) {
+                    int sock = pconn->sock;
+                    if (FD_ISSET(sock, &wfds) || FD_ISSET(sock, &rfds) ||
+                        FD_ISSET(sock, &efds)) {
+                        FD_CLR(sock, &wfds);
+                        FD_CLR(sock, &rfds);
+                        FD_CLR(sock, &efds);
+                        if (connection_establish(pconn) == COF_FAILED) {
+                            close_connection(pconn);
+                            cnt--;
+                            continue;
+                        }
+                        maxfd = MAX(maxfd, pconn->sock + 1);
+                    }
+
+                    if (CONN_PENDING(pconn)) {
+                        select_watch_pending(pconn, &rfds, &wfds, &efds);
+                    } else {    // established, send request.
+                        FD_SET(pconn->sock, &wfds);
+                        FD_SET(pconn->sock, &efds);
+                    }
+                    continue;
+                }
+                // TLS may have to write before it can go on reading.
+                bool tls_write = (pconn->io_wait & WT_WRITE) &&
+                                 !(pconn->expt & eow);
+                if (FD_ISSET(pconn->sock, &wfds) && !tls_write) {
+                    ret = pconn->conn.write_data((connection *) pconn,
+                                                 pconn->conn.priv);
+                    if (ret == COF_FINISHED) {
+                        pconn->expt ^= eow;
+                        if (!(pconn->io_wait & WT_WRITE))
+                            FD_CLR(pconn->sock, &wfds);
+                        FD_SET(pconn->sock, &rfds);
+                        FD_SET(pconn->sock, &efds);
+                    } else if (ret == COF_MORE_DATA) {
+                        FD_SET(pconn->sock, &wfds);
+                        FD_SET(pconn->sock, &rfds);
+                        FD_SET(pconn->sock, &efds);
+                    } else {
+                        //@todo: handle this?
+                        mlog(ALWAYS, "Unknown value: %d\n", ret);
+                    }
+
+                    timer_set(pconn, tp_first_byte);
+                } else if (FD_ISSET(pconn->sock, &rfds) ||
+                           (tls_write && FD_ISSET(pconn->sock, &wfds))) {
+                    // Removed from read set until bandwidth is available.
+                    if (!bandwidth_ready(pconn))
+                        continue;
+
+                    int sock = pconn->sock;
+                    ret = pconn->conn.recv_data((connection *) pconn,
+                                                pconn->conn.priv);
+                    if (finish_recv(pconn, ret)) {
+                        // Socket may be closed, select() fails on it.
+                        FD_CLR(sock, &wfds);
+                        FD_CLR(sock, &rfds);
+                        FD_CLR(sock, &efds);
+                        cnt--;
+                        PDEBUG("remaining sockets: %d\n", cnt);
+                    } else if (pconn->sock != sock) {
+                        // moved to another address.
+                        FD_CLR(sock, &wfds);
+                        FD_CLR(sock, &rfds);
+                        FD_CLR(sock, &efds);
+                        select_watch_pending(pconn, &rfds, &wfds, &efds);
+                        maxfd = MAX(maxfd, pconn->sock + 1);
+                    } else {
+                        if ((pconn->expt & eow) ||
+                            (pconn->io_wait & WT_WRITE))
+                            FD_SET(pconn->sock, &wfds);
+                        FD_SET(pconn->sock, &rfds);
+                    }
+                } else if (FD_ISSET(pconn->sock, &efds)) {
+                    PDEBUG ("failed: pconn: %p\n", pconn);
+                    close_connection(pconn);
+                    cnt--;
+                } else if (pconn->active) {
+                    if ((pconn->expt & eor) &&
+                        (!pconn->throttled || bandwidth_ready(pconn)))
+                        FD_SET(pconn->sock, &rfds);
+                    if ((pconn->expt & eow) || (pconn->io_wait & WT_WRITE))
+                        FD_SET(pconn->sock, &wfds);
+                    FD_SET(pconn->sock, &efds);
+                }
+            }
+        }
+
+        bool started = false;
+        if (coord_queued)
+            cnt -= coord_dispatch(group, &started);
+
+        // Start connecting once address is known.
+        bool resolved = rfd != -1 && nfds > 0 && FD_ISSET(rfd, &rfds);
+        if (resolved || started) {
+            if (resolved)
+                resolver_dispatch();
+            GROUP_FOREACH(i, group) {
+                connection_p *pconn = group->members[i];
+                if (!pconn->resolved)
+                    continue;
+
+                pconn->resolved = false;
+                if (!pconn->active) {
+                    cnt--;
+                    continue;
+                }
+
+                FD_SET(pconn->sock, &wfds);
+                FD_SET(pconn->sock, &rfds);
+                FD_SET(pconn->sock, &efds);
+                maxfd = MAX(maxfd, pconn->sock + 1);
+            }
+        }
+
+#ifdef SSL_SUPPORT
+        if (tls_parked) {
+            GROUP_FOREACH(i, group) {
+                connection_p *pconn = group->members[i];
+                if (pconn->active && pconn->parked && tls_unpark(pconn))
+                    select_watch_pending(pconn, &rfds, &wfds, &efds);
+            }
+        }
+#endif
+
+        timer_wheel_advance(group->wheel, get_monotonic_ms());
+        connection_p *expired;
+        while ((expired = timer_expired(group))) {
+            FD_CLR(expired->sock, &rfds);
+            FD_CLR(expired->sock, &wfds);
+            FD_CLR(expired->sock, &efds);
+            close_connection(expired);
+            cnt--;
+        }
+        group_compact(group);
+
+        if (cnt == 0) {
+            break;
+        }
+
+        if (*(group->cflag)) {
+            fprintf(stderr, "Stop because control_flag set to 1!!!\n");
+            break;
+        }
+    }
+    return cnt;
+}
+
+/* Reads from connection until it has nothing to offer, returns last result
+ * of recv_data. Reads never wait, reads after the first one are only issued
+ * for connections whose read may return data without TLS going on first.
+ */
+static int drain_connection(connection_p* pconn)
+{
+    int ret = 0;
+    int n = 0;
+    do {
+        ret = pconn->conn.recv_data((connection *) pconn, pconn->conn.priv);
+        while (ret > 0 && pconn->rco.has_more &&
+               pconn->rco.has_more(&pconn->conn, pconn->priv)) {
+            ret = pconn->conn.recv_data((connection *) pconn,
+                                        pconn->conn.priv);
+        }
+    } while (ret > 0 && (pconn->features & sf_nowait_read) &&
+             ++n < MAX_DRAIN_READS && bandwidth_ready(pconn));
+
+    return ret;
+}
+
+#ifdef HAVE_EPOLL
+#define MAX_EVENTS    64
+
+static bool epoll_update(int epfd, int op, connection_p* pconn, uint32 events)
+{
+    struct epoll_event ev;
+    XZERO(ev);
+    ev.events = events;
+    ev.data.ptr = pconn;
+    g_io_stats.ctls++;
+    if (epoll_ctl(epfd, op, pconn->sock, &ev) == -1) {
+        mlog(ALWAYS, "epoll_ctl failed for sock: %d, (%d): %s\n",
+             pconn->sock, errno, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/* Events watched while receiving, TLS may have to write to go on reading. */
+static inline uint32 epoll_recv_events(connection_p* pconn)
+{
+    return EPOLLIN | ((pconn->io_wait & WT_WRITE) ? EPOLLOUT : 0);
+}
+
+/* Starts watching connections resolved (or started by coord_dispatch()),
+ * returns number of them failed, which are closed.
+ */
+static int epoll_start_resolved(int epfd, connection_group* group)
+{
+    int failed = 0;
+    GROUP_FOREACH(i, group) {
+        connection_p *pconn = group->members[i];
+        if (!pconn->resolved)
+            continue;
+
+        pconn->resolved = false;
+        if (!pconn->active ||
+            !epoll_update(epfd, EPOLL_CTL_ADD, pconn, EPOLLIN | EPOLLOUT)) {
+            close_connection(pconn);
+            failed++;
+        }
+    }
+    return failed;
+}
+
+int do_perform_epoll(connection_group* group)
+{
+    if (!(group->type & cg_all)) {
+        mlog(ALWAYS, "Connection timed out...\n");
+        return 0;
+    }
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        mlog(VERBOSE, "Failed to create epoll: %s, using select...\n",
+             strerror(errno));
+        return do_perform_select(group);
+    }
+
+    struct epoll_event ev;
+    if (wake_fd == -1)
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd != -1) {
+        XZERO(ev);
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev);
+    }
+
+    int rfd = resolver_fd();
+    if (rfd != -1) {
+        XZERO(ev);
+        ev.events = EPOLLIN;
+        ev.data.ptr = &resolver_tag;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, rfd, &ev);
+    }
+
+    int cnt = group->cnt;
+    GROUP_FOREACH(i, group) {
+        connection_p *pconn = group->members[i];
+        // make sure no pending data left.
+        if (pconn->rco.has_more) {
+            while (pconn->rco.has_more(&pconn->conn, pconn->priv)) {
+                 pconn->conn.recv_data((connection *) pconn, pconn->conn.priv);
+            }
+        }
+
+        if (pconn->sock && pconn->active && !CONN_WAITING(pconn)) {
+            uint32 events = 0;
+            if ((group->type & cg_read) && pconn->conn.recv_data)
+                events |= EPOLLIN;
+
+            if ((group->type & cg_write) && pconn->conn.write_data)
+                events |= EPOLLOUT;
+
+            if (!epoll_update(epfd, EPOLL_CTL_ADD, pconn, events)) {
+                close_connection(pconn);
+                cnt--;
+            }
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (cnt > 0 && !(*(group->cflag))) {
+        int nfds = epoll_wait(epfd, events, MAX_EVENTS,
+                              engine_wait_ms(group));
+        g_io_stats.polls++;
+        if (nfds == -1) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Failed to epoll_wait: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < nfds; i++) {
+            connection_p *pconn = (connection_p *) events[i].data.ptr;
+            uint32 e = events[i].events;
+            int ret = 0;
+
+            if (!pconn) {       // woken up by connection_wakeup().
+                uint64 v;
+                if (read(wake_fd, &v, sizeof(v)) == -1)
+                    ;
+                continue;
+            }
+
+            if (pconn == (connection_p *) &resolver_tag) {
+                // Start connecting once address is known.
+                resolver_dispatch();
+                cnt -= epoll_start_resolved(epfd, group);
+                continue;
+            }
+
+            if (!pconn->active)
+                continue;
+
+            if (CONN_PENDING(pconn)) {
+                int sock = pconn->sock;
+                if (connection_establish(pconn) == COF_FAILED) {
+                    close_connection(pconn);
+                    cnt--;
+                    continue;
+                }
+
+                // Socket is changed if next address is being tried, the
+                // old one was removed from epoll when it was closed.
+                uint32 events = EPOLLIN | EPOLLOUT;
+                if (CONN_PENDING(pconn))
+                    events = ((pconn->hs_wait & WT_READ) ? EPOLLIN : 0) |
+                             ((pconn->hs_wait & WT_WRITE) ? EPOLLOUT : 0);
+                if (!epoll_update(epfd, pconn->sock == sock ?
+                                  EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                                  pconn, events)) {
+                    close_connection(pconn);
+                    cnt--;
+                }
+                continue;
+            }
+
+            if ((e & EPOLLOUT) && (pconn->expt & eow)) {
+                ret = pconn->conn.write_data((connection *) pconn,
+                                             pconn->conn.priv);
+                if (ret == COF_FINISHED) {
+                    pconn->expt ^= eow;
+                    epoll_update(epfd, EPOLL_CTL_MOD, pconn,
+                                 epoll_recv_events(pconn));
+                } else if (ret != COF_MORE_DATA) {
+                    //@todo: handle this?
+                    mlog(ALWAYS, "Unknown value: %d\n", ret);
+                }
+
+                timer_set(pconn, tp_first_byte);
+            } else if ((e & (EPOLLIN | EPOLLHUP | EPOLLERR)) ||
+                       ((e & EPOLLOUT) && (pconn->io_wait & WT_WRITE))) {
+                if (!bandwidth_ready(pconn)) {
+                    // stop polling until bandwidth is available.
+                    epoll_update(epfd, EPOLL_CTL_MOD, pconn, 0);
+                    continue;
+                }
+
+                int sock = pconn->sock;
+                int io_wait = pconn->io_wait;
+                ret = drain_connection(pconn);
+                if (finish_recv(pconn, ret)) {
+                    // closed sockets are removed from epoll automatically.
+                    if (pconn->sock != -1) {
+                        epoll_ctl(epfd, EPOLL_CTL_DEL, pconn->sock, NULL);
+                        g_io_stats.ctls++;
+                    }
+                    cnt--;
+                    PDEBUG("remaining sockets: %d\n", cnt);
+                } else if (pconn->sock != sock) {
+                    // moved to another address, the old socket was removed
+                    // from epoll when it was closed.
+                    if (!epoll_update(epfd, EPOLL_CTL_ADD, pconn, EPOLLOUT)) {
+                        close_connection(pconn);
+                        cnt--;
+                    }
+                } else if (pconn->expt & eow) {
+                    // rescheduled, new request should be sent.
+                    epoll_update(epfd, EPOLL_CTL_MOD, pconn,
+                                 EPOLLIN | EPOLLOUT);
+                } else if ((pconn->io_wait ^ io_wait) & WT_WRITE) {
+                    epoll_update(epfd, EPOLL_CTL_MOD, pconn,
+                                 epoll_recv_events(pconn));
+                }
+            }
+        }
+
+        if (bandwidth_limited()) {
+            GROUP_FOREACH(i, group) {
+                connection_p *pconn = group->members[i];
+                if (pconn->active && pconn->throttled &&
+                    bandwidth_ready(pconn))
+                    epoll_update(epfd, EPOLL_CTL_MOD, pconn,
+                                 epoll_recv_events(pconn));
+            }
+        }
+
+#ifdef SSL_SUPPORT
+        if (tls_parked) {
+            GROUP_FOREACH(i, group) {
+                connection_p *pconn = group->members[i];
+                if (pconn->active && pconn->parked && tls_unpark(pconn))
+                    epoll_update(epfd, EPOLL_CTL_MOD, pconn, EPOLLOUT);
+            }
+        }
+#endif
+        bool started = false;
+        if (coord_queued)
+            cnt -= coord_dispatch(group, &started);
+        if (started)
+            cnt -= epoll_start_resolved(epfd, group);
+
+        timer_wheel_advance(group->wheel, get_monotonic_ms());
+        connection_p *expired;
+        while ((expired = timer_expired(group))) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, expired->sock, NULL);
+            g_io_stats.ctls++;
+            close_connection(expired);
+            cnt--;
+        }
+        group_compact(group);
+    }
+
+    if (*(group->cflag)) {
+        fprintf(stderr, "Stop because control_flag set to 1!!!\n");
+    }
+
+    close(epfd);
+    return cnt;
 }
 #endif
 
-/* Return true iff the connection to the remote site established
-   through SOCK is still open.
-
-   Specifically, this function returns true if SOCK is not ready for
-   reading.  This is because, when the connection closes, the socket
-   is ready for reading because EOF is about to be delivered.  A side
-   effect of this method is that sockets that have pending data are
-   considered non-open.  This is actually a good thing for callers of
-   this function, where such pending data can only be unwanted
-   leftover from a previous request.  */
-
-bool validate_connection(connection_p * pconn)
+#ifdef HAVE_IO_URING
+/* Tags of operations submitted to ring, stored in lower bits of user_data,
+ * upper bits hold the connection_p pointer.
+ */
+typedef enum _uring_operation {
+    uo_none    = 0,
+    uo_poll_in = 1,
+    uo_poll_out = 2,
+    uo_recv    = 3,
+    uo_mask    = 3
+} uring_operation;
+
+#define UD_TIMER      ((uint64)1 << 62)
+#define UD_WAKE       ((uint64)1 << 61)
+#define UD_CANCEL     ((uint64)1 << 60)
+#define UD_RESOLVER   ((uint64)1 << 59)
+#define UD_SPECIAL    (UD_TIMER | UD_WAKE | UD_CANCEL | UD_RESOLVER)
+#define UD_MAKE(P, O)   ((uint64)(uintptr_t)(P) | (O))
+#define UD_CONN(D)    ((connection_p*)(uintptr_t)((D) & ~(uint64)uo_mask))
+
+// Upper bound of bytes requested by one recv.
+#define MAX_RECV_SIZE  (1 << 30)
+
+static struct io_uring_sqe* uring_get_sqe_force(uring* ring)
 {
-    if (!pconn->connected || pconn->sock == -1)
-        return false;
+    struct io_uring_sqe* sqe = NULL;
+    while (!(sqe = uring_get_sqe(ring))) {
+        // submission queue is full, flush it.
+        g_io_stats.polls++;
+        if (uring_submit(ring, 0) < 0)
+            return NULL;
+    }
+    return sqe;
+}
 
-    fd_set check_set;
-    struct timeval to;
-    int ret = 0;
+/* Submits next operation of connection: poll if it is being established,
+ * write if request is not sent, recv directly into target buffer if protocol
+ * provides it, poll otherwise.
+ * Nothing is submitted if connection is throttled by bandwidth limiter or
+ * parked, and pconn->busy tells whether an operation was submitted.
+ */
+static bool uring_arm(uring* ring, connection_group* group,
+                      connection_p* pconn)
+{
+    if (pconn->parked)
+        return true;
 
-    /* Check if we still have a valid (non-EOF) connection.  From Andrew
-     * Maholski's code in the Unix Socket FAQ.  */
+    connection* conn = &pconn->conn;
+    bool pending = CONN_PENDING(pconn);
+    bool write = pending ? (pconn->hs_wait & WT_WRITE) :
+                 (pconn->expt & eow) && (group->type & cg_write) &&
+                 conn->write_data;
+    if (!write && !pending && !bandwidth_ready(pconn))
+        return true;
 
-    FD_ZERO(&check_set);
-    FD_SET(pconn->sock, &check_set);
+    struct io_uring_sqe* sqe = uring_get_sqe_force(ring);
+    if (!sqe)
+        return false;
 
-    /* Wait one microsecond */
-    to.tv_sec = 0;
-    to.tv_usec = 1;
+    if (write) {
+        uring_prep_poll(sqe, pconn->sock, POLLOUT,
+                        UD_MAKE(pconn, uo_poll_out));
+    } else if (pending) {
+        uring_prep_poll(sqe, pconn->sock, POLLIN,
+                        UD_MAKE(pconn, uo_poll_in));
+    } else {
+        char* buf = NULL;
+        uint32 size = 0;
+        if ((pconn->features & sf_nowait_read) && conn->get_buffer &&
+            conn->recv_done &&
+            conn->get_buffer(conn, conn->priv, &buf, &size) == 0 && size) {
+            if (bandwidth_limited())
+                size = (uint32) MIN((int64) size, bandwidth_quota(pconn));
+            uring_prep_recv(sqe, pconn->sock, buf, MIN(size, MAX_RECV_SIZE),
+                            UD_MAKE(pconn, uo_recv));
+        } else {
+            // TLS may have to write to go on reading.
+            uring_prep_poll(sqe, pconn->sock, POLLIN |
+                            ((pconn->io_wait & WT_WRITE) ? POLLOUT : 0),
+                            UD_MAKE(pconn, uo_poll_in));
+        }
+    }
 
-    ret = select(pconn->sock + 1, &check_set, NULL, NULL, &to);
-    if (!ret)
-        /* We got a timeout, it means we're still connected. */
-        return true;
-    else
-        /* Read now would not wait, it means we have either pending data
-           or EOF/error. */
-        return false;
+    pconn->busy = true;
+    return true;
 }
 
-#define close_connection(x) do {                \
-        close(x->sock);                         \
-        x->sock = -1;                           \
-        x->active = false;                      \
-        x->connected = false;                   \
-    } while (0)
+/* Arms connections resolved (or started by coord_dispatch()), returns number
+ * of them failed, which are closed. *pending counts operations submitted.
+ */
+static int uring_start_resolved(uring* ring, connection_group* group,
+                                int* pending)
+{
+    int failed = 0;
+    GROUP_FOREACH(i, group) {
+        connection_p *pconn = group->members[i];
+        if (!pconn->resolved)
+            continue;
+
+        pconn->resolved = false;
+        if (!pconn->active) {
+            failed++;
+        } else if (!uring_arm(ring, group, pconn)) {
+            close_connection(pconn);
+            failed++;
+        } else if (pconn->busy) {
+            (*pending)++;
+        }
+    }
+    return failed;
+}
 
-int do_perform_select(connection_group* group)
+int do_perform_uring(connection_group* group)
 {
     if (!(group->type & cg_all)) {
         mlog(ALWAYS, "Connection timed out...\n");
         return 0;
     }
 
-    int maxfd = 0;
-    int cnt = group->cnt;
+    uring* ring = uring_create(MAX(64, group->cnt * 2));
+    if (!ring) {
+        mlog(VERBOSE, "Failed to create io_uring, using fallback...\n");
+#ifdef HAVE_EPOLL
+        return do_perform_epoll(group);
+#else
+        return do_perform_select(group);
+#endif
+    }
 
-    fd_set rfds;
-    FD_ZERO(&rfds);
-    fd_set wfds;
-    FD_ZERO(&wfds);
-    fd_set efds;
-    FD_ZERO(&efds);
+#ifdef HAVE_EPOLL
+    if (wake_fd == -1)
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd != -1)
+        uring_prep_poll(uring_get_sqe_force(ring), wake_fd, POLLIN, UD_WAKE);
+#endif
+
+    // Timeout is added when it should fire earlier than those in flight,
+    // the ones fired later just wake loop up needlessly.
+    struct __kernel_timespec ts;
+    int timers = 0;             // timeouts in flight.
+    uint64 timer_at = 0;        // when the earliest one fires, 0: unknown.
+    int pending = 0;            // operations submitted but not completed.
+    if (wake_fd != -1)
+        pending++;
+
+    int rfd = resolver_fd();
+    if (rfd != -1) {
+        uring_prep_poll(uring_get_sqe_force(ring), rfd, POLLIN, UD_RESOLVER);
+        pending++;
+    }
 
-    slist_head *p;
-    SLIST_FOREACH(p, group->lst) {
-        connection_p *pconn = LIST2PCONN(p);
+    int cnt = group->cnt;
+    GROUP_FOREACH(i, group) {
+        connection_p *pconn = group->members[i];
         // make sure no pending data left.
         if (pconn->rco.has_more) {
             while (pconn->rco.has_more(&pconn->conn, pconn->priv)) {
@@ -801,141 +3238,212 @@ int do_perform_select(connection_group* group)
             }
         }
 
-        if (pconn->sock) {
-            if ((group->type & cg_read) && pconn->conn.recv_data)
-                FD_SET(pconn->sock, &rfds);
-
-            if ((group->type & cg_write) && pconn->conn.write_data)
-                FD_SET(pconn->sock, &wfds);
-
-            FD_SET(pconn->sock, &efds);
-            maxfd = maxfd > pconn->sock ? maxfd : pconn->sock;
+        if (pconn->sock && pconn->active && !CONN_WAITING(pconn)) {
+            if (uring_arm(ring, group, pconn)) {
+                if (pconn->busy)
+                    pending++;
+            } else {
+                close_connection(pconn);
+                cnt--;
+            }
         }
     }
 
-    maxfd++;
+    while (cnt > 0 && !(*(group->cflag))) {
+        uint64 now = get_monotonic_ms();
+        int wait = engine_wait_ms(group);
+        if (wait >= 0 &&
+            (!timer_at || now + wait + TW_TICK_MS < timer_at)) {
+            ts.tv_sec = wait / 1000;
+            ts.tv_nsec = (wait % 1000) * 1000000LL;
+            uring_prep_timeout(uring_get_sqe_force(ring), &ts, UD_TIMER);
+            timer_at = now + wait;
+            timers++;
+            pending++;
+        }
 
-    int nfds = 0;
-    struct timeval tv;
-    while (!(*(group->cflag))) {
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
-        nfds = select(maxfd, &rfds, &wfds, &efds, &tv);
-        if (nfds == -1) {
-            fprintf(stderr, "Failed to select: %s\n", strerror(errno));
+        int ret = uring_submit(ring, 1);
+        g_io_stats.polls++;
+        if (ret < 0 && ret != -EINTR && ret != -EBUSY) {
+            fprintf(stderr, "Failed to submit to io_uring: %s\n",
+                    strerror(-ret));
             break;
         }
-        if (nfds == 0) {
-            PDEBUG("timed out...\n");
-            int cts = get_time_s();
-            SLIST_FOREACH(p, group->lst) {
-                connection_p *pconn = LIST2PCONN(p);
-                if (pconn->active) {
-                    if (cts - pconn->last_access > TIME_OUT) {
-                        close_connection(pconn);
-                        cnt--;
-                        PDEBUG("cnt: %d\n", cnt);
 
-                    } else {
-                        FD_SET(pconn->sock, &rfds);
+        // Reap all completions before going back to kernel, connections
+        // are re-armed in batch by next uring_submit().
+        struct io_uring_cqe* cqe = NULL;
+        while ((cqe = uring_peek_cqe(ring))) {
+            uint64 data = cqe->user_data;
+            int res = cqe->res;
+            uring_cqe_seen(ring);
+            pending--;
+
+            if (data & UD_SPECIAL) {
+                if (data & UD_TIMER) {
+                    // Others in flight fire later, or not at all.
+                    timers--;
+                    timer_at = 0;
+
+                    // Resume connections throttled by bandwidth limiter.
+                    GROUP_FOREACH(i, group) {
+                        connection_p *pconn = group->members[i];
+                        if (pconn->active && pconn->throttled &&
+                            !pconn->busy && uring_arm(ring, group, pconn) &&
+                            pconn->busy)
+                            pending++;
                     }
+                } else if (data & UD_WAKE) {
+                    uint64 v;
+                    if (read(wake_fd, &v, sizeof(v)) == -1)
+                        ;
+                    uring_prep_poll(uring_get_sqe_force(ring), wake_fd,
+                                    POLLIN, UD_WAKE);
+                    pending++;
+                } else if (data & UD_RESOLVER) {
+                    // Start connecting once address is known.
+                    resolver_dispatch();
+                    cnt -= uring_start_resolved(ring, group, &pending);
+                    uring_prep_poll(uring_get_sqe_force(ring), rfd,
+                                    POLLIN, UD_RESOLVER);
+                    pending++;
+                } else {
+                    pending++;  // cancel requests are not counted.
                 }
+                continue;
             }
-        } else {
-            SLIST_FOREACH(p, group->lst) {
-                connection_p *pconn = LIST2PCONN(p);
-                int ret = 0;
 
-                if (!pconn->active) {
-                    continue;
-                }
-                if (FD_ISSET(pconn->sock, &wfds)) {
-                    ret = pconn->conn.write_data((connection *) pconn,
-                                                 pconn->conn.priv);
-                    if (ret == COF_FINISHED) {
-                        pconn->expt ^= eow;
-                        FD_CLR(pconn->sock, &wfds);
-                        FD_SET(pconn->sock, &rfds);
-                        FD_SET(pconn->sock, &efds);
-                    } else if (ret == COF_MORE_DATA) {
-                        FD_SET(pconn->sock, &wfds);
-                        FD_SET(pconn->sock, &rfds);
-                        FD_SET(pconn->sock, &efds);
-                    } else {
-                        //@todo: handle this?
-                        mlog(ALWAYS, "Unknown value: %d\n", ret);
-                    }
+            connection_p* pconn = UD_CONN(data);
+            pconn->busy = false;
+            if (!pconn->active)
+                continue;
 
-                    pconn->last_access = get_time_s();
-                } else if (FD_ISSET(pconn->sock, &rfds)) {
-                    ret = pconn->conn.recv_data((connection *) pconn,
-                                                pconn->conn.priv);
-                    pconn->last_access = get_time_s();
-                    switch (ret) {
-                        case COF_CLOSED:
-                        case COF_FAILED: {
-                            close_connection(pconn);
-                        }
-                        case COF_FINISHED:{ //TODO:
-                            PDEBUG("remove conn: %p socket: %d, ret: %d...\n",
-                                   pconn, pconn->sock, ret);
-                            /* close(pconn->sock); */
-                            cnt--;
-                            PDEBUG("remaining sockets: %d\n", cnt);
-                            pconn->active = false;
-                            pconn->connected = false;
-                            pconn->expt ^= eor;
-                            break;
-                        }
-                        case COF_ABORT:
-                        {
-                            exit(1);
-                            break;
-                        }
-                        case COF_AGAIN:
-                        default:
-                        {
-                            FD_SET(pconn->sock, &rfds);
-                            break;
-                        }
-                    }
-                } else if (FD_ISSET(pconn->sock, &efds)) {
-                    PDEBUG ("failed: pconn: %p\n", pconn);
+            int op = (int)(data & uo_mask);
+            bool removed = false;
+            if (CONN_PENDING(pconn)) {
+                if (connection_establish(pconn) == COF_FAILED) {
                     close_connection(pconn);
-                    cnt--;
-                } else if (pconn->active) {
-                    if (pconn->expt & eor)
-                        FD_SET(pconn->sock, &rfds);
-                    if (pconn->expt & eow)
-                        FD_SET(pconn->sock, &wfds);
-                    FD_SET(pconn->sock, &efds);
+                    removed = true;
+                }
+            } else if (op == uo_poll_out) {
+                ret = pconn->conn.write_data((connection *) pconn,
+                                             pconn->conn.priv);
+                if (ret == COF_FINISHED) {
+                    pconn->expt ^= eow;
+                } else if (ret != COF_MORE_DATA) {
+                    mlog(ALWAYS, "Unknown value: %d\n", ret);
+                }
+                timer_set(pconn, tp_first_byte);
+            } else {
+                if (op == uo_recv) {
+                    account_recv(pconn, res);
+                    if (res > 0)
+                        ret = pconn->conn.recv_done((connection *) pconn,
+                                                    res, pconn->conn.priv);
+                    else if (res == 0)
+                        ret = COF_CLOSED;
+                    else if (res == -EAGAIN || res == -EINTR)
+                        ret = COF_AGAIN;
+                    else if (res == -EIO && (pconn->features & sf_ktls))
+                        ret = drain_connection(pconn);  // not data.
+                    else {
+                        mlog(ALWAYS, "recv failed on sock: %d, %s\n",
+                             pconn->sock, strerror(-res));
+                        ret = COF_FAILED;
+                    }
+                } else {
+                    ret = drain_connection(pconn);
                 }
+                removed = finish_recv(pconn, ret);
+            }
+
+            if (removed) {
+                cnt--;
+                PDEBUG("remaining sockets: %d\n", cnt);
+            } else if (uring_arm(ring, group, pconn) && pconn->busy) {
+                pending++;
             }
         }
 
-        if (cnt == 0) {
-            break;
-        } else if (cnt < group->cnt / 2) {// half of connections are free, reschedule.
-            static bool rescheduled = false;
-            if (!rescheduled) {
-                PDEBUG("TODO: implement reschduling...\n");
-                rescheduled = true;
+#ifdef SSL_SUPPORT
+        if (tls_parked) {
+            GROUP_FOREACH(i, group) {
+                connection_p *pconn = group->members[i];
+                if (pconn->active && pconn->parked && !pconn->busy &&
+                    tls_unpark(pconn) && uring_arm(ring, group, pconn) &&
+                    pconn->busy)
+                    pending++;
             }
         }
+#endif
+        bool started = false;
+        if (coord_queued)
+            cnt -= coord_dispatch(group, &started);
+        if (started)
+            cnt -= uring_start_resolved(ring, group, &pending);
+
+        timer_wheel_advance(group->wheel, get_monotonic_ms());
+        connection_p *expired;
+        while ((expired = timer_expired(group))) {
+            close_connection(expired);
+            cnt--;
+        }
+        group_compact(group);
+    }
 
-        if (*(group->cflag)) {
-            fprintf(stderr, "Stop because control_flag set to 1!!!\n");
+    if (*(group->cflag)) {
+        fprintf(stderr, "Stop because control_flag set to 1!!!\n");
+    }
+
+    // Cancel all outstanding operations, and wait for them: they may still
+    // refer to memory owned by connections, finished ones included.
+    for (int i = 0; i < group->cnt; i++) {
+        connection_p *pconn = group->members[i];
+        if (pconn->busy) {
+            uring_prep_cancel(uring_get_sqe_force(ring),
+                              UD_MAKE(pconn, uo_recv), UD_CANCEL);
+            uring_prep_cancel(uring_get_sqe_force(ring),
+                              UD_MAKE(pconn, uo_poll_in), UD_CANCEL);
+            uring_prep_cancel(uring_get_sqe_force(ring),
+                              UD_MAKE(pconn, uo_poll_out), UD_CANCEL);
+        }
+    }
+    for (int i = 0; i < timers; i++)
+        uring_prep_cancel(uring_get_sqe_force(ring), UD_TIMER, UD_CANCEL);
+    if (wake_fd != -1)
+        uring_prep_cancel(uring_get_sqe_force(ring), UD_WAKE, UD_CANCEL);
+    if (rfd != -1)
+        uring_prep_cancel(uring_get_sqe_force(ring), UD_RESOLVER, UD_CANCEL);
+
+    while (pending > 0) {
+        int ret = uring_submit(ring, 1);
+        if (ret < 0 && ret != -EINTR) {
             break;
         }
+
+        struct io_uring_cqe* cqe = NULL;
+        while ((cqe = uring_peek_cqe(ring))) {
+            uint64 data = cqe->user_data;
+            uring_cqe_seen(ring);
+            if (data & UD_CANCEL)
+                continue;
+
+            pending--;
+            if (!(data & UD_SPECIAL))
+                UD_CONN(data)->busy = false;
+        }
     }
+
+    uring_destroy(ring);
     return cnt;
 }
+#endif
 
 int connect_to(int ai_family, int ai_socktype,
                int ai_protocol, const struct sockaddr *addr,
                socklen_t addrlen, int timeout)
 {
-    int sock = create_nonblocking_socket();
+    int sock = create_nonblocking_socket(ai_family);
     if (sock == -1) {
         mlog(ALWAYS, "Failed to create socket - %s ...\n",
              strerror(errno));
@@ -951,9 +3459,46 @@ ret:
     return sock;
 }
 
+/* Connects to g_unix. Connect of unix socket completes at once, it fails
+ * with EAGAIN instead of being in progress if backlog of server is full.
+ */
+int unix_connect()
+{
+    int sock = create_nonblocking_socket(AF_UNIX);
+    if (sock == -1) {
+        mlog(ALWAYS, "Failed to create socket - %s ...\n",
+             strerror(errno));
+        return -1;
+    }
+
+    if (connect(sock, (struct sockaddr *) &g_unix, g_unix_len) == -1) {
+        mlog(ALWAYS, "Failed to connect to %s: %s\n", g_unix.sun_path,
+             strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    PDEBUG("sock(%d) connected to %s\n", sock, g_unix.sun_path);
+    return sock;
+}
+
 bool try_connect(int sockfd, const struct sockaddr *addr,
                  socklen_t addrlen, int timeout)
 {
+#ifdef TCP_FASTOPEN_CONNECT
+    // If a cookie of server is cached, connect returns at once and SYN is
+    // sent with first write. Otherwise, or if server drops data in SYN,
+    // kernel falls back to a normal handshake and sends data after it.
+    int on = 1;
+    if (g_fastopen && addr->sa_family != AF_UNIX &&
+        setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+                   &on, sizeof(on)) == -1) {
+        mlog(VERBOSE, "TCP Fast Open is not available: %s\n",
+             strerror(errno));
+        g_fastopen = false;
+    }
+#endif
+
     if (connect(sockfd, addr, addrlen) == -1) {
         // failed to connect if sock is non-blocking or error is not EINTR.
         if (errno != EINPROGRESS) {
@@ -982,10 +3527,10 @@ char *get_host_key(const char *host, int port)
     return key;
 }
 
-int create_nonblocking_socket()
+int create_nonblocking_socket(int family)
 {
 #if defined(USE_FCNTL)
-    int sock = socket(PF_INET, SOCK_STREAM, 0);
+    int sock = socket(family, SOCK_STREAM, 0);
     if (sock != -1 && fcntl(sock, F_SETFL, O_NONBLOCK) == -1) {
         mlog(ALWAYS,
              "Failed to make socket (%d) non-blocking: %s ...\n", sock,
@@ -993,11 +3538,143 @@ int create_nonblocking_socket()
         close(sock);
     }
 #else
-    int sock = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int sock = socket(family, SOCK_STREAM | SOCK_NONBLOCK, 0);
 #endif
+    if (sock != -1 && family != AF_UNIX) {
+        socket_tune(sock);
+        source_bind(sock, family);
+    }
     return sock;
 }
 
+/* Sets receive buffer of sock, SO_RCVBUFFORCE is tried first as SO_RCVBUF
+ * is capped by net.core.rmem_max. Note: kernel stops autotuning it then.
+ */
+static void socket_set_rcvbuf(int sock, int size)
+{
+#ifdef SO_RCVBUFFORCE
+    if (!setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)))
+        return;
+#endif
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) == -1)
+        PDEBUG("Failed to set receive buffer: %s\n", strerror(errno));
+}
+
+/* Applies g_tuning to a socket not connected yet: window scale is chosen
+ * when connecting, based on receive buffer.
+ */
+static void socket_tune(int sock)
+{
+    int on = 1;
+    if (g_tuning.nodelay)
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    int rcvbuf = g_tuning.rcvbuf ? g_tuning.rcvbuf : rcvbuf_hint;
+    if (rcvbuf)
+        socket_set_rcvbuf(sock, rcvbuf);
+
+#ifdef TCP_CONGESTION
+    if (*g_tuning.congestion &&
+        setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, g_tuning.congestion,
+                   strlen(g_tuning.congestion)) == -1) {
+        mlog(VERBOSE, "Congestion control %s is not available: %s, "
+             "using default.\n", g_tuning.congestion, strerror(errno));
+        g_tuning.congestion[0] = '\0';
+    }
+#endif
+
+    if (g_tuning.keepalive) {
+        setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+#ifdef TCP_KEEPIDLE
+        int idle = g_tuning.keepalive;
+        int intvl = MAX(idle / TUNE_KEEPCNT, 1);
+        int cnt = TUNE_KEEPCNT;
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+#endif
+    }
+}
+
+/* Returns max receive buffer kernel autotuning can reach (tcp_rmem). */
+static int64 rcvbuf_autotune_max()
+{
+    static int64 rmem_max = 0;
+    if (!rmem_max) {
+        rmem_max = 6 * M;       // default of Linux.
+        FILE *fp = fopen("/proc/sys/net/ipv4/tcp_rmem", "r");
+        if (fp) {
+            long long lo, def, hi;
+            if (fscanf(fp, "%lld %lld %lld", &lo, &def, &hi) == 3 && hi > 0)
+                rmem_max = hi;
+            fclose(fp);
+        }
+    }
+    return rmem_max;
+}
+
+/* Measures bandwidth-delay product of conn, and grows its receive buffer to
+ * twice of it, if that is more than kernel autotuning can reach. New sockets
+ * start with the largest buffer set so far.
+ */
+static void rcvbuf_account(connection_p* conn, int size)
+{
+#ifdef TCP_INFO
+    if (!g_tuning.measure || !conn || size <= 0)
+        return;
+
+    uint32 now = (uint32) get_monotonic_ms();
+    if (!conn->rx_since) {
+        conn->rx_since = now;
+        conn->rx_bytes = 0;
+        return;
+    }
+
+    conn->rx_bytes += size;
+    uint32 elapsed = now - conn->rx_since;
+    if (elapsed < TUNE_SAMPLE_MS)
+        return;
+
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    XZERO(ti);
+    if (!getsockopt(conn->sock, IPPROTO_TCP, TCP_INFO, &ti, &len)) {
+        uint64 rtt = ti.tcpi_rcv_rtt ? ti.tcpi_rcv_rtt : ti.tcpi_rtt; // us
+        uint64 bdp = conn->rx_bytes * 1000 / elapsed * rtt / 1000000;
+        int64 want = MIN((int64) bdp * 2, TUNE_RCVBUF_MAX);
+
+        // Kernel doubles the value set, half of it is used as window.
+        if (want > conn->rcvbuf && want * 2 > rcvbuf_autotune_max()) {
+            mlog(VERBOSE, "BDP of %s: %llu bytes (rtt: %llu us), receive "
+                 "buffer set to %lld.\n", conn->host,
+                 (unsigned long long) bdp, (unsigned long long) rtt,
+                 (long long) want);
+            socket_set_rcvbuf(conn->sock, (int) want);
+            conn->rcvbuf = (int) want;
+            rcvbuf_hint = MAX(rcvbuf_hint, (int) want);
+        }
+    }
+
+    conn->rx_bytes = 0;
+    conn->rx_since = now;
+#endif
+}
+
+/* Bookkeeping of size bytes received by conn. */
+static void account_recv(connection_p* conn, int size)
+{
+    if (size > 0)
+        g_io_stats.bytes += size;
+    if (conn->fastopen && size > 0)
+        fastopen_account(conn);
+    limit_bandwidth(conn, size);
+    spread_account(&conn->spread, size);
+    source_account(conn->source, size);
+    scavenger_sample(conn->sock, &conn->scav_at, size);
+    rcvbuf_account(conn, size);
+    timeout_account(conn, size);
+}
+
 /** Wrapper of tcp_connection_read/secure_connection_read. */
 int mget_connection_read(connection * conn, char *buf,
                          uint32 size, void *priv)
@@ -1006,11 +3683,37 @@ int mget_connection_read(connection * conn, char *buf,
     int ret = 0;
 
     if (pconn && pconn->sock && buf) {
+        // Don't block callers waiting for data (response header, for
+        // example) even if bandwidth is used up, just read a little.
+        if (bandwidth_limited()) {
+            int64 quota = MAX(bandwidth_quota(pconn), BW_MIN_READ);
+            if (quota < size)
+                size = (uint32) quota;
+        }
         ret = pconn->rco.read(conn, buf, size, priv);
     }
 
-    limit_bandwidth(pconn, ret);
+    account_recv(pconn, ret);
+
+    return ret;
+}
+
+/** Wrapper of tcp_connection_save_to_fd/connection_save_to_fd. */
+int mget_connection_save_to_fd(connection * conn, int out, uint32 size)
+{
+    connection_p *pconn = (connection_p *) conn;
+    int ret = 0;
+
+    if (pconn && pconn->sock && pconn->rco.save_to_fd) {
+        if (bandwidth_limited()) {
+            int64 quota = MAX(bandwidth_quota(pconn), BW_MIN_READ);
+            if (quota < size)
+                size = (uint32) quota;
+        }
+        ret = pconn->rco.save_to_fd(conn, out, size);
+    }
 
+    account_recv(pconn, ret);
     return ret;
 }
 
@@ -1028,45 +3731,128 @@ int mget_connection_write(connection * conn, const char *buf,
     return 0;
 }
 
-void limit_bandwidth(connection_p* conn, int size)
+static void bucket_refill(token_bucket* tb, uint32 now)
 {
-    // TODO: Remove this ifdef!
-#if 0
+    int64 add = tb->rate * (uint32) (now - tb->last) / 1000;
+    if (add > 0) {
+        int64 burst = MAX(tb->rate / 4, BW_MIN_READ);
+        tb->tokens = MIN(tb->tokens + add, burst);
+        tb->last = now;
+    }
+}
 
-    if (bw_limit == -1)         // not enabled.
-       return;
+static token_bucket *host_bucket(const char *host, int port)
+{
+    if (!g_host_buckets)
+        g_host_buckets = hash_table_create(32, free);
+
+    char *key = get_host_key(host, port);
+    token_bucket *tb = HASH_ENTRY_GET(token_bucket, g_host_buckets, key);
+    if (!tb) {
+        tb = ZALLOC1(token_bucket);
+        tb->rate = host_limit;
+        tb->last = (uint32) get_monotonic_ms();
+        if (!HASH_TABLE_INSERT(g_host_buckets, key, tb, sizeof(*tb))) {
+            FIF(tb);
+            tb = NULL;
+        }
+    } else if (tb->rate != host_limit) {
+        tb->rate = host_limit;  // limit changed by another request.
+    }
+    FIF(key);
+    return tb;
+}
 
-    //Don't enable this for ftp which using multi-threads...
-    if (conn->port == IPPORT_FTP) {
-        return;
+/* Returns number of bytes this connection may read now, or 0 if it should
+ * wait for buckets to be refilled. Available tokens are shared by all
+ * connections in the same group.
+ */
+static int64 bandwidth_quota(connection_p* pconn)
+{
+    uint32 now = (uint32) get_monotonic_ms();
+    int64 avail = INT64_MAX;
+    if (g_bucket.rate) {
+        bucket_refill(&g_bucket, now);
+        avail = g_bucket.tokens;
     }
+    if (pconn->bucket) {
+        bucket_refill(pconn->bucket, now);
+        avail = MIN(avail, pconn->bucket->tokens);
+    }
+    avail = MIN(avail, scavenger_tokens());
+    avail = MIN(avail, coord_tokens());
 
-    static uint32 ts = 0;
-    if (!ts)
-        ts = get_time_ms();
+    if (avail <= 0)
+        return 0;
+    if (avail != INT64_MAX && pconn->group && pconn->group->live > 1)
+        avail = MAX(avail / pconn->group->live, BW_MIN_READ);
+    return avail;
+}
 
-    static int chunk = 0;
-    uint32 cts = get_time_ms();
-    int delta = chunk - bw_limit;
-    if (delta < 0) {
-        if (cts - ts > 1000) {
-            chunk = 0;
-            ts = cts;
-        } else
-            chunk += size;
+/* Returns true if connection may read now, connection is marked as
+ * throttled otherwise, and should be removed from read interest until
+ * bandwidth_ready() returns true again.
+ */
+static bool bandwidth_ready(connection_p* pconn)
+{
+    if (!bandwidth_limited())
+        return true;
+
+    bool ready = bandwidth_quota(pconn) > 0;
+    if (ready && pconn->throttled)
+        timer_set(pconn, pconn->phase); // time spent waiting is not idle.
+    pconn->throttled = !ready;
+    return ready;
+}
+
+void limit_bandwidth(connection_p* conn, int size)
+{
+    if (!conn || size <= 0)
         return;
-    }
 
-    int slp = (int) (((float) chunk) / bw_limit * 1000) + ts - cts;
-    PDEBUG("d: %d, limit: %d, ts: %u, c_ts: %u, sleep for: %d mseconds\n",
-           delta, bw_limit, ts, cts, slp);
-    if (slp > 0) {
-        usleep(slp * 1000);
+    if (g_bucket.rate)
+        g_bucket.tokens -= size;
+    if (conn->bucket)
+        conn->bucket->tokens -= size;
+    scavenger_consume(size);
+    coord_consume(size);
+}
+
+#ifdef SSL_SUPPORT
+static void secure_setup(connection_p* pconn)
+{
+    pconn->rco.write    = secure_connection_write;
+    pconn->rco.read     = secure_connection_read;
+    pconn->rco.save_to_fd = connection_save_to_fd;
+    pconn->rco.has_more = secure_connection_has_more;
+    pconn->rco.close = secure_connection_close;
+    pconn->features &= ~(sf_nowait_read | sf_ktls);
+
+    // Plaintext can be read, or spliced, from socket as from plain TCP.
+    if (secure_socket_ktls(pconn->priv)) {
+        PDEBUG("sock(%d) %p receives with kernel TLS.\n", pconn->sock,
+               pconn);
+        pconn->rco.read       = ktls_connection_read;
+        pconn->rco.save_to_fd = tcp_connection_save_to_fd;
+        pconn->features |= sf_nowait_read | sf_ktls;
     }
+    PDEBUG ("C: %p, P: %p, W: %p, R: %p\n",
+            pconn, &pconn->rco, pconn->rco.write, pconn->rco.read);
+}
+#endif
+
+void connection_allow_early_data(connection* conn)
+{
+    if (conn)
+        ((connection_p *) conn)->early_data = true;
+}
 
-    chunk = 0;
-    ts = cts;
-#endif                          // End of #if 0
+void connection_set_file(connection* conn, int fd, char *addr)
+{
+    if (conn) {
+        ((connection_p *) conn)->zc_fd   = fd;
+        ((connection_p *) conn)->zc_base = addr;
+    }
 }
 
 void connection_make_secure(connection* conn)
@@ -1080,16 +3866,12 @@ void connection_make_secure(connection* conn)
     if (pconn->priv) {
         ssl_destroy(pconn->priv);
     }
-    if ((pconn->priv = make_socket_secure(pconn->sock)) == NULL) {
+    if ((pconn->priv = make_socket_secure(pconn->sock, pconn->host,
+                                          pconn->port)) == NULL) {
         fprintf(stderr, "Failed to make socket secure\n");
         abort();
     }
-    pconn->rco.write    = secure_connection_write;
-    pconn->rco.read     = secure_connection_read;
-    pconn->rco.has_more = secure_connection_has_more;
-    pconn->rco.close = secure_connection_close;
-    PDEBUG ("C: %p, P: %p, W: %p, R: %p\n",
-            conn, &pconn->rco, pconn->rco.write, pconn->rco.read);
+    secure_setup(pconn);
 #else
     fprintf(stderr,
             "FATAL: HTTPS requires GnuTLS, which is not installed....\n");
@@ -1099,11 +3881,65 @@ void connection_make_secure(connection* conn)
 
 void connection_cleanup()
 {
-    PDEBUG("connn: %p\n", g_conn_cache);
-    hash_table_destroy(g_conn_cache);
-    PDEBUG("addr_cache: %p\n", addr_cache);
-    hash_table_destroy(addr_cache);
+    if (g_io_stats.bytes) {
+        io_stats *st = &g_io_stats;
+        uint64 calls = st->reads + st->writes + st->waits + st->polls +
+            st->ctls;
+        mlog(g_io_report ? ALWAYS : VERBOSE, "I/O syscalls: %.1f per MB "
+             "received, %llu reads, %llu writes, %llu waits, %llu polls, "
+             "%llu epoll_ctl for %llu bytes.\n",
+             calls * 1048576.0 / st->bytes,
+             (unsigned long long) st->reads,
+             (unsigned long long) st->writes,
+             (unsigned long long) st->waits,
+             (unsigned long long) st->polls,
+             (unsigned long long) st->ctls,
+             (unsigned long long) st->bytes);
+        XZERO(g_io_stats);
+    }
+    if (g_pool_stats.hits || g_pool_stats.misses) {
+        mlog(VERBOSE, "Connection pool: %u hits, %u misses, %u stale, "
+             "%u evicted.\n", g_pool_stats.hits, g_pool_stats.misses,
+             g_pool_stats.stale, g_pool_stats.evicted);
+    }
+    pool_flush();
+    hash_table_destroy(g_pool_hosts);
+    g_pool_hosts = NULL;
+#ifdef SSL_SUPPORT
+    ssl_cleanup();
+#endif
+    scavenger_report();
+    if (g_zc_mapped || g_zc_copied) {
+        mlog(VERBOSE, "TCP zero-copy receive: %llu bytes mapped (copied into "
+             "file by kernel), %llu copied.\n",
+             (unsigned long long) g_zc_mapped,
+             (unsigned long long) g_zc_copied);
+        g_zc_mapped = g_zc_copied = 0;
+    }
+    if (g_tfo_data || g_tfo_fallback) {
+        mlog(VERBOSE, "TCP Fast Open: %u connections sent data in SYN, "
+             "%u fell back.\n", g_tfo_data, g_tfo_fallback);
+        g_tfo_data = g_tfo_fallback = 0;
+    }
+    source_report();
+    spread_cleanup();
+    coord_close();
+    coord_opened = false;
+    dns_cache_close();
+    addr_cache = false;
+    hash_table_destroy(g_host_buckets);
+    resolver_cleanup();
+    g_host_buckets = NULL;
     bq_destroy(dq);
+    FIF(save_buf);
+    save_buf = NULL;
+#ifdef HAVE_SPLICE
+    splice_pipe_close();
+#endif
+    if (wake_fd != -1) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
 }
 
 /*
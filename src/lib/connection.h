@@ -56,7 +56,9 @@ typedef struct _connection_operations {
 	void (*close) (connection*, void*);
  	bool (*has_more) (connection*, void*);
 
-    int32 (*save_to_fd)(connection*, int);
+    // Receives at most size bytes and writes them to fd at its current
+    // offset, returns number of bytes saved or COF_XXX.
+    int32 (*save_to_fd)(connection*, int, uint32);
 } connection_operations;
 
 
@@ -69,7 +71,17 @@ struct _connection {
 	int (*recv_data) (connection *, void *);
 
 	// it should return COF_FINISHED if no more data is pending to send.
+	// It may be called again for the same job if connection is moved to
+	// another address, request should be sent again then.
 	int (*write_data) (connection *, void *);
+
+	// Optional, used by engines which receive data by themselves (io_uring):
+	// get_buffer returns 0 and sets where incoming data should be stored,
+	// or COF_AGAIN if data should be received by recv_data for now.
+	// recv_done is notified with number of bytes stored into that buffer,
+	// and returns the same values as recv_data.
+	int (*get_buffer) (connection *, void *, char **, uint32 *);
+	int (*recv_done) (connection *, int, void *);
     bool(*connection_reschedule_func) (connection *, void *);
 	void *priv;
 };
@@ -98,17 +110,124 @@ void connection_add_to_group(connection_group *, connection *);
 */
 int connection_perform(connection_group* group);
 
+/** Wakes up connection_perform() if it is waiting for events, so that the
+ *  control flag can be checked immediately. It is async-signal-safe.
+ */
+void connection_wakeup();
+
 void connection_cleanup();
 
 connection* connection_get(const url_info* ui, bool async);
+/** Returns "host:port", which should be freed by caller. */
+char *get_host_key(const char *host, int port);
 void connection_put(connection* sock);
 
 void connection_make_secure(connection* conn);
 
-/** Set global bandwith limit, unit: bps.
+/** Lets first request of conn be sent as TLS early data, if it resumes a
+ *  session that accepts it. Request must be idempotent: early data can be
+ *  replayed.
+ */
+void connection_allow_early_data(connection* conn);
+
+/** Tells that buffers given to reads of conn lie in addr, mapping of file fd
+ *  from its start, so that pages of socket mapped by zero-copy receive can
+ *  be written into fd instead of being copied through addr.
+ */
+void connection_set_file(connection* conn, int fd, char *addr);
+
+/** Set global bandwith limit, unit: bytes per second, 0 removes it.
  */
 void set_global_bandwidth(int);
 
+/** Set bandwith limit of every single host, unit: bytes per second, 0
+ *  removes it.
+ */
+void set_host_bandwidth(int);
+
+/** Set limits of keep-alive pool: max number of idle connections kept for
+ *  a single host (negative value disables pool) and seconds they can stay
+ *  idle, 0 keeps the current value.
+ */
+void set_pool_limits(int per_host, int idle_timeout);
+
+/** Set number of hosts that dns cache can hold (only used when cache is
+ *  created) and seconds addresses are cached, 0 keeps the default.
+ */
+void set_dns_cache(int entries, int ttl);
+
+/** Set tuning of new sockets: profile is one of sock_profile, other values
+ *  override the profile if set: receive buffer in bytes, name of congestion
+ *  control ("" for kernel default), and seconds idle before keepalive
+ *  probes (negative value disables keepalive).
+ */
+void set_socket_tuning(int profile, int rcvbuf, const char* congestion,
+                       int keepalive);
+
+/** Spread connections of a host over all addresses it resolves to, and move
+ *  connections from addresses much slower than others to the fastest one.
+ */
+void set_spread_mode(bool enable);
+
+/** Use TCP Fast Open: first request is sent in SYN to servers whose cookie
+ *  is known to kernel, others get a normal handshake.
+ */
+void set_fast_open(bool enable);
+
+/** Binds connections to source addresses in list, separated by comma, each
+ *  is an IP address or an interface. Faster ones get more connections,
+ *  invalid ones are ignored.
+ */
+void set_source_addresses(const char *list);
+
+/** Connects to path instead of hosts in urls, which still give Host header
+ *  and URI of requests. NULL to connect to hosts with TCP.
+ */
+void set_unix_socket(const char *path);
+
+/** Experimental: receive plain TCP by mapping pages of socket
+ *  (TCP_ZEROCOPY_RECEIVE) and writing them into file instead of copying,
+ *  where kernel supports it. Only reads of connections given a file by
+ *  connection_set_file() use it.
+ */
+void set_zerocopy_receive(bool enable);
+
+/** Scavenger mode: back off when rtt of connections grows (queueing delay
+ *  caused by others on the same links): reads are paced, and connections
+ *  finishing their chunks are not given new ones.
+ */
+void set_scavenger_mode(bool enable);
+
+/** Caps shared by mget processes of same user: max connections to one
+ *  host, and bandwidth of all, 0 for no cap. Connections wait for slots
+ *  freed by others, slots of processes exited are taken back.
+ */
+void set_shared_limits(int conns, int limit);
+
+typedef struct _pool_stats {
+	uint32 hits;		// connections reused from pool.
+	uint32 misses;		// no idle connection, a new one was created.
+	uint32 stale;		// idle connections found closed by peer.
+	uint32 evicted;		// closed because of idle timeout or limits.
+} pool_stats;
+
+void connection_pool_stats(pool_stats *stats);
+
+/* Syscalls made by connections, to see what receiving costs. */
+typedef struct _io_stats {
+	uint64 bytes;		// received from sockets.
+	uint64 reads;		// read/recv/splice calls on sockets.
+	uint64 writes;		// write/send calls on sockets.
+	uint64 waits;		// select() of connections used synchronously.
+	uint64 polls;		// select/epoll_wait/io_uring_enter of event loops.
+	uint64 ctls;		// epoll_ctl calls.
+} io_stats;
+
+void connection_io_stats(io_stats *stats);
+
+/** Reports syscalls per MB received when connections are cleaned up. */
+void set_io_stats(bool enable);
+
 typedef enum _wait_type {
 	WT_NONE = 0,
 	WT_READ = 1,
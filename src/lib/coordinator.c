@@ -0,0 +1,371 @@
+/** coordinator.c --- implementation of host-wide budget shared by processes.
+ *
+ * Copyright (C) 2014 Yang,Ying-chao
+ *
+ * Author: Yang,Ying-chao <yangyingchao@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Connections of all processes are slots in a fixed table: a slot is owned
+ * by pid of the process holding it, and tagged with hash of host. Slots are
+ * counted and taken with the table locked, so that slots of processes that
+ * exited can be taken back.
+ *
+ * The lock is a robust process-shared mutex, which kernel hands over when
+ * its holder dies. Where there is none, the lock is a pid, taken over once
+ * its holder is gone; as pids are reused, waiting for it is bounded. Either
+ * way, a process that can't get the lock in time goes on without the cap.
+ *
+ * Bandwidth is a token bucket in the same table, refilled by whichever
+ * process comes first after a tick, and drained with atomic operations.
+ */
+
+#include "coordinator.h"
+#include "mget_config.h"
+#include "fileutils.h"
+#include "logutils.h"
+#include "mget_macros.h"
+#include "mget_utils.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define COORD_MAGIC        0x6d636f6f   // "mcoo"
+#ifdef HAVE_ROBUST_MUTEX
+#define COORD_VERSION      3            // bump when layout changes.
+#else
+#define COORD_VERSION      2            // processes can't share lock of 3.
+#endif
+#define COORD_LOCK_SPINS   64           // yield only, sleep after that.
+#define COORD_LOCK_WAIT_MS 1000         // go on uncapped after that.
+#define COORD_MIN_BURST    (4 * K)
+
+typedef struct _coord_slot {
+    int32 pid;                  // owner, 0 if free.
+    uint32 hash;                // host:port.
+} coord_slot;
+
+typedef struct _coord_table {
+    uint32 magic;               // set after other fields are initialized.
+    uint32 version;
+    int32 lock;                 // pid of process holding it, 0 if free.
+    uint32 reserved;
+    int64 rate;                 // bytes per second, 0 means unlimited.
+    int64 tokens;
+    uint64 last;                // last refilled, monotonic ms.
+#ifdef HAVE_ROBUST_MUTEX
+    pthread_mutex_t mutex;      // used instead of lock.
+#endif
+    coord_slot slots[COORD_SLOTS];
+} coord_table;
+
+static coord_table *g_table = NULL;
+static size_t g_length = 0;
+static int32 g_pid = 0;
+static int g_conns = 0;         // cap of connections to one host.
+static bool g_limited = false;  // this process follows rate of table.
+static uint32 g_reclaimed = 0;  // slots taken back from exited processes.
+static uint32 g_recovered = 0;  // locks taken over from dead holders.
+static uint32 g_timeouts = 0;   // locks not got in time.
+
+static uint32 coord_hash(const char *host, int port)
+{
+    uint32 h = 2166136261u;     // FNV-1a
+    for (const char *p = host; *p; p++) {
+        h ^= (uint8) * p;
+        h *= 16777619u;
+    }
+    h ^= (uint32) port;
+    h *= 16777619u;
+    return h;
+}
+
+static inline bool pid_alive(int32 pid)
+{
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+#ifdef HAVE_ROBUST_MUTEX
+static void table_init(coord_table *table)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&table->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/* Returns false if lock is not got in COORD_LOCK_WAIT_MS. Slots are single
+ * stores, table is consistent even if holder died in the middle.
+ */
+static bool table_lock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += COORD_LOCK_WAIT_MS / 1000;
+    ts.tv_nsec += (COORD_LOCK_WAIT_MS % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    int err = pthread_mutex_timedlock(&g_table->mutex, &ts);
+    if (err == EOWNERDEAD) {
+        pthread_mutex_consistent(&g_table->mutex);
+        g_recovered++;
+        err = 0;
+    }
+    if (err)
+        g_timeouts++;
+    return !err;
+}
+
+static void table_unlock()
+{
+    pthread_mutex_unlock(&g_table->mutex);
+}
+#else
+static void table_init(coord_table *table)
+{
+}
+
+/* Spins for a while, then sleeps longer and longer, so that a holder which
+ * is not running is not kept waiting for CPU. Holder is checked when it
+ * sleeps; a pid reused by another process is only got over by giving up in
+ * COORD_LOCK_WAIT_MS.
+ */
+static bool table_lock()
+{
+    uint64 start = get_monotonic_ms();
+    useconds_t nap = 50;
+    for (uint32 i = 1;; i++) {
+        int32 owner = 0;
+        if (__atomic_compare_exchange_n(&g_table->lock, &owner, g_pid,
+                                        false, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED))
+            return true;
+
+        if (i < COORD_LOCK_SPINS) {
+            sched_yield();
+            continue;
+        }
+
+        // Holder was killed in the middle, take it over.
+        if (owner != g_pid && !pid_alive(owner) &&
+            __atomic_compare_exchange_n(&g_table->lock, &owner, 0, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            g_recovered++;
+            continue;
+        }
+
+        if (get_monotonic_ms() - start >= COORD_LOCK_WAIT_MS) {
+            g_timeouts++;
+            return false;
+        }
+        usleep(nap);
+        nap = MIN(nap * 2, 10000);
+    }
+}
+
+static void table_unlock()
+{
+    __atomic_store_n(&g_table->lock, 0, __ATOMIC_RELEASE);
+}
+#endif
+
+bool coord_open(const char *key, int conns, int64 rate)
+{
+    g_conns = MAX(conns, 0);
+    g_limited = rate > 0;
+    if (!g_table) {
+        bool created = false;
+        size_t length = sizeof(coord_table);
+        coord_table *table = shm_region_attach(key, &length, &created,
+                                               COORD_MAGIC);
+        if (table && created) {
+            table->version = COORD_VERSION;
+            table_init(table);
+            __atomic_store_n(&table->magic, COORD_MAGIC, __ATOMIC_RELEASE);
+        } else if (table) {
+            if (table->version != COORD_VERSION ||
+                length < sizeof(coord_table)) {
+                shm_region_close(table, length);
+                table = NULL;
+            }
+        }
+
+        if (!table) {
+            mlog(ALWAYS, "Shared budget is not usable, connections and "
+                 "bandwidth of processes are not capped.\n");
+            return false;
+        }
+
+        g_table = table;
+        g_length = length;
+        g_pid = (int32) getpid();
+    }
+
+    if (g_limited)
+        __atomic_store_n(&g_table->rate, rate, __ATOMIC_RELAXED);
+    return true;
+}
+
+int coord_acquire(const char *host, int port)
+{
+    if (!g_table || !g_conns || !host)
+        return 0;
+
+    uint32 hash = coord_hash(host, port);
+    int count = 0;
+    int empty = -1;
+    if (!table_lock())
+        return 0;
+    for (int i = 0; i < COORD_SLOTS; i++) {
+        coord_slot *s = &g_table->slots[i];
+        if (!s->pid) {
+            if (empty == -1)
+                empty = i;
+        } else if (s->hash == hash) {
+            count++;
+        }
+    }
+
+    // Slots of processes that exited are only looked for when needed, as
+    // it takes a syscall for each of them.
+    if (count >= g_conns || empty == -1) {
+        int32 alive = g_pid;    // slots of a process are often adjacent.
+        count = 0;
+        for (int i = 0; i < COORD_SLOTS; i++) {
+            coord_slot *s = &g_table->slots[i];
+            if (s->pid && s->pid != alive && pid_alive(s->pid))
+                alive = s->pid;
+            if (!s->pid || s->pid != alive) {
+                if (s->pid) {
+                    s->pid = 0;
+                    g_reclaimed++;
+                }
+                if (empty == -1)
+                    empty = i;
+            } else if (s->hash == hash) {
+                count++;
+            }
+        }
+    }
+
+    int slot = -1;
+    if (empty == -1) {
+        slot = 0;               // all taken, nothing to follow.
+    } else if (count < g_conns) {
+        g_table->slots[empty].hash = hash;
+        __atomic_store_n(&g_table->slots[empty].pid, g_pid,
+                         __ATOMIC_RELEASE);
+        slot = empty + 1;
+    }
+    table_unlock();
+
+    PDEBUG("%s:%d has %d connections, got slot %d\n", host, port, count,
+           slot);
+    return slot;
+}
+
+void coord_release(int slot)
+{
+    if (!g_table || slot <= 0 || slot > COORD_SLOTS)
+        return;
+
+    coord_slot *s = &g_table->slots[slot - 1];
+    int32 pid = g_pid;
+    __atomic_compare_exchange_n(&s->pid, &pid, 0, false, __ATOMIC_RELEASE,
+                                __ATOMIC_RELAXED);
+}
+
+bool coord_limited()
+{
+    return g_table && g_limited;
+}
+
+int64 coord_tokens()
+{
+    if (!coord_limited())
+        return INT64_MAX;
+
+    uint64 now = get_monotonic_ms();
+    uint64 last = __atomic_load_n(&g_table->last, __ATOMIC_ACQUIRE);
+    if (now > last &&
+        __atomic_compare_exchange_n(&g_table->last, &last, now, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        int64 rate = __atomic_load_n(&g_table->rate, __ATOMIC_RELAXED);
+        int64 add = (int64) MIN(now - last, 1000ULL) * rate / 1000;
+        int64 burst = MAX(rate / 4, COORD_MIN_BURST);
+        int64 tokens = __atomic_load_n(&g_table->tokens, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&g_table->tokens, &tokens,
+                                            MIN(tokens + add, burst), false,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED));
+    }
+
+    return __atomic_load_n(&g_table->tokens, __ATOMIC_RELAXED);
+}
+
+void coord_consume(int size)
+{
+    if (coord_limited() && size > 0)
+        __atomic_sub_fetch(&g_table->tokens, size, __ATOMIC_RELAXED);
+}
+
+void coord_close()
+{
+    if (!g_table)
+        return;
+
+    for (int i = 0; i < COORD_SLOTS; i++)
+        coord_release(i + 1);
+    if (g_reclaimed) {
+        mlog(VERBOSE, "Shared budget: %u slots reclaimed from exited "
+             "processes.\n", g_reclaimed);
+        g_reclaimed = 0;
+    }
+    if (g_recovered || g_timeouts) {
+        mlog(VERBOSE, "Shared budget: lock taken over from dead holders %u "
+             "times, not got in time %u times.\n", g_recovered,
+             g_timeouts);
+        g_recovered = g_timeouts = 0;
+    }
+
+    shm_region_close(g_table, g_length);
+    g_table = NULL;
+    g_limited = false;
+    g_conns = 0;
+}
+
+/*
+ * Editor modelines
+ *
+ * Local Variables:
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * fill-column: 78
+ * End:
+ *
+ * vim: set noet ts=4 sw=4:
+ */
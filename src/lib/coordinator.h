@@ -0,0 +1,84 @@
+/** coordinator.h --- host-wide budget shared by processes, used internally by libmget.
+ *
+ * Copyright (C) 2014 Yang,Ying-chao
+ *
+ * Author: Yang,Ying-chao <yangyingchao@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _COORDINATOR_H_
+#define _COORDINATOR_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mget_types.h"
+
+#define COORD_SLOTS        1024 // max connections of all processes.
+
+/**
+ * @name coord_open - Opens budget shared by processes.
+ * @param key - name of shared memory.
+ * @param conns - max connections of all processes to one host, 0 for no cap.
+ * @param rate - bytes per second of all processes, 0 for no cap. Rate set
+ *               by the process opened last is used.
+ * @return true if shared memory is used, nothing is capped otherwise.
+ *
+ * Caps are only followed by processes that opened it.
+ */
+bool coord_open(const char *key, int conns, int64 rate);
+
+/**
+ * @name coord_acquire - Takes a connection slot of host.
+ * @return slot (> 0), 0 if connections are not capped or table can't be
+ *         locked in time, or -1 if all slots of host are taken. Slots held
+ *         by processes that exited are reclaimed.
+ */
+int coord_acquire(const char *host, int port);
+
+/** Gives back slot got by coord_acquire(). */
+void coord_release(int slot);
+
+/** Returns true if bandwidth of all processes is capped. */
+bool coord_limited();
+
+/** Returns bytes all processes may receive now, may be negative. */
+int64 coord_tokens();
+
+/** Takes size bytes received from shared bucket. */
+void coord_consume(int size);
+
+/** Releases slots of this process and closes shared memory. */
+void coord_close();
+
+#ifdef __cplusplus
+}
+#endif
+#endif				/* _COORDINATOR_H_ */
+/*
+ * Editor modelines
+ *
+ * Local Variables:
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * fill-column: 78
+ * End:
+ *
+ * vim: set noet ts=4 sw=4:
+ */
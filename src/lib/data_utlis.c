@@ -117,28 +117,63 @@ hash_table *hash_table_create(uint32 hashSize, DestroyFunction dFunctor)
     return table;
 }
 
+/* Returns entry of key, or the first free one if key is not there. Entries
+ * are probed from slot of key and wrap around, NULL is returned if table is
+ * full.
+ */
+static TableEntry *hash_table_probe(hash_table * table, const char *key)
+{
+    uint32 index = table->hashFunctor(key);
+    for (uint32 n = 0; n < table->capacity; ++n) {
+        TableEntry *entry = &table->entries[(index + n) % table->capacity];
+        if (!entry->key || !strcmp(key, entry->key)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Doubles capacity of table, and places its entries again. */
+static bool hash_table_grow(hash_table * table)
+{
+    uint32 capacity = table->capacity;
+    TableEntry *entries = ZALLOC(TableEntry, capacity * 2);
+    if (!entries) {
+        return false;
+    }
+
+    TableEntry *old = table->entries;
+    table->entries = entries;
+    table->capacity = capacity * 2;
+    for (uint32 i = 0; i < capacity; ++i) {
+        if (old[i].key) {
+            *hash_table_probe(table, old[i].key) = old[i];
+        }
+    }
+    free(old);
+
+    PDEBUG("table: %p grows to %u entries\n", table, table->capacity);
+    return true;
+}
+
 bool hash_table_insert(hash_table * table, const char *key, void *val,
                        uint32 len)
 {
     bool ret = false;
     if (table && key && val) {
-        uint32 i;
-        // Insert entry into the first open slot starting from index.
-        for (i = table->hashFunctor(key); i < table->capacity; ++i) {
-            TableEntry *entry = &table->entries[i];
-            if (entry->key) {
-                if (!strcmp(key, entry->key)) {
-                    break;
-                }
-            } else {
-                entry->key = strdup(key);
-                entry->val = val;
-                entry->val_len = len;
-                entry->ts = time(NULL);
-                ret = true;
-                table->occupied++;
-                break;
-            }
+        TableEntry *entry = hash_table_probe(table, key);
+        if (!entry && hash_table_grow(table)) {
+            entry = hash_table_probe(table, key);
+        }
+
+        // Existing key is kept.
+        if (entry && !entry->key) {
+            entry->key = strdup(key);
+            entry->val = val;
+            entry->val_len = len;
+            entry->ts = time(NULL);
+            ret = true;
+            table->occupied++;
         }
     }
 
@@ -158,45 +193,28 @@ bool hash_table_update(hash_table * table, char *key, void *val,
 
     bool ret = false;
     if (table && key && val) {
-        uint32 i;
-        TableEntry *oldest = NULL;
-        TableEntry *entry = NULL;
-        // Insert entry into the first open slot starting from index.
-        for (i = table->hashFunctor(key); i < table->capacity; ++i) {
-            entry = &table->entries[i];
-            if (entry->key) {
-                if (!strcmp(key, entry->key)) {
-                    goto fill_slot;
-                } else {
-                    if (!oldest)
-                        oldest = entry;
-                    else
-                        oldest = oldest->ts < entry->ts ? oldest : entry;
+        TableEntry *entry = hash_table_probe(table, key);
+        if (!entry) {
+            // Table is full, the oldest entry is replaced.
+            //@todo: consider add a callback for this event.
+            entry = &table->entries[0];
+            for (uint32 i = 1; i < table->capacity; ++i) {
+                if (table->entries[i].ts < entry->ts) {
+                    entry = &table->entries[i];
                 }
-            } else {
-                table->occupied++;
-          fill_slot:
-                FIF(entry->key);
-                entry->key = strdup(key);
-                entry->val = val;
-                entry->val_len = len;
-                entry->ts = time(NULL);
-                ret = true;
-                break;
             }
+            DEL_ENTRY(table, entry);
+            entry->key = NULL;
+        } else if (!entry->key) {
+            table->occupied++;
         }
 
-        if (!ret && oldest) {
-            //@todo: consider add a callback for this event.
-            DEL_ENTRY(table, oldest);
-            ret = true;
-            entry = oldest;
-            goto fill_slot;
-        }
-
-        if (!ret) {
-            PDEBUG("Failed to update hash table for key: %s\n", key);
-        }
+        FIF(entry->key);
+        entry->key = strdup(key);
+        entry->val = val;
+        entry->val_len = len;
+        entry->ts = time(NULL);
+        ret = true;
     }
 
     DTB("leave", table);
@@ -209,20 +227,8 @@ bool hash_table_update(hash_table * table, char *key, void *val,
 */
 void *hash_table_entry_get(hash_table * table, const char *key)
 {
-    TableEntry *entry = NULL;
-    uint32 index = table->hashFunctor(key);
-    int i;
-
-    for (i = index; i < table->capacity; ++i) {
-        entry = &table->entries[i];
-        if (entry->key == NULL) {
-            return NULL;
-        }
-        if (strcmp(entry->key, key) == 0) {
-            break;
-        }
-    }
-    if (entry) {
+    TableEntry *entry = hash_table_probe(table, key);
+    if (entry && entry->key) {
         PDEBUG("Key: %s - %s, val: %p\n", key, entry->key, entry->val);
         return entry->val;
     }
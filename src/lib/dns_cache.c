@@ -0,0 +1,359 @@
+/** dns_cache.c --- implementation of shared host address cache.
+ *
+ * Copyright (C) 2014 Yang,Ying-chao
+ *
+ * Author: Yang,Ying-chao <yangyingchao@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Cache is an open addressing hash table of fixed size slots, which may be
+ * mapped by several processes at the same time. Every slot is protected by
+ * its own sequence lock: writer makes sequence odd (by compare-and-swap, so
+ * writers never wait for each other, the loser just skips updating), copies
+ * data in and makes it even again. Readers never write: they copy the slot
+ * and retry if sequence was odd or has changed meanwhile.
+ *
+ * Slots are never removed, expired ones are reused by following puts. A
+ * writer killed in the middle leaves its slot odd, a slot seen with the same
+ * odd sequence for DNS_STUCK_MS is taken over and emptied by whoever sees it.
+ */
+
+#include "dns_cache.h"
+#include "fileutils.h"
+#include "logutils.h"
+#include "mget_macros.h"
+#include "mget_utils.h"
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DNS_CACHE_MAGIC    0x6d646e73   // "mdns"
+#define DNS_CACHE_VERSION  1            // bump when layout changes.
+#define DNS_HOST_MAX       256
+#define DNS_PROBE_MAX      8            // max slots checked for a host.
+#define DNS_READ_RETRIES   64
+#define DNS_STUCK_MS       1000         // writer is taken as dead after it.
+#define DNS_STUCK_MAX      4            // locked slots watched at a time.
+
+typedef struct _dns_slot {
+    uint32 seq;                 // odd while slot is being written.
+    uint32 hash;                // 0 if slot was never used.
+    int64 expires;              // seconds since epoch.
+    int32 port;
+    int32 naddr;
+    char host[DNS_HOST_MAX];
+    dns_addr addrs[DNS_CACHE_ADDRS];
+} dns_slot;
+
+typedef struct _dns_table {
+    uint32 magic;               // set after other fields are initialized.
+    uint32 version;
+    uint32 nslots;
+    uint32 reserved;
+    dns_slot slots[0];
+} dns_table;
+
+static dns_table *g_table = NULL;
+static size_t g_length = 0;
+static bool g_shared = false;
+static uint32 g_ttl = DNS_CACHE_TTL;
+
+// Locked slots seen by this process, and since when.
+static struct {
+    dns_slot *slot;
+    uint32 seq;
+    uint64 since;
+} g_stuck[DNS_STUCK_MAX];
+
+static uint32 dns_hash(const char *host, int port)
+{
+    uint32 h = 2166136261u;     // FNV-1a
+    for (const char *p = host; *p; p++) {
+        h ^= (uint8) * p;
+        h *= 16777619u;
+    }
+    h ^= (uint32) port;
+    h *= 16777619u;
+    return h ? h : 1;           // 0 marks empty slot.
+}
+
+static void slot_unlock(dns_slot * s, uint32 seq);
+
+/* Called when slot s keeps being locked with seq, returns true if it was
+ * locked so for DNS_STUCK_MS: it is locked again by this process and
+ * emptied, data left by dead writer may be torn. Hash is kept, so that
+ * slot still links probe sequence.
+ */
+static bool slot_reclaim(dns_slot * s, uint32 seq)
+{
+    uint64 now = get_monotonic_ms();
+    int i = (int) ((s - g_table->slots) % DNS_STUCK_MAX);
+    if (g_stuck[i].slot != s || g_stuck[i].seq != seq) {
+        g_stuck[i].slot = s;
+        g_stuck[i].seq = seq;
+        g_stuck[i].since = now;
+        return false;
+    }
+
+    uint32 locked = seq;
+    if (now - g_stuck[i].since < DNS_STUCK_MS ||
+        !__atomic_compare_exchange_n(&s->seq, &locked, seq + 2, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return false;
+
+    g_stuck[i].slot = NULL;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s->expires = 0;
+    s->naddr = 0;
+    s->host[0] = '\0';
+    slot_unlock(s, seq + 1);
+    mlog(VERBOSE, "Dns cache slot %ld was left locked, reclaimed.\n",
+         (long) (s - g_table->slots));
+    return true;
+}
+
+/* Copies slot into out, returns false if it keeps being written. */
+static bool slot_read(dns_slot * s, dns_slot * out)
+{
+    uint32 seq = 0;
+    for (int i = 0; i < DNS_READ_RETRIES; i++) {
+        seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        memcpy(out, s, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) {
+            out->host[DNS_HOST_MAX - 1] = '\0';
+            out->naddr = MIN(MAX(out->naddr, 0), DNS_CACHE_ADDRS);
+            return true;
+        }
+    }
+
+    if ((seq & 1) && slot_reclaim(s, seq))
+        return slot_read(s, out);
+    return false;
+}
+
+static inline bool slot_match(const dns_slot * s, uint32 hash,
+                              const char *host, int port)
+{
+    return s->hash == hash && s->port == port && !strcmp(s->host, host);
+}
+
+/* Locks slot for writing, returns false if it is being written by others. */
+static bool slot_lock(dns_slot * s, uint32 * seq)
+{
+    *seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+    if ((*seq & 1) ||
+        !__atomic_compare_exchange_n(&s->seq, seq, *seq + 1, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return false;
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return true;
+}
+
+static void slot_unlock(dns_slot * s, uint32 seq)
+{
+    __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+#define SLOT(H, I)   (&g_table->slots[((H) + (I)) % g_table->nslots])
+
+bool dns_cache_open(const char *key, uint32 entries, uint32 ttl)
+{
+    if (g_table)
+        return g_shared;
+
+    if (!entries)
+        entries = DNS_CACHE_ENTRIES;
+    if (ttl)
+        g_ttl = ttl;
+
+    g_length = sizeof(dns_table) + (size_t) entries * sizeof(dns_slot);
+    if (key) {
+        bool created = false;
+        size_t length = g_length;
+        dns_table *table = shm_region_attach(key, &length, &created,
+                                             DNS_CACHE_MAGIC);
+        if (table && created) {
+            table->version = DNS_CACHE_VERSION;
+            table->nslots = entries;
+            __atomic_store_n(&table->magic, DNS_CACHE_MAGIC,
+                             __ATOMIC_RELEASE);
+        } else if (table) {
+            if (table->version != DNS_CACHE_VERSION || !table->nslots ||
+                length < sizeof(dns_table) +
+                (size_t) table->nslots * sizeof(dns_slot)) {
+                mlog(VERBOSE, "Shared dns cache is not usable, "
+                     "using private one.\n");
+                shm_region_close(table, length);
+                table = NULL;
+            }
+        }
+
+        if (table) {
+            g_table = table;
+            g_length = length;
+            g_shared = true;
+            return true;
+        }
+    }
+
+    g_table = (dns_table *) ZALLOC(char, g_length);
+    g_table->version = DNS_CACHE_VERSION;
+    g_table->nslots = entries;
+    g_table->magic = DNS_CACHE_MAGIC;
+    return false;
+}
+
+/* Gets addresses of host and when they expire. */
+static bool cache_get(const char *host, int port, dns_record * rec,
+                      int64 * expires)
+{
+    if (!g_table || !host)
+        return false;
+
+    uint32 hash = dns_hash(host, port);
+    int64 now = time(NULL);
+    dns_slot s;
+    for (int i = 0; i < DNS_PROBE_MAX; i++) {
+        if (!slot_read(SLOT(hash, i), &s))
+            continue;
+        if (!s.hash)            // end of probe sequence.
+            break;
+        if (!slot_match(&s, hash, host, port) || s.expires <= now ||
+            !s.naddr)
+            continue;
+
+        rec->naddr = s.naddr;
+        memcpy(rec->addrs, s.addrs, s.naddr * sizeof(dns_addr));
+        *expires = s.expires;
+        return true;
+    }
+
+    return false;
+}
+
+static void cache_put(const char *host, int port, const dns_record * rec,
+                      int64 expires)
+{
+    if (!g_table || !host || strlen(host) >= DNS_HOST_MAX || !rec->naddr)
+        return;
+
+    // Use slot of this host if any, or the first empty one, or the first
+    // expired one, or the one expires first, in this order.
+    uint32 hash = dns_hash(host, port);
+    int64 now = time(NULL);
+    dns_slot *target = NULL;
+    dns_slot *expired = NULL;
+    dns_slot *oldest = NULL;
+    int64 oldest_expires = 0;
+    dns_slot s;
+    for (int i = 0; i < DNS_PROBE_MAX; i++) {
+        dns_slot *p = SLOT(hash, i);
+        if (!slot_read(p, &s))
+            continue;
+        if (!s.hash || slot_match(&s, hash, host, port)) {
+            target = p;
+            break;
+        }
+        if (!expired && s.expires <= now)
+            expired = p;
+        if (!oldest || s.expires < oldest_expires) {
+            oldest = p;
+            oldest_expires = s.expires;
+        }
+    }
+
+    if (!target)
+        target = expired ? expired : oldest;
+
+    uint32 seq;
+    if (!target || !slot_lock(target, &seq))
+        return;
+
+    target->hash = hash;
+    target->port = port;
+    target->expires = expires;
+    target->naddr = MIN(rec->naddr, DNS_CACHE_ADDRS);
+    strcpy(target->host, host);
+    memcpy(target->addrs, rec->addrs, target->naddr * sizeof(dns_addr));
+    slot_unlock(target, seq);
+}
+
+bool dns_cache_get(const char *host, int port, dns_record * rec)
+{
+    int64 expires;
+    return cache_get(host, port, rec, &expires);
+}
+
+void dns_cache_put(const char *host, int port, const dns_record * rec)
+{
+    cache_put(host, port, rec, time(NULL) + g_ttl);
+}
+
+void dns_cache_promote(const char *host, int port,
+                       const struct sockaddr *addr, socklen_t len)
+{
+    dns_record rec;
+    int64 expires;
+    if (!cache_get(host, port, &rec, &expires))
+        return;
+
+    for (int i = 0; i < rec.naddr; i++) {
+        if (rec.addrs[i].len != len || memcmp(&rec.addrs[i].u, addr, len))
+            continue;
+        if (i == 0)             // already the first one.
+            return;
+
+        dns_addr a = rec.addrs[i];
+        memmove(&rec.addrs[1], &rec.addrs[0], i * sizeof(dns_addr));
+        rec.addrs[0] = a;
+        cache_put(host, port, &rec, expires);
+        return;
+    }
+}
+
+void dns_cache_close()
+{
+    if (g_shared)
+        shm_region_close(g_table, g_length);
+    else
+        FIF(g_table);
+
+    g_table = NULL;
+    g_shared = false;
+}
+
+/*
+ * Editor modelines
+ *
+ * Local Variables:
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * fill-column: 78
+ * End:
+ *
+ * vim: set noet ts=4 sw=4:
+ */
@@ -0,0 +1,92 @@
+/** dns_cache.h --- host address cache shared by processes, used internally by libmget.
+ *
+ * Copyright (C) 2014 Yang,Ying-chao
+ *
+ * Author: Yang,Ying-chao <yangyingchao@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _DNS_CACHE_H_
+#define _DNS_CACHE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mget_types.h"
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define DNS_CACHE_ENTRIES  1024 // default number of hosts.
+#define DNS_CACHE_TTL      300  // default seconds to keep addresses.
+#define DNS_CACHE_ADDRS    8    // max addresses kept for one host.
+
+typedef struct _dns_addr {
+    uint16 family;
+    uint16 len;
+    union {
+        struct sockaddr sa;
+        struct sockaddr_in v4;
+        struct sockaddr_in6 v6;
+    } u;
+} dns_addr;
+
+typedef struct _dns_record {
+    int naddr;
+    dns_addr addrs[DNS_CACHE_ADDRS];    // the one that works comes first.
+} dns_record;
+
+/**
+ * @name dns_cache_open - Opens address cache.
+ * @param key - name of shared memory, or NULL to use private memory.
+ * @param entries - number of hosts it can hold, used only if it is created.
+ * @param ttl - seconds that addresses put by this process are valid.
+ * @return true if shared memory is used.
+ *
+ * Private memory is used if shared memory can't be opened, so that cache is
+ * always available after this call.
+ */
+bool dns_cache_open(const char *key, uint32 entries, uint32 ttl);
+
+/** Gets unexpired addresses of host, returns false if not found. */
+bool dns_cache_get(const char *host, int port, dns_record * rec);
+
+/** Replaces addresses of host. */
+void dns_cache_put(const char *host, int port, const dns_record * rec);
+
+/** Moves addr to front of addresses of host, as it is known to work. */
+void dns_cache_promote(const char *host, int port,
+                       const struct sockaddr *addr, socklen_t len);
+
+void dns_cache_close();
+
+#ifdef __cplusplus
+}
+#endif
+#endif				/* _DNS_CACHE_H_ */
+/*
+ * Editor modelines
+ *
+ * Local Variables:
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * fill-column: 78
+ * End:
+ *
+ * vim: set noet ts=4 sw=4:
+ */
@@ -31,6 +31,11 @@
 // year/month/day is birthday of my son, just for fun!
 #define MAGIC_NUMBER     0xFC
 
+// Number of spare chunk slots reserved after effective chunks, so chunks can
+// be split while downloading without remapping metadata (remapping would
+// invalidate chunk pointers held by connections).
+#define SPARE_CHUNKS(nc)      MIN((nc), 255 - (nc))
+
 void dinfo_destroy(dinfo* info)
 {
     if (!info)
@@ -242,6 +247,16 @@ bool dinfo_ready(dinfo * info)
             && info->md->hd.status);
 }
 
+// Mapping of metadata may be moved by fm_remap, pointers into it should be
+// updated.
+static void dinfo_reset_pointers(dinfo* info)
+{
+    metadata *md = info->md = (metadata *) info->fm_md->addr;
+    md->ptrs->body = (data_chunk *) md->raw_data;
+    md->ptrs->ht_buffer = (char *) (md->raw_data) +
+                          sizeof(data_chunk) * md->hd.nr_effective;
+}
+
 extern bool chunk_split(uint64 size, int *num,
                         uint64 * cs, data_chunk ** dc);
 
@@ -278,7 +293,11 @@ bool dinfo_update_url(dinfo * info, const char *url)
 
     md->ptrs->ht_buffer = ptr;
     hd->ebl = dump_hash_table(ht, md->ptrs->ht_buffer, n_ebl);
-    fm_remap(info->fm_md, CALC_MD_SIZE(hd->nr_effective, hd->ebl));
+    fm_remap(info->fm_md, CALC_MD_SIZE(hd->nr_effective +
+                                       SPARE_CHUNKS(hd->nr_effective),
+                                       hd->ebl));
+    dinfo_reset_pointers(info);
+    md = info->md;
     PDEBUG("chunk: %p -- %p, ht_buffer: %p\n",
            md->raw_data, md->ptrs->body, md->ptrs->ht_buffer);
 
@@ -344,8 +363,11 @@ bool dinfo_update_metadata(dinfo * info, uint64 size, const char *fn)
 
     md->ptrs->ht_buffer = ptr;
     hd->ebl = dump_hash_table(ht, md->ptrs->ht_buffer, n_ebl);
-    fm_remap(info->fm_md, CALC_MD_SIZE(hd->nr_effective, hd->ebl));
-    md = info->md = (metadata*)info->fm_md->addr;
+    fm_remap(info->fm_md, CALC_MD_SIZE(hd->nr_effective +
+                                       SPARE_CHUNKS(hd->nr_effective),
+                                       hd->ebl));
+    dinfo_reset_pointers(info);
+    md = info->md;
 
     // now update fm_file.
     if (!info->fm_file) {
@@ -373,6 +395,56 @@ bool dinfo_update_metadata(dinfo * info, uint64 size, const char *fn)
     return true;
 }
 
+data_chunk* dinfo_split_chunk(dinfo* info, uint64 min_size)
+{
+    if (!info || !info->md || !info->fm_md)
+        return NULL;
+
+    metadata   *md     = info->md;
+    mh         *hd     = &md->hd;
+    data_chunk *victim = NULL;
+    uint64      left   = 0;
+    data_chunk *dp     = md->ptrs->body;
+    for (int i = 0; i < hd->nr_effective; ++i, ++dp) {
+        if (dp->end_pos > dp->cur_pos && dp->end_pos - dp->cur_pos > left) {
+            left   = dp->end_pos - dp->cur_pos;
+            victim = dp;
+        }
+    }
+
+    if (!victim || left < 2 * min_size || hd->nr_effective == 255)
+        return NULL;
+
+    // New chunk takes place of ht_buffer, which is moved backward into the
+    // spare slots.
+    size_t ebl  = PA(hd->ebl, 4);
+    char  *ptr  = md->ptrs->ht_buffer;
+    char  *end  = (char *) info->fm_md->addr + info->fm_md->length;
+    if (ptr + sizeof(data_chunk) + ebl > end) {
+        PDEBUG("No spare chunk slot left.\n");
+        return NULL;
+    }
+
+    memmove(ptr + sizeof(data_chunk), ptr, ebl);
+    md->ptrs->ht_buffer = ptr + sizeof(data_chunk);
+
+    // Split at 4K boundary, victim keeps lower half.
+    uint64 mid = (victim->cur_pos + left / 2) & ~((uint64) 4 * K - 1);
+    if (mid <= victim->cur_pos)
+        mid = victim->cur_pos + left / 2;
+
+    dp = (data_chunk *) ptr;
+    memset(dp, 0, sizeof(data_chunk));
+    dp->start_pos = mid;
+    dp->cur_pos   = mid;
+    dp->end_pos   = victim->end_pos;
+    victim->end_pos = mid;
+    hd->nr_effective++;
+
+    PDEBUG("Chunk %p split at %llX, new chunk: %p (%llX -- %llX)\n",
+           victim, mid, dp, dp->start_pos, dp->end_pos);
+    return dp;
+}
 
 void dinfo_sync(dinfo * info)
 {
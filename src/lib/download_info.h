@@ -45,6 +45,15 @@ bool dinfo_ready(dinfo* info);
 
 bool dinfo_update_metadata(dinfo *, uint64, const char *);
 bool dinfo_update_url(dinfo * info, const char *url);
+
+/**
+ * @name dinfo_split_chunk - Splits chunk with most remaining data into two.
+ * @param info - download info
+ * @param min_size - Minimum size of new chunk.
+ * @return New chunk holding upper half of remaining data, or NULL if no chunk
+ *         is worth splitting.
+ */
+data_chunk* dinfo_split_chunk(dinfo* info, uint64 min_size);
 void dinfo_sync(dinfo * info);
 
 #ifdef __cplusplus
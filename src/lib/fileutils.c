@@ -23,6 +23,7 @@
 #include "data_utlis.h"
 #include "fileutils.h"
 #include "logutils.h"
+#include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
 #include <stdio.h>
@@ -32,8 +33,14 @@
 #include <sys/mman.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
+
+// From linux/ioprio.h, which is missing in older kernel headers.
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_WHO_PROCESS  1
 #define FM_DEFAULT       (S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)
 
 fhandle *fhandle_create(const char *fn, FHM mode)
@@ -273,14 +280,17 @@ int fm_get_fd(fh_map* fm) {
 // internal use, no error checking needed..
 bool safe_write(int fd, char* buf, size_t total)
 {
-    do
+    while (total > 0)
     {
         ssize_t w = write(fd, buf, total);
         if (w == -1) {
+            if (errno == EINTR)
+                continue;
             return false;
         }
+        buf   += w;
         total -= w;
-    } while (total > 0);
+    }
 
     return true;
 }
@@ -297,6 +307,17 @@ size_t get_file_size(fh_map* fm)
     return -1;
 }
 
+bool set_io_priority_idle()
+{
+#ifdef SYS_ioprio_set
+    if (!syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                 IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT))
+        return true;
+    mlog(VERBOSE, "Failed to lower io priority: %s\n", strerror(errno));
+#endif
+    return false;
+}
+
 
 
 #define shm_error(msg)                                              \
@@ -309,34 +330,135 @@ size_t get_file_size(fh_map* fm)
 */
 
 
-shm_region* shm_region_open(const char* key)
+void* shm_region_open(const char* key, size_t* length, bool* created)
 {
-    shm_region* r = NULL;
-    size_t length = sizeof(shm_region);
-    int fd = shm_open(key, O_RDWR, S_IRUSR | S_IWUSR);
-    if (fd == -1) { // no shared memory created for this library, create new
+    void* r = NULL;
+    int fd = shm_open(key, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+    *created = fd != -1;
+    if (*created) { // no shared memory created for this library, create new
                     // one.
-        fd = shm_open(key, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+        if (ftruncate(fd, *length) == -1) {
+            shm_unlink(key);
+            shm_error("Failed to truncate..");
+        }
+    } else {
+        struct stat st;
+        fd = shm_open(key, O_RDWR, S_IRUSR | S_IWUSR);
         if (fd == -1)
             shm_error("Failed to open shared memory");
-        if (ftruncate(fd, length) == -1)
-            shm_error("Failed to truncate..");
+        if (fstat(fd, &st) == -1)
+            shm_error("Failed to stat shared memory");
+        if (!st.st_size) { // being created by others.
+            errno = EAGAIN;
+            goto err;
+        }
+        *length = st.st_size;
     }
 
     /* Map shared memory object */
-    r = (shm_region*) mmap(NULL, length,
-                           PROT_READ | PROT_WRITE,
-                           MAP_SHARED, fd, 0);
+    r = mmap(NULL, *length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     if (r == MAP_FAILED)
         shm_error("do mmap");
 
 err:
+    if (fd != -1)
+        close(fd);
     return r;
 }
 
-void shm_region_close(shm_region* region)
+void* file_region_open(const char* path, size_t* length, bool* created)
+{
+    void* r = NULL;
+    int fd = open(path, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC,
+                  S_IRUSR | S_IWUSR);
+    *created = fd != -1;
+    if (*created) {
+        if (ftruncate(fd, *length) == -1) {
+            unlink(path);
+            shm_error("Failed to truncate..");
+        }
+    } else {
+        struct stat st;
+        fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd == -1)
+            shm_error("Failed to open file");
+        if (fstat(fd, &st) == -1)
+            shm_error("Failed to stat file");
+        if (!st.st_size) { // being created by others.
+            errno = EAGAIN;
+            goto err;
+        }
+        *length = st.st_size;
+    }
+
+    r = mmap(NULL, *length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (r == MAP_FAILED)
+        shm_error("do mmap");
+
+err:
+    if (fd != -1)
+        close(fd);
+    return r;
+}
+
+void shm_region_close(void* addr, size_t length)
+{
+    if (addr)
+        munmap(addr, length);
+}
+
+#define REGION_WAIT_MS  100     // for creator of region to initialize it.
+
+/* Waits for creator of region name to size it and to set magic, a creator
+ * killed before that leaves it broken for good: it is removed and created
+ * again then. Processes which time out together may remove each other's
+ * regions, those already mapped are only left unshared.
+ */
+static void* region_attach(const char* name, size_t* length, bool* created,
+                           uint32 magic, bool file)
+{
+    size_t size = *length;
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < REGION_WAIT_MS; i++) {
+            *length = size;
+            uint32* r = file ? file_region_open(name, length, created) :
+                shm_region_open(name, length, created);
+            if (r && *created)
+                return r;
+            if (!r && errno != EAGAIN)
+                return NULL;
+
+            for (; r && i < REGION_WAIT_MS; i++) {
+                if (__atomic_load_n(r, __ATOMIC_ACQUIRE) == magic)
+                    return r;
+                usleep(1000);
+            }
+
+            shm_region_close(r, *length);
+            if (!r)
+                usleep(1000);
+        }
+
+        mlog(VERBOSE, "Shared region %s is left uninitialized, "
+             "creating it again.\n", name);
+        if (file)
+            unlink(name);
+        else
+            shm_unlink(name);
+    }
+    return NULL;
+}
+
+void* shm_region_attach(const char* key, size_t* length, bool* created,
+                        uint32 magic)
+{
+    return region_attach(key, length, created, magic, false);
+}
+
+void* file_region_attach(const char* path, size_t* length, bool* created,
+                         uint32 magic)
 {
-    ;
+    return region_attach(path, length, created, magic, true);
 }
 
 /*
@@ -69,16 +69,42 @@ char *fm_get_directory(fh_map * fm);
 bool safe_write(int fd, char* buf, size_t total);
 size_t get_file_size(fh_map* fm);
 
+/** Puts disk io of calling thread into idle class: data is written to
+ *  files only when disk is not used by others.
+ */
+bool set_io_priority_idle();
+
 // shared memory region.
-#define SHM_LENGTH 4096
-typedef struct _shm_region {
-    size_t len;
-    bool busy;                  // Race condition: this may be used by multiple instances
-    char buf[SHM_LENGTH];
-} shm_region;
-
-shm_region* shm_region_open(const char* key);
-void shm_region_close(shm_region*);
+
+/**
+ * @name shm_region_open - Maps shared memory object key.
+ * @param key - name of shared memory object.
+ * @param length - size to create object with, set to real size of object if
+ *                 it was created by others.
+ * @param created - set to true if object was created by this call.
+ * @return mapped address, or NULL.
+ */
+void* shm_region_open(const char* key, size_t* length, bool* created);
+void shm_region_close(void* addr, size_t length);
+
+/** Maps file at path in the same way, it is unmapped by shm_region_close(). */
+void* file_region_open(const char* path, size_t* length, bool* created);
+
+/**
+ * @name shm_region_attach - Maps shared memory object key as
+ *                           shm_region_open() does, and waits for it to be
+ *                           initialized if it was created by others.
+ * @param magic - first uint32 of region, set by creator once it has
+ *                initialized the rest. Object whose creator died before
+ *                that is removed and created again.
+ * @return mapped address, or NULL.
+ */
+void* shm_region_attach(const char* key, size_t* length, bool* created,
+                        uint32 magic);
+
+/** Maps file at path in the same way as shm_region_attach(). */
+void* file_region_attach(const char* path, size_t* length, bool* created,
+                         uint32 magic);
 
 #endif	/* _FILEUTILS_H_ */
 
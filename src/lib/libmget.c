@@ -27,11 +27,13 @@
 #include "data_utlis.h"
 #include "protocols.h"
 #include "connection.h"
+#include "fileutils.h"
 #include <stdio.h>
 #include <strings.h>
 
 extern log_level g_log_level;
 extern host_cache_type g_hct;
+extern io_engine g_engine;
 
 typedef mget_err(*protocol_handler) (dinfo*, dp_callback, bool*, mget_option*, void*);
 static hash_table *g_handlers = NULL;
@@ -44,6 +46,7 @@ mget_err start_request(const char* url, const file_name* fn, mget_option* opt,
 
     g_log_level = opt->ll;
     g_hct = opt->hct;
+    g_engine = opt->engine;
 
     if (!dinfo_create(url, fn, opt, &info)) {
         ret = ME_RES_ERR;
@@ -66,8 +69,22 @@ mget_err start_request(const char* url, const file_name* fn, mget_option* opt,
 
     mlog(QUIET, "Using internal %s handler...\n", info->ui->protocol);
 
-    if (opt->limit > 0)
-        set_global_bandwidth(opt->limit);
+    set_global_bandwidth(opt->limit);
+    set_host_bandwidth(opt->host_limit);
+    set_pool_limits(opt->pool_size, opt->pool_timeout);
+    set_dns_cache(opt->dns_entries, opt->dns_ttl);
+    set_spread_mode(opt->spread);
+    set_fast_open(opt->fastopen);
+    set_source_addresses(opt->sources);
+    set_unix_socket(opt->unix_socket);
+    set_zerocopy_receive(opt->zerocopy);
+    set_scavenger_mode(opt->background);
+    set_io_stats(opt->io_stats);
+    set_shared_limits(opt->shared_conns, opt->shared_limit);
+    if (opt->background)
+        set_io_priority_idle();
+    set_socket_tuning(opt->profile, opt->rcvbuf, opt->congestion,
+                      opt->keepalive);
 
     ret = handler(info, cb, stop_flag, opt, user_data);
 
@@ -76,6 +93,14 @@ mget_err start_request(const char* url, const file_name* fn, mget_option* opt,
     return ret;
 }
 
+void mget_request_stop(bool* stop_flag)
+{
+    if (stop_flag)
+        *stop_flag = true;
+
+    connection_wakeup();
+}
+
 void mget_cleanup()
 {
     hash_table_destroy(g_handlers);
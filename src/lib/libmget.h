@@ -65,14 +65,50 @@ typedef enum _host_cache_type {
 	HC_UPDATE
 } host_cache_type;
 
+typedef enum _io_engine {
+	IE_DEFAULT = 0,		// best engine available on this platform.
+	IE_SELECT,
+	IE_EPOLL,
+	IE_URING,		// io_uring, falls back to default if not supported.
+} io_engine;
+
+
+typedef enum _sock_profile {
+	SP_DEFAULT = 0,		// TCP_NODELAY and keepalive, buffers autotuned.
+	SP_NONE,		// kernel defaults.
+	SP_LFN,			// long fat network: receive buffer sized from
+				// measured bandwidth-delay product, bbr.
+} sock_profile;
 
 typedef struct _mget_option {
 	int max_connections;
 	char *user;
 	char *passwd;
-	int limit;
+	int limit;		// global bandwidth limit, bytes per second.
+	int host_limit;		// bandwidth limit of single host.
+	int pool_size;		// idle connections kept per host, -1 to disable.
+	int pool_timeout;	// seconds to keep idle connections.
+	int dns_entries;	// number of hosts in shared dns cache.
+	int dns_ttl;		// seconds to keep addresses in dns cache.
+	int shared_conns;	// connections to a host of all processes.
+	int shared_limit;	// bandwidth of all processes.
+	bool spread;		// spread connections over addresses of host.
+	bool fastopen;		// send first request in SYN (TCP Fast Open).
+	char *sources;		// source addresses or interfaces to bind,
+				// separated by comma, NULL for default.
+	bool background;	// scavenger mode, yield to other traffic.
+	bool zerocopy;		// receive plain TCP with TCP_ZEROCOPY_RECEIVE.
+	bool io_stats;		// report syscalls per MB received.
+	char *unix_socket;	// reach all hosts through this unix socket,
+				// e.g. a local caching proxy, NULL for TCP.
+	sock_profile profile;	// socket tuning profile.
+	int rcvbuf;		// receive buffer in bytes, 0 to use profile's.
+	char *congestion;	// congestion control, NULL to use profile's.
+	int keepalive;		// seconds idle before keepalive probes, 0 to
+				// use profile's, -1 to disable.
 	log_level ll;
 	host_cache_type hct;
+	io_engine engine;
     bool informational;
 
     struct mget_proxy {
@@ -107,6 +143,14 @@ mget_err start_request(const char *url, const file_name * fn,
                        bool * stop_flag, void *user_data);
 
 
+/**
+ * @name mget_request_stop - Sets stop flag and wakes up pending transfers.
+ * @param stop_flag - Flag passed to start_request.
+ * @return void
+ * @note It is safe to call this from signal handlers.
+ */
+void mget_request_stop(bool * stop_flag);
+
 /**
  * @name metadata_inspect - show content of metadata
  * @param  - path of metadata.
@@ -28,16 +28,18 @@
 #include <stdarg.h>
 #include <sys/time.h>
 #include <stdlib.h>
+#include <limits.h>
 
 int get_time_ms()
 {
     struct timeval tv;
 
-    if (gettimeofday(&tv, NULL) == 1) {
+    if (gettimeofday(&tv, NULL) == -1) {
         return 0;
     }
 
-    return (int) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    // Wraps around, computed unsigned so that it does not overflow.
+    return (int) (uint32) ((uint64) tv.tv_sec * 1000 + tv.tv_usec / 1000);
 }
 
 int get_time_s()
@@ -45,6 +47,15 @@ int get_time_s()
     return (int) time(NULL);
 }
 
+uint64 get_monotonic_ms()
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        return 0;
+
+    return (uint64) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 #define MINUTE     (60)
 #define HOUR       (MINUTE*60)
 #define DAY       (HOUR*24)
@@ -87,7 +98,41 @@ char *current_time_str()
 
 int integer_size(const char *size)
 {
-    return 1024 * 512;
+    if (!size)
+        return 0;
+
+    char *end = NULL;
+    double val = strtod(size, &end);
+    if (end == size || !(val >= 0))
+        return -1;
+
+    switch (*end++) {
+        case 'g':
+        case 'G': {
+            val *= G;
+            break;
+        }
+        case 'm':
+        case 'M': {
+            val *= M;
+            break;
+        }
+        case 'k':
+        case 'K': {
+            val *= K;
+            break;
+        }
+        default: {
+            end--;              // no suffix.
+            break;
+        }
+    }
+
+    // Other fields may follow a comma.
+    if (*end && *end != ',')
+        return -1;
+
+    return val > INT_MAX ? INT_MAX : (int) val;
 }
 
 
@@ -36,12 +36,19 @@ extern "C" {
 
 // user should copy this tring after it returns!
 const char *stringify_size(uint64 sz);
+
+// Converts size like "10M" into bytes (suffix: K, M or G), it may be followed
+// by a comma and other fields. Returns -1 if invalid.
 int integer_size(const char *size);
 
 bool file_existp(const char *fn);
 
+// Wall clock in milliseconds, wraps around: use get_monotonic_ms() to
+// measure intervals.
 int get_time_ms();
 int get_time_s();
+// Milliseconds elapsed since an arbitrary point, not affected by clock changes.
+uint64 get_monotonic_ms();
 char *stringify_time(uint64 ts);
 char *current_time_str();
 
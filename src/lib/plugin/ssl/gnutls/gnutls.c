@@ -22,12 +22,18 @@
 
 #include "../../../logutils.h"
 #include "../../../mget_macros.h"
+#include "../../../connection.h"
+#include "../../../data_utlis.h"
+#include "../../../tls_cache.h"
 #include "../ssl.h"
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <errno.h>
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
+#if GNUTLS_VERSION_NUMBER >= 0x030704
+#include <gnutls/socket.h>
+#endif
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,6 +42,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 /* A very basic TLS client, with anonymous authentication. */
@@ -46,7 +53,120 @@
    confused with actual gnutls functions -- such as the gnutls_read
    preprocessor macro.  */
 
+/* GnuTLS does not queue data it can't send for now: a record that got
+ * GNUTLS_E_AGAIN is resumed by sending nothing, before anything else is sent.
+ * Data written is queued here instead, so that writes never have to be
+ * issued again by callers.
+ */
+typedef struct _gnutls_wrapper {
+    gnutls_session_t session;
+    int rwant;                  // WT_READ/WT_WRITE read is waiting for.
+    int wwant;                  // WT_READ/WT_WRITE wq is waiting for.
+    byte_queue *wq;             // accepted by write, not taken by GnuTLS yet.
+    bool resume;                // record from head of wq was cut short.
+    bool ticket_wait;           // session is saved once ticket is got.
+} gnutls_wrapper;
+
+/* Latest session data got from each host, connections to the same host
+ * resume it instead of doing full handshakes. Sessions are also kept in tls
+ * cache, for processes started later. Entry of host is set as user pointer
+ * of gnutls sessions.
+ */
+typedef struct _ssl_cached {
+    struct _ssl_cached *next;
+    char *host;
+    int port;
+    gnutls_datum_t data;        // empty if no session is got yet.
+} ssl_cached;
+
+#define HANDSHAKE_TIMEOUT  30   // seconds, for make_socket_secure() only.
+#define PAGE               4096
+
 static gnutls_certificate_credentials_t credentials;
+static ssl_cached *g_sessions = NULL;
+static uint32 g_full = 0;       // number of full handshakes.
+static uint32 g_resumed = 0;    // number of resumed handshakes.
+
+/* Returns entry of host, session is loaded from tls cache if this process
+ * has not got one yet.
+ */
+static ssl_cached *session_get(const char *host, int port)
+{
+    ssl_cached *c = g_sessions;
+    while (c && (c->port != port || strcmp(c->host, host)))
+        c = c->next;
+
+    if (!c) {
+        c = ZALLOC1(ssl_cached);
+        c->host = strdup(host);
+        c->port = port;
+        c->next = g_sessions;
+        g_sessions = c;
+    }
+
+    if (!c->data.size) {
+        unsigned char buf[TLS_CACHE_DATA];
+        int size = tls_cache_get(host, port, buf, sizeof(buf));
+        if (size && (c->data.data = gnutls_malloc(size))) {
+            memcpy(c->data.data, buf, size);
+            c->data.size = size;
+        }
+    }
+    return c;
+}
+
+static void session_save(gnutls_session_t session)
+{
+    ssl_cached *c = gnutls_session_get_ptr(session);
+    gnutls_datum_t data;
+    if (!c || gnutls_session_get_data2(session, &data) < 0)
+        return;
+
+    gnutls_free(c->data.data);
+    c->data = data;
+    tls_cache_put(c->host, c->port, data.data, data.size,
+                  time(NULL) + gnutls_db_get_default_cache_expiration());
+}
+
+/* Under TLS 1.3 session ticket is sent after handshake, along with data:
+ * session got by handshake can't be resumed, it is saved once reads have got
+ * its ticket instead.
+ */
+static void ticket_check(gnutls_wrapper *wrapper)
+{
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+    if (wrapper->ticket_wait &&
+        (gnutls_session_get_flags(wrapper->session) &
+         GNUTLS_SFLAGS_SESSION_TICKET)) {
+        wrapper->ticket_wait = false;
+        session_save(wrapper->session);
+    }
+#endif
+}
+
+bool ssl_has_session(const char *host, int port)
+{
+    return host && session_get(host, port)->data.size;
+}
+
+void ssl_cleanup()
+{
+    if (g_full || g_resumed) {
+        mlog(VERBOSE, "TLS handshakes: %u full, %u resumed.\n", g_full,
+             g_resumed);
+        g_full = g_resumed = 0;
+    }
+
+    while (g_sessions) {
+        ssl_cached *c = g_sessions;
+        g_sessions = c->next;
+        gnutls_free(c->data.data);
+        FIF(c->host);
+        FIF(c);
+    }
+    tls_cache_close();
+}
+
 bool ssl_init()
 {
     /* Becomes true if GnuTLS is initialized. */
@@ -61,85 +181,240 @@ bool ssl_init()
     gnutls_certificate_allocate_credentials(&credentials);
     gnutls_certificate_set_verify_flags(credentials,
                                         GNUTLS_VERIFY_ALLOW_X509_V1_CA_CRT);
+    tls_cache_open(tls_cache_path(), 0);
 
     ssl_initialized = true;
 
     return true;
 }
 
-static void gnutls_close(int fd, void *arg)
+void ssl_destroy(void *priv)
+{
+    CAST(gnutls_wrapper, wrapper, priv);
+    if (wrapper) {
+        /*gnutls_bye (ctx->session, GNUTLS_SHUT_RDWR); */
+        gnutls_deinit(wrapper->session);
+        bq_destroy(wrapper->wq);
+        FIF(wrapper);
+    }
+}
+
+/* Returns COF_AGAIN with errno set as a non-blocking socket does, if ret
+ * tells record should be received or sent again, direction session waits
+ * for is recorded into want then.
+ */
+static int gnutls_again(gnutls_session_t session, int ret, int *want)
+{
+    if (ret != GNUTLS_E_AGAIN && ret != GNUTLS_E_INTERRUPTED)
+        return ret;
+
+    *want = gnutls_record_get_direction(session) ? WT_WRITE : WT_READ;
+    errno = EAGAIN;
+    return COF_AGAIN;
+}
+
+/* Keeps data GnuTLS can't take for now, it is sent by gnutls_flush(). */
+static void gnutls_queue(gnutls_wrapper *wrapper, const char *buf,
+                         uint32 size)
+{
+    if (!wrapper->wq)
+        wrapper->wq = bq_init(MAX(size, PAGE));
+    bq_enlarge(wrapper->wq, size);
+    memcpy(wrapper->wq->w, buf, size);
+    wrapper->wq->w += size;
+}
+
+static inline bool gnutls_queued(gnutls_wrapper *wrapper)
+{
+    return wrapper->wq && wrapper->wq->r < wrapper->wq->w;
+}
+
+/* Sends data kept by gnutls_queue() as long as socket takes it, returns
+ * negative GnuTLS error if session failed. Queue may be reallocated while a
+ * record is cut short: GnuTLS has encrypted it already, it is resumed
+ * without data.
+ */
+static int gnutls_flush(gnutls_wrapper *wrapper)
 {
-    gnutls_session_t *session = arg;
+    byte_queue *wq = wrapper->wq;
+    wrapper->wwant = 0;
+    while (gnutls_queued(wrapper)) {
+        ssize_t n = wrapper->resume ?
+            gnutls_record_send(wrapper->session, NULL, 0) :
+            gnutls_record_send(wrapper->session, wq->r, wq->w - wq->r);
+        if (gnutls_again(wrapper->session, (int) n, &wrapper->wwant) ==
+            COF_AGAIN) {
+            wrapper->resume = true;
+            return 0;
+        }
 
-    /*gnutls_bye (ctx->session, GNUTLS_SHUT_RDWR); */
-    gnutls_deinit(*session);
-    /* xfree (ctx); */
-    close(fd);
+        wrapper->resume = false;
+        if (n < 0) {
+            mlog(ALWAYS, "GnuTLS: (write) %s\n", gnutls_strerror(n));
+            return (int) n;
+        }
+        wq->r += n;
+    }
+
+    if (wq && wq->r != wq->p)
+        bq_reset(wq);
+    return 0;
 }
 
+/* Reads never wait: COF_AGAIN is returned if GnuTLS needs socket to be
+ * ready, secure_socket_want() tells for what.
+ */
 int secure_socket_read(int sk, char *buf, uint32 size, void *priv)
 {
-    if (priv)                   //@todo: need to read all content in tls buffer!!!
-    {
-        gnutls_session_t *session = (gnutls_session_t *) priv;
+    if (priv) {
+        gnutls_wrapper *wrapper = (gnutls_wrapper *) priv;
+        wrapper->rwant = 0;
+        if (gnutls_flush(wrapper) < 0)
+            return -1;
 
-        return gnutls_record_recv(*session, buf, size);
+        int rd = gnutls_again(wrapper->session,
+                              gnutls_record_recv(wrapper->session, buf, size),
+                              &wrapper->rwant);
+        ticket_check(wrapper);
+        return rd;
     }
 
     return 0;
 }
 
+/* Writes never wait either: data socket can't take for now is queued, and
+ * sent by following reads and writes once it is ready.
+ */
 int secure_socket_write(int sk, char *buf, uint32 size, void *priv)
 {
     if (priv) {
-        gnutls_session_t *session = (gnutls_session_t *) priv;
+        gnutls_wrapper *wrapper = (gnutls_wrapper *) priv;
+        if (gnutls_flush(wrapper) < 0)
+            return -1;
 
-        return gnutls_record_send(*session, buf, size);
+        gnutls_queue(wrapper, buf, size);
+        return gnutls_flush(wrapper) < 0 ? -1 : (int) size;
     }
     return 0;
 }
 
-void *make_socket_secure(int sk)
+bool secure_socket_has_more(int sk, void *priv)
 {
-    gnutls_session_t *session = ZALLOC1(gnutls_session_t);
+    gnutls_wrapper *wrapper = (gnutls_wrapper *) priv;
+    return wrapper && gnutls_record_check_pending(wrapper->session) > 0;
+}
 
-    if (!session) {
-        goto free;
+bool secure_socket_ktls(void *priv)
+{
+#if GNUTLS_VERSION_NUMBER >= 0x030704
+    // Enabled by "ktls = true" in system wide config of GnuTLS.
+    gnutls_wrapper *wrapper = (gnutls_wrapper *) priv;
+    return wrapper &&
+        (gnutls_transport_is_ktls_enabled(wrapper->session) &
+         GNUTLS_KTLS_RECV);
+#else
+    return false;
+#endif
+}
+
+int secure_socket_want(void *priv)
+{
+    gnutls_wrapper *wrapper = (gnutls_wrapper *) priv;
+    if (!wrapper)
+        return 0;
+    return wrapper->rwant | (gnutls_queued(wrapper) ? wrapper->wwant : 0);
+}
+
+void *ssl_create(int sk, const char *host, int port)
+{
+    gnutls_wrapper *wrapper = ZALLOC1(gnutls_wrapper);
+
+    if (!wrapper) {
+        goto ret;
     }
 
-    int err = 0;
+    gnutls_session_t *session = &wrapper->session;
 
     gnutls_init(session, GNUTLS_CLIENT);
 
-    gnutls_set_default_priority(*session);
+    // Protocol versions are left to default priority, which no longer
+    // allows SSL3.
+    int err = gnutls_set_default_priority(*session);
+    if (err < 0) {
+        mlog(ALWAYS, "GnuTLS: (set_priority) %s\n",
+             gnutls_strerror(err));
+        ssl_destroy(wrapper);
+        wrapper = NULL;
+        goto ret;
+    }
+
     gnutls_credentials_set(*session, GNUTLS_CRD_CERTIFICATE, credentials);
-    gnutls_transport_set_ptr(*session, (gnutls_transport_ptr_t) sk);
-    /* gnutls_transport_set_int2 (*session, sk, sk); */
+    gnutls_transport_set_int(*session, sk);
 
-    int allowed_protocols[4] = { 0, 0, 0, 0 };
-    allowed_protocols[0] = GNUTLS_SSL3;
-    err = gnutls_protocol_set_priority(*session, allowed_protocols);
+    if (host) {
+        ssl_cached *c = session_get(host, port);
+        gnutls_session_set_ptr(*session, c);
+        if (c->data.size)
+            gnutls_session_set_data(*session, c->data.data, c->data.size);
+    }
+ret:
+    return wrapper;
+}
+
+int ssl_handshake(void *priv)
+{
+    gnutls_wrapper *wrapper = (gnutls_wrapper *) priv;
+    gnutls_session_t session = wrapper->session;
+    int err = gnutls_handshake(session);
+    if (err == GNUTLS_E_AGAIN || err == GNUTLS_E_INTERRUPTED)
+        return gnutls_record_get_direction(session) ? WT_WRITE : WT_READ;
 
     if (err < 0) {
-        mlog(NOTQUIET, "GnuTLS: (set_priority) %s\n",
+        mlog(ALWAYS, "GnuTLS: (handshake) %s\n",
              gnutls_strerror(err));
-        goto err;
+        return -1;
     }
 
-    err = gnutls_handshake(*session);
-    if (err < 0) {
-        mlog(NOTQUIET, "GnuTLS: (handshake) %s\n",
-             gnutls_strerror(err));
-        goto err;
-    } else {
+    if (gnutls_session_is_resumed(session))
+        g_resumed++;
+    else
+        g_full++;
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+    if (gnutls_protocol_get_version(session) == GNUTLS_TLS1_3 &&
+        !(gnutls_session_get_flags(session) & GNUTLS_SFLAGS_SESSION_TICKET)) {
+        wrapper->ticket_wait = true;    // see ticket_check().
+        return 0;
+    }
+#endif
+    session_save(session);
+    return 0;
+}
+
+bool ssl_start_early(void *priv)
+{
+    return false;               // not supported yet.
+}
+
+void *make_socket_secure(int sk, const char *host, int port)
+{
+    gnutls_wrapper *wrapper = ssl_create(sk, host, port);
+    if (!wrapper) {
         goto ret;
     }
-err:
-    gnutls_deinit(*session);
-free:
-    FIFZ(&session);
+
+    // Only used by blocking callers, event loops drive ssl_handshake().
+    int err = 0;
+    while ((err = ssl_handshake(wrapper)) > 0) {
+        if (!timed_wait(sk, err, HANDSHAKE_TIMEOUT))
+            break;
+    }
+
+    if (err) {
+        ssl_destroy(wrapper);
+        wrapper = NULL;
+    }
 ret:
-    return session;
+    return wrapper;
 }
 
 /*
@@ -24,19 +24,39 @@
 #include "../../../mget_macros.h"
 #include "../../../connection.h"
 #include "../../../data_utlis.h"
+#include "../../../tls_cache.h"
 #include "../ssl.h"
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 typedef struct _ssl_wrapper {
-    SSL_CTX *ctx;
     SSL *ssl;
     BIO *bio;
     int sock;
-    byte_queue *bq;
+    int rwant;                  // WT_READ/WT_WRITE read is waiting for.
+    int wwant;                  // WT_READ/WT_WRITE wq is waiting for.
+    byte_queue *wq;             // accepted by write, not taken by SSL yet.
+    char *host;                 // sessions are cached by host and port.
+    int port;
+    bool early;                 // handshake is left to first read.
+    byte_queue *eq;             // sent as early data, resent if rejected.
 } ssl_wrapper;
 
+/* Latest session got from each host, connections to the same host resume it
+ * instead of doing full handshakes. Sessions are also kept in tls cache, for
+ * processes started later.
+ */
+typedef struct _ssl_cached {
+    struct _ssl_cached *next;
+    char *host;
+    int port;
+    SSL_SESSION *sess;
+} ssl_cached;
+
 #define berr_exit(msg)                                  \
     do {                                                \
         mlog(ALWAYS, msg ", %s",                        \
@@ -47,8 +67,98 @@ typedef struct _ssl_wrapper {
 #define CHECK_PTR(X, msg) if (!X) berr_exit(msg)
 #define CHECK_W_PTR(X)    if (!X) berr_exit("Failed to create "#X)
 #define PAGE       4096
+#define HANDSHAKE_TIMEOUT  30   // seconds, for make_socket_secure() only.
+
+// Sessions can be copied, and early data can be sent since 1.1.1.
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+#define HAVE_TLS13  1
+#endif
+
+// Records can be received by kernel TLS since 3.0, if it is built in.
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define HAVE_KTLS   1
+#endif
 
 static bool g_initilized = false;
+static SSL_CTX *g_ctx = NULL;   // shared by all connections.
+static ssl_cached *g_sessions = NULL;
+static uint32 g_full = 0;       // number of full handshakes.
+static uint32 g_resumed = 0;    // number of resumed handshakes.
+static uint32 g_early = 0;      // number of early data accepted.
+static uint32 g_rejected = 0;   // number of early data rejected.
+static uint32 g_ktls = 0;       // number of handshakes leading to kTLS.
+
+static ssl_cached *session_find(const char *host, int port)
+{
+    ssl_cached *c = g_sessions;
+    while (c && (c->port != port || strcmp(c->host, host)))
+        c = c->next;
+    return c;
+}
+
+static ssl_cached *session_put(const char *host, int port, SSL_SESSION *sess)
+{
+    ssl_cached *c = session_find(host, port);
+    if (!c) {
+        c = ZALLOC1(ssl_cached);
+        c->host = strdup(host);
+        c->port = port;
+        c->next = g_sessions;
+        g_sessions = c;
+    } else if (c->sess) {
+        SSL_SESSION_free(c->sess);
+    }
+
+    c->sess = sess;
+    return c;
+}
+
+/* Returns session of host, loading it from tls cache if it is not got by
+ * this process yet.
+ */
+static ssl_cached *session_get(const char *host, int port)
+{
+    if (!host)
+        return NULL;
+
+    ssl_cached *c = session_find(host, port);
+    if (c)
+        return c;
+
+    unsigned char buf[TLS_CACHE_DATA];
+    int size = tls_cache_get(host, port, buf, sizeof(buf));
+    const unsigned char *p = buf;
+    SSL_SESSION *sess = size ? d2i_SSL_SESSION(NULL, &p, size) : NULL;
+    if (!sess)
+        return NULL;
+
+    PDEBUG("session of %s:%d loaded from cache.\n", host, port);
+    return session_put(host, port, sess);
+}
+
+/* Called when a session is got from server: once handshake is finished for
+ * TLS 1.2, or when ticket arrives after it for TLS 1.3. Returns 1 as
+ * reference of sess is kept.
+ */
+static int session_new(SSL *ssl, SSL_SESSION *sess)
+{
+    ssl_wrapper *wrapper = (ssl_wrapper *) SSL_get_app_data(ssl);
+    if (!wrapper || !wrapper->host)
+        return 0;
+
+    PDEBUG("session of %s:%d cached.\n", wrapper->host, wrapper->port);
+    session_put(wrapper->host, wrapper->port, sess);
+
+    unsigned char buf[TLS_CACHE_DATA];
+    unsigned char *p = buf;
+    int size = i2d_SSL_SESSION(sess, NULL);
+    if (size > 0 && size <= (int) sizeof(buf) && i2d_SSL_SESSION(sess, &p))
+        tls_cache_put(wrapper->host, wrapper->port, buf, size,
+                      SSL_SESSION_get_time(sess) +
+                      SSL_SESSION_get_timeout(sess));
+    return 1;
+}
+
 bool ssl_init()
 {
     if (!g_initilized) {
@@ -62,43 +172,214 @@ bool ssl_init()
         g_initilized = true;
     }
 
+    if (!g_ctx) {
+        g_ctx = SSL_CTX_new(SSLv23_client_method());
+        CHECK_W_PTR(g_ctx);
+        SSL_CTX_set_verify(g_ctx, SSL_VERIFY_NONE, NULL);
+        SSL_CTX_set_mode(g_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                         SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+        // Sessions are kept per host by session_new(), not by ctx.
+        SSL_CTX_set_session_cache_mode(g_ctx, SSL_SESS_CACHE_CLIENT |
+                                       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(g_ctx, session_new);
+#ifdef HAVE_KTLS
+        // Used only if kernel has tls module and supports the cipher.
+        SSL_CTX_set_options(g_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+        tls_cache_open(tls_cache_path(), 0);
+    }
+
     return true;
 }
 
-int secure_socket_read(int sk, char *buf, uint32 size, void *priv)
+bool ssl_has_session(const char *host, int port)
 {
-    if ((int)size < 0)
+    return session_get(host, port) != NULL;
+}
+
+void ssl_cleanup()
+{
+    if (g_full || g_resumed) {
+        mlog(VERBOSE, "TLS handshakes: %u full, %u resumed.\n", g_full,
+             g_resumed);
+        g_full = g_resumed = 0;
+    }
+    if (g_early || g_rejected) {
+        mlog(VERBOSE, "TLS early data: %u accepted, %u rejected.\n",
+             g_early, g_rejected);
+        g_early = g_rejected = 0;
+    }
+    if (g_ktls) {
+        mlog(VERBOSE, "TLS records received by kernel: %u connections.\n",
+             g_ktls);
+        g_ktls = 0;
+    }
+
+    while (g_sessions) {
+        ssl_cached *c = g_sessions;
+        g_sessions = c->next;
+        SSL_SESSION_free(c->sess);
+        FIF(c->host);
+        FIF(c);
+    }
+
+    if (g_ctx) {
+        SSL_CTX_free(g_ctx);
+        g_ctx = NULL;
+        tls_cache_close();
+    }
+}
+
+/* Records which direction SSL waits for, returns COF_AGAIN with errno set
+ * as a non-blocking socket does.
+ */
+static int ssl_again(int *want, int e)
+{
+    *want = e == SSL_ERROR_WANT_WRITE ? WT_WRITE : WT_READ;
+    errno = EAGAIN;
+    return COF_AGAIN;
+}
+
+/* Keeps data SSL can't take for now, it is written by ssl_flush(). */
+static void ssl_queue(ssl_wrapper *wrapper, const char *buf, uint32 size)
+{
+    if (!wrapper->wq)
+        wrapper->wq = bq_init(MAX(size, PAGE));
+    bq_enlarge(wrapper->wq, size);
+    memcpy(wrapper->wq->w, buf, size);
+    wrapper->wq->w += size;
+}
+
+static inline bool ssl_queued(ssl_wrapper *wrapper)
+{
+    return wrapper->wq && wrapper->wq->r < wrapper->wq->w;
+}
+
+/* Writes data kept by ssl_queue() as long as socket takes it. A write
+ * retried by SSL may start elsewhere and be longer, as queue is reallocated
+ * and appended: SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER allows that.
+ */
+static void ssl_flush(ssl_wrapper *wrapper)
+{
+    byte_queue *wq = wrapper->wq;
+    wrapper->wwant = 0;
+    while (ssl_queued(wrapper)) {
+        int n = SSL_write(wrapper->ssl, wq->r, wq->w - wq->r);
+        if (n > 0) {
+            wq->r += n;
+            continue;
+        }
+
+        int e = SSL_get_error(wrapper->ssl, n);
+        if (e != SSL_ERROR_WANT_WRITE && e != SSL_ERROR_WANT_READ)
+            berr_exit("SSL write problem");
+        ssl_again(&wrapper->wwant, e);
+        return;
+    }
+
+    if (wq && wq->r != wq->p)
+        bq_reset(wq);
+}
+
+#ifdef HAVE_TLS13
+/* Goes on with handshake started by ssl_start_early(), returns 0 once it is
+ * finished, COF_AGAIN if socket should be waited for, or -1 if it failed.
+ * Early data rejected by server is queued to be sent again.
+ */
+static int early_finish(ssl_wrapper *wrapper)
+{
+    int ret = ssl_handshake(wrapper);
+    if (ret > 0) {
+        wrapper->rwant = ret;
+        errno = EAGAIN;
+        return COF_AGAIN;
+    }
+
+    wrapper->early = false;
+    if (ret < 0) {
+        mlog(ALWAYS, "TLS handshake with %s failed.\n", wrapper->host);
         return -1;
+    }
 
-    ssl_wrapper *wrapper = (ssl_wrapper *) priv;
-    int bq_size = wrapper->bq->w - wrapper->bq->r;
-    if (bq_size > 0) {
-        int s =  MIN(bq_size, size);
-        memcpy(buf, wrapper->bq->r,s);
-        wrapper->bq->r += s;
-        if (wrapper->bq->r == wrapper->bq->w) {
-            bq_reset(wrapper->bq);
+    byte_queue *eq = wrapper->eq;
+    wrapper->eq = NULL;
+    if (SSL_get_early_data_status(wrapper->ssl) == SSL_EARLY_DATA_ACCEPTED) {
+        g_early++;
+    } else {
+        PDEBUG("early data rejected by %s, sending it again.\n",
+               wrapper->host);
+        g_rejected++;
+
+        // It goes before data queued during handshake.
+        if (ssl_queued(wrapper)) {
+            size_t size = wrapper->wq->w - wrapper->wq->r;
+            bq_enlarge(eq, size);
+            memcpy(eq->w, wrapper->wq->r, size);
+            eq->w += size;
         }
-        return s;
+        bq_destroy(wrapper->wq);
+        wrapper->wq = eq;
+        eq = NULL;
     }
 
-    int ret = 0;
-    bool extended = false;
-retry:
-    if (!timed_wait(wrapper->sock, WT_READ, -1)) {
-        mlog(ALWAYS, "%s: socket not ready.\n", __func__);
-        return 0;
+    bq_destroy(eq);
+    return 0;
+}
+
+/* Writes data as early data. What server does not accept as early data, or
+ * socket can't take for now, is queued and sent after handshake.
+ */
+static int early_write(ssl_wrapper *wrapper, char *buf, uint32 size)
+{
+    SSL_SESSION *sess = SSL_get_session(wrapper->ssl);
+    if (ssl_queued(wrapper) || wrapper->eq->w - wrapper->eq->p + size >
+        SSL_SESSION_get_max_early_data(sess)) {
+        ssl_queue(wrapper, buf, size);
+        return (int) size;
     }
 
-read:
-    if (extended) {
-        PDEBUG ("buf: %p, size: %d\n", buf, size);
-        int tmp = SSL_read(wrapper->ssl, wrapper->bq->w, size);
-        wrapper->bq->w += tmp;
-        mlog(DEFAULT, "%d bytes saved in bq..\n", tmp);
-    } else
-        ret = SSL_read(wrapper->ssl, buf, size);
+    size_t written = 0;
+    if (!SSL_write_early_data(wrapper->ssl, buf, size, &written)) {
+        int e = SSL_get_error(wrapper->ssl, 0);
+        if (e != SSL_ERROR_WANT_WRITE && e != SSL_ERROR_WANT_READ) {
+            mlog(ALWAYS, "Failed to write early data to %s.\n",
+                 wrapper->host);
+            return -1;
+        }
+        written = 0;
+    }
+
+    bq_enlarge(wrapper->eq, written);
+    memcpy(wrapper->eq->w, buf, written);
+    wrapper->eq->w += written;
+    if (written < size)
+        ssl_queue(wrapper, buf + written, size - written);
+    return (int) size;
+}
+#endif
+
+/* Reads never wait: COF_AGAIN is returned if SSL needs socket to be ready,
+ * secure_socket_want() tells for what. Records already decrypted are
+ * reported by secure_socket_has_more(), callers read again to drain them.
+ */
+int secure_socket_read(int sk, char *buf, uint32 size, void *priv)
+{
+    if ((int)size < 0)
+        return -1;
 
+    ssl_wrapper *wrapper = (ssl_wrapper *) priv;
+    wrapper->rwant = 0;
+#ifdef HAVE_TLS13
+    if (wrapper->early) {
+        int ret = early_finish(wrapper);
+        if (ret)
+            return ret;
+    }
+#endif
+    ssl_flush(wrapper);
+
+    int ret = SSL_read(wrapper->ssl, buf, size);
     int e = SSL_get_error(wrapper->ssl, ret);
     switch (e) {
         case SSL_ERROR_NONE:
@@ -108,15 +389,9 @@ read:
             SSL_shutdown(wrapper->ssl);
             break;
         case SSL_ERROR_WANT_READ:
-            goto retry;
         case SSL_ERROR_WANT_WRITE:
-            if (!timed_wait(wrapper->sock, WT_WRITE, -1)) {
-                mlog(ALWAYS, "%s: socket not ready for write..\n",
-                     __func__);
-            }
-            goto retry;
+            return ssl_again(&wrapper->rwant, e);
         case SSL_ERROR_SYSCALL:{
-            fprintf(stderr, "buf: %p, size: %u\n", buf, size);
             if (!ERR_get_error()) {
                 if (!ret) {
                     mlog(ALWAYS,
@@ -129,104 +404,171 @@ read:
             }
             break;
         }
+#ifdef SSL_R_UNEXPECTED_EOF_WHILE_READING
+        case SSL_ERROR_SSL:{
+            // OpenSSL 3 reports EOF without close_notify in this way.
+            if (ERR_GET_REASON(ERR_peek_error()) ==
+                SSL_R_UNEXPECTED_EOF_WHILE_READING) {
+                ERR_clear_error();
+                mlog(ALWAYS,
+                     "EOF was observed that violates the protocol.\n");
+                return -1;
+            }
+            berr_exit("SSL read problem");
+        }
+#endif
 
         default:
             berr_exit("SSL read problem");
     }
 
-    if (SSL_pending(wrapper->ssl)) {
-        PDEBUG("pending data, size: %d, ret: %d...\n", size, ret);
-        buf  += ret;
-        size -= ret;
-        PDEBUG("pending data, size: %d...\n", (int) size);
-        if ((int) size <= 0) {
-            bq_enlarge(wrapper->bq, PAGE);
-            buf = wrapper->bq->w;
-            size = wrapper->bq->x - wrapper->bq->w;
-            extended = true;
-        }
-        goto read;
-    }
-
     return ret;
 }
 
+/* Writes never wait either: data socket can't take for now is queued, and
+ * written by following reads and writes once it is ready.
+ */
 int secure_socket_write(int sk, char *buf, uint32 size, void *priv)
 {
     ssl_wrapper *wrapper = (ssl_wrapper *) priv;
-
-    /* Try to write */
-retry:
-    if (!timed_wait(wrapper->sock, WT_WRITE, -1)) {
-        mlog(ALWAYS, "%s: socket not ready.\n", __func__);
-        return 0;
+#ifdef HAVE_TLS13
+    if (wrapper->early)
+        return early_write(wrapper, buf, size);
+#endif
+
+    ssl_flush(wrapper);
+    if (ssl_queued(wrapper)) {
+        ssl_queue(wrapper, buf, size);
+        return (int) size;
     }
 
     int r = SSL_write(wrapper->ssl, buf, size);
-    switch (SSL_get_error(wrapper->ssl, r)) {
-        case SSL_ERROR_NONE:
-            break;
-        case SSL_ERROR_WANT_WRITE:
-            goto retry;
-        case SSL_ERROR_WANT_READ:
-            if (!timed_wait(wrapper->sock, WT_READ, -1)) {
-                mlog(ALWAYS, "%s: socket not ready for reading\n",
-                     __func__);
-            }
-            goto retry;
-        default:
+    if (r <= 0) {
+        int e = SSL_get_error(wrapper->ssl, r);
+        if (e != SSL_ERROR_WANT_WRITE && e != SSL_ERROR_WANT_READ)
             berr_exit("SSL write problem");
+        ssl_again(&wrapper->wwant, e);
+        r = 0;
     }
 
-    return r;
+    if (r < (int) size)
+        ssl_queue(wrapper, buf + r, size - r);
+    return (int) size;
 }
 
-void* make_socket_secure(int sock)
+bool secure_socket_ktls(void *priv)
 {
-    PDEBUG("enter with sock: %d\n", sock);
+#ifdef HAVE_KTLS
+    ssl_wrapper *wrapper = (ssl_wrapper *) priv;
+    return wrapper && BIO_get_ktls_recv(SSL_get_rbio(wrapper->ssl));
+#else
+    return false;
+#endif
+}
 
-    ssl_wrapper *wrapper = ZALLOC1(ssl_wrapper);
-    wrapper->ctx = SSL_CTX_new(SSLv23_client_method());
-    CHECK_W_PTR(wrapper->ctx);
-    SSL_CTX_set_verify(wrapper->ctx, SSL_VERIFY_NONE, NULL);
-    SSL_CTX_set_mode(wrapper->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
+int secure_socket_want(void *priv)
+{
+    ssl_wrapper *wrapper = (ssl_wrapper *) priv;
+    if (!wrapper)
+        return 0;
+    return wrapper->rwant | (ssl_queued(wrapper) ? wrapper->wwant : 0);
+}
 
+void* ssl_create(int sock, const char *host, int port)
+{
+    PDEBUG("enter with sock: %d\n", sock);
 
-    wrapper->ssl = SSL_new(wrapper->ctx);
+    ssl_init();
+    ssl_wrapper *wrapper = ZALLOC1(ssl_wrapper);
+    wrapper->ssl = SSL_new(g_ctx);
     CHECK_W_PTR(wrapper->ssl);
 
     wrapper->bio = BIO_new_socket(sock, BIO_NOCLOSE);
     CHECK_W_PTR(wrapper->bio);
 
     wrapper->sock = sock;
-    wrapper->bq = bq_init(PAGE);
 
-    PDEBUG("ctx: %p ssl: %p, bio: %p\n", wrapper->ctx, wrapper->ssl,
-           wrapper->bio);
+    PDEBUG("ssl: %p, bio: %p\n", wrapper->ssl, wrapper->bio);
 
     SSL_set_bio(wrapper->ssl, wrapper->bio, wrapper->bio);
-    /* SSL_set_session(ssl,sess);          /\*And resume it*\/ */
-    int ret = 0;
-
-retry:
-    ret = SSL_connect(wrapper->ssl);
-    if (ret <= 0) {
-        unsigned long e = SSL_get_error(wrapper->ssl, ret);
-        if (e != SSL_ERROR_WANT_READ && e != SSL_ERROR_WANT_WRITE) {
-            berr_exit("SSL connect error (second connect)");
+    SSL_set_app_data(wrapper->ssl, wrapper);
+
+    wrapper->host = strdup(host ? host : "");
+    wrapper->port = port;
+    ssl_cached *c = session_get(host, port);
+    if (c) {
+#ifdef HAVE_TLS13
+        // TLS 1.3 session is marked as not resumable once it is used, a copy
+        // is resumed instead so that it can be shared by all connections.
+        SSL_SESSION *sess = SSL_SESSION_dup(c->sess);
+        if (sess) {
+            SSL_set_session(wrapper->ssl, sess);
+            SSL_SESSION_free(sess);
         }
+#else
+        SSL_set_session(wrapper->ssl, c->sess);
+#endif
+    }
+    return wrapper;
+}
+
+int ssl_handshake(void *priv)
+{
+    ssl_wrapper *wrapper = (ssl_wrapper *) priv;
+    int ret = SSL_connect(wrapper->ssl);
+    if (ret > 0) {
+        if (SSL_session_reused(wrapper->ssl))
+            g_resumed++;
+        else
+            g_full++;
+        if (secure_socket_ktls(wrapper))
+            g_ktls++;
+        return 0;
+    }
+
+    switch (SSL_get_error(wrapper->ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            return WT_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return WT_WRITE;
+        default:
+            return -1;
+    }
+}
 
-        int type = WT_NONE;
-        if (e == SSL_ERROR_WANT_READ)
-            type |= WT_READ;
-        else if (e == SSL_ERROR_WANT_WRITE)
-            type |= WT_WRITE;
+bool ssl_start_early(void *priv)
+{
+#ifdef HAVE_TLS13
+    ssl_wrapper *wrapper = (ssl_wrapper *) priv;
+    SSL_SESSION *sess = SSL_get_session(wrapper->ssl);
+    if (!sess || !SSL_SESSION_get_max_early_data(sess))
+        return false;
 
-        if (timed_wait(sock, type, -1))
-            goto retry;
+    PDEBUG("sending early data to %s.\n", wrapper->host);
+    wrapper->early = true;
+    wrapper->eq = bq_init(PAGE);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void* make_socket_secure(int sock, const char *host, int port)
+{
+    ssl_wrapper *wrapper = ssl_create(sock, host, port);
+    int ret = 0;
 
-        mlog(ALWAYS, "Failed to select...\n");
-        abort();
+    // Only used by blocking callers, event loops drive ssl_handshake().
+    while ((ret = ssl_handshake(wrapper)) > 0) {
+        if (!timed_wait(sock, ret, HANDSHAKE_TIMEOUT)) {
+            mlog(ALWAYS, "TLS handshake with %s timed out.\n", host);
+            ssl_destroy(wrapper);
+            return NULL;
+        }
+    }
+
+    if (ret < 0) {
+        berr_exit("SSL connect error (second connect)");
     }
 
     /* check_cert(ssl, host); */
@@ -242,9 +584,10 @@ void ssl_destroy(void *priv)
     if (wrapper)
     {
         /* BIO_free(wrapper->bio); */
-        /* SSL_CTX_free(wrapper->ctx); */
         SSL_free(wrapper->ssl);
-        bq_destroy(wrapper->bq);
+        bq_destroy(wrapper->wq);
+        FIF(wrapper->host);
+        bq_destroy(wrapper->eq);
         FIF(wrapper);
     }
 }
@@ -252,10 +595,7 @@ void ssl_destroy(void *priv)
 bool secure_socket_has_more(int sk, void *priv)
 {
     ssl_wrapper *wrapper = (ssl_wrapper *) priv;
-    PDEBUG ("%d\n", wrapper->bq->w - wrapper->bq->r);
-    if (wrapper && wrapper->bq && (wrapper->bq->w - wrapper->bq->r > 0))
-        return true;
-    return false;
+    return wrapper && SSL_pending(wrapper->ssl) > 0;
 }
 
 
@@ -31,13 +31,52 @@ extern "C" {
 #endif
 
 bool ssl_init();
-void *make_socket_secure(int);
+void *make_socket_secure(int, const char *host, int port);
+
+/* Creates TLS session on a socket without doing handshake, session got
+ * from host before is resumed if there is one.
+ */
+void *ssl_create(int, const char *host, int port);
+
+/* Continues handshake of session created by ssl_create(), returns 0 when it
+ * is finished, WT_READ or WT_WRITE if it should be called again once socket
+ * is readable or writable, or -1 if it failed.
+ */
+int ssl_handshake(void *);
+
+/* Leaves handshake of session created by ssl_create() to first read, if it
+ * resumes a session that accepts early data: data written before that is
+ * sent as early data. Returns false if early data can't be used.
+ */
+bool ssl_start_early(void *);
 void ssl_destroy(void *);
 
+/* Returns true if there is a session of host to resume. */
+bool ssl_has_session(const char *host, int port);
+
+/* Frees shared context and cached sessions, logs handshake counts. */
+void ssl_cleanup();
+
+/* Reads and writes don't wait for socket: read returns COF_AGAIN if it
+ * should be called again once socket is ready, write queues what socket
+ * can't take for now, which is written by following reads and writes.
+ */
 int secure_socket_read(int, char *, uint32, void *);
 int secure_socket_write(int, char *, uint32, void *);
+
+/* Returns true if decrypted data is left to read. */
 bool secure_socket_has_more(int, void *);
 
+/* Returns WT_READ and/or WT_WRITE that socket should be ready for before
+ * reading again, or 0 if it is not waiting for anything.
+ */
+int secure_socket_want(void *);
+
+/* Returns true if records are decrypted by kernel (kTLS), so that socket
+ * gives plaintext to plain reads. Known once handshake is finished.
+ */
+bool secure_socket_ktls(void *);
+
 #ifdef __cplusplus
 }
 #endif
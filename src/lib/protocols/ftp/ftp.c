@@ -234,6 +234,8 @@ Error in server response, closing control ftp_connection.\n"));
 }
 
 
+static int ftp_recv_done(connection * conn, int rd, void *priv);
+
 static int ftp_read_sock(connection * conn, void *priv)
 {
     if (!priv) {
@@ -252,6 +254,29 @@ static int ftp_read_sock(connection * conn, void *priv)
                            (uint32)(dp->end_pos - dp->cur_pos), NULL);
     } while (rd == -1 && errno == EINTR);
 
+    return ftp_recv_done(conn, rd, priv);
+}
+
+static int ftp_get_buffer(connection * conn, void *priv, char **buf,
+                          uint32 * size)
+{
+    co_param *param = (co_param *) priv;
+    data_chunk *dp = (data_chunk *) param->dp;
+
+    if (dp->cur_pos >= dp->end_pos) {
+        return COF_FINISHED;
+    }
+
+    *buf = param->addr + dp->cur_pos;
+    *size = (uint32) MIN(dp->end_pos - dp->cur_pos, (uint64) (1 << 30));
+    return 0;
+}
+
+static int ftp_recv_done(connection * conn, int rd, void *priv)
+{
+    co_param *param = (co_param *) priv;
+    data_chunk *dp = (data_chunk *) param->dp;
+
     if (rd > 0) {
         dp->cur_pos += rd;
         if (param->cb) {
@@ -471,6 +496,8 @@ Error in server response, closing control ftp_connection.\n"));
 
     param->data_conn->priv = param;
     param->data_conn->recv_data = ftp_read_sock;
+    param->data_conn->get_buffer = ftp_get_buffer;
+    param->data_conn->recv_done = ftp_recv_done;
 
     *pconn = conn;
     return FTPOK;
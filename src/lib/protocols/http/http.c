@@ -32,6 +32,8 @@
 
 #define DEFAULT_HTTP_CONNECTIONS 5
 #define PAGE                     4096
+#define MIN_STEAL_SIZE           (512 * K) // Minimum size of stolen chunk.
+#define SAVE_SIZE                (1 * M)   // Max size saved by save_to_fd.
 
 static const char *HEADER_END        = "\r\n\r\n";
 
@@ -46,8 +48,10 @@ typedef struct http_request_context hcontext;
 typedef struct _connection_operation_param {
     void          *addr;                //base addr;
     data_chunk    *dp;
+    uint64         req_end;             // end of requested range, exclusive.
     url_info      *ui;
     bool           header_finished;
+    byte_queue    *hbq;                 // header received so far.
     hash_table    *ht;
     void (*cb) (metadata*, void*);
     metadata      *md;
@@ -114,6 +118,8 @@ static void http_response_destroy(const http_response* rsp);
 
 
 static int parse_respnse(byte_queue*, hash_table**);
+static int response_read(connection*, byte_queue*);
+static const http_response* response_parse(const http_request*, byte_queue*);
 static uint64 get_remote_file_size(url_info*, const http_response**, hcontext*);
 static char* get_suggested_name(const char*);
 static mget_err process_request_single_form(hcontext*);
@@ -123,8 +129,19 @@ static const http_response* get_response(connection*, const http_request* rea);
 static bool setup_proxy(hcontext* context);
 static connection* get_proxied_connection(hcontext* context, bool async);
 static size_t request_send(connection*, const http_request*, byte_queue*);
+
+int http_recv_done(connection*, int, void*);
+bool http_reschedule(connection*, void*);
 
 
+/* Chunk may be shortened after request was sent, rest of that response is
+ * still on the way then: connection is closed instead of being reused.
+ */
+static inline int chunk_finished(const co_param* param)
+{
+    return param->req_end == param->dp->end_pos ? COF_FINISHED : COF_CLOSED;
+}
+
 int http_read_sock(connection* conn, void* priv)
 {
     if (!priv)
@@ -139,11 +156,22 @@ int http_read_sock(connection* conn, void* priv)
     int rd = 0;
     void *addr = param->addr + dp->cur_pos;
     if (!param->header_finished) {
-        const http_response* rsp = get_response(conn, NULL);
-        if (!rsp) {
+        // Header may arrive in pieces, which are kept until it is complete.
+        if (!param->hbq)
+            param->hbq = bq_init(PAGE);
+        rd = response_read(conn, param->hbq);
+        if (rd == COF_AGAIN)
+            return rd;
+
+        byte_queue* hbq = param->hbq;
+        param->hbq = NULL;
+        if (rd) {
+            bq_destroy(hbq);
             return COF_CLOSED;
         }
 
+        const http_response* rsp = response_parse(NULL, hbq);
+
         int stat = rsp->stat;
         switch (stat) {
             case 206:
@@ -166,7 +194,10 @@ int http_read_sock(connection* conn, void* priv)
             }
         }
 
-        size_t length = rsp->bq->w - rsp->bq->r;
+        // Chunk may be shortened after request was sent, extra data is
+        // dropped.
+        size_t length = MIN(rsp->bq->w - rsp->bq->r,
+                            dp->end_pos - dp->cur_pos);
         PDEBUG("LEN: %ld, bq->w - bq->r: %ld\n", length,
                rsp->bq->w - rsp->bq->r);
         if (length) {
@@ -175,12 +206,11 @@ int http_read_sock(connection* conn, void* priv)
             dp->cur_pos += length;
         }
         param->header_finished = true;
-        if (dp->cur_pos == dp->end_pos)
-            goto ret;
-        else if (dp->cur_pos == dp->end_pos)
-            mlog(ALWAYS, "Wrong data: dp: %p : %llX -- %llX\n",
-                 dp, dp->cur_pos, dp->end_pos);
         http_response_destroy(rsp);
+        if (dp->cur_pos == dp->end_pos) {
+            rd = chunk_finished(param);
+            goto ret;
+        }
     }
 
     do {
@@ -188,7 +218,40 @@ int http_read_sock(connection* conn, void* priv)
                            dp->end_pos - dp->cur_pos, NULL);
     } while (rd == -1 && errno == EINTR);
 
+    rd = http_recv_done(conn, rd, priv);
+
+ret:
+    return rd;
+}
+
+int http_get_buffer(connection* conn, void* priv, char** buf, uint32* size)
+{
+    co_param   *param = (co_param *) priv;
+    data_chunk *dp    = param->dp;
+
+    // header should be parsed by http_read_sock.
+    if (!param->header_finished)
+        return COF_AGAIN;
+
+    if (dp->cur_pos >= dp->end_pos)
+        return COF_FINISHED;
+
+    *buf  = param->addr + dp->cur_pos;
+    *size = (uint32) MIN(dp->end_pos - dp->cur_pos, (uint64)(1 << 30));
+    return 0;
+}
+
+// Updates chunk after rd bytes are stored at param->addr + dp->cur_pos.
+int http_recv_done(connection* conn, int rd, void* priv)
+{
+    co_param    *param = (co_param *) priv;
+    data_chunk*  dp    = param->dp;
+
     if (rd > 0) {
+        // Chunk may be split while data is being received, bytes beyond
+        // end_pos belong to another chunk.
+        if (dp->cur_pos + rd > dp->end_pos)
+            rd = (int) (dp->end_pos - dp->cur_pos);
         dp->cur_pos += rd;
         param->md->hd.current_size+=rd;
         if (param->cb) {
@@ -209,10 +272,9 @@ int http_read_sock(connection* conn, void* priv)
 
     if (dp->cur_pos >= dp->end_pos) {
         PDEBUG("Finished chunk: %p\n", dp);
-        rd = COF_FINISHED;
+        rd = chunk_finished(param);
     }
 
-ret:
     return rd;
 }
 
@@ -224,18 +286,50 @@ int http_write_sock(connection* conn, void *priv)
     }
 
     co_param *cp = (co_param *) priv;
+
+    // Last byte of Range is inclusive: nothing beyond this chunk should be
+    // left on connection, so it can be reused for another one.
+    cp->req_end = cp->dp->end_pos;
+    cp->header_finished = false;    // sent again if connection was moved.
+    bq_destroy(cp->hbq);
+    cp->hbq = NULL;
     const http_request* req = http_request_create("GET",
                                                   cp->context->uri_host,
                                                   cp->context->uri,
                                                   true,
                                                   cp->dp->cur_pos,
-                                                  cp->dp->end_pos);
+                                                  cp->req_end - 1);
     size_t written = request_send(conn, req, NULL);
     http_request_destroy(req);
     PDEBUG("written: %d\n", written);
     return COF_FINISHED;
 }
 
+/* Work stealing: once a connection finished its chunk, split the chunk with
+ * most remaining data and let this connection download its upper half.
+ */
+bool http_reschedule(connection* conn, void* priv)
+{
+    co_param   *param = (co_param *) priv;
+    data_chunk *dp    = NULL;
+
+    if (*param->context->cflag)
+        return false;
+
+    // Chunk was shortened after request was sent, remaining data of last
+    // response is still pending on this connection.
+    if (param->req_end != param->dp->end_pos)
+        return false;
+
+    if (!(dp = dinfo_split_chunk(param->info, MIN_STEAL_SIZE)))
+        return false;
+
+    PDEBUG("conn: %p, chunk: %p -> %p\n", conn, param->dp, dp);
+    param->dp = dp;
+    param->header_finished = false;
+    return true;
+}
+
 mget_err process_http_request(dinfo *info, dp_callback cb,
                               bool *stop_flag,
                               mget_option* opts,
@@ -359,9 +453,12 @@ restart:
         (*cb) (md, user_data);
 
     mget_err err = ME_OK;
-    if (context.can_split)
+    if (context.can_split) {
+        // Idle while chunks are fetched, so let one of them reuse it.
+        connection_put(context.conn);
+        context.conn = NULL;
         err = process_request_multi_form(&context);
-    else {
+    } else {
         err = process_request_single_form(&context);
         connection_put(context.conn);
     }
@@ -544,54 +641,68 @@ static int parse_respnse(byte_queue* bq, hash_table** ht)
     return stat;
 }
 
-// return http status if success, or -1 if failed.
-const http_response* get_response(connection* conn, const http_request* req)
+/* Reads response header into bq, returns 0 once it is there, COF_AGAIN if
+ * connection has nothing to offer for now (call again to go on), or
+ * COF_FAILED if connection is closed before header is complete.
+ */
+static int response_read(connection* conn, byte_queue* bq)
 {
-    PDEBUG("enter\n");
-
-    http_response* rsp = NULL;
-
-    if (!conn)
-        goto out;
-
-    rsp = ZALLOC1(http_response);
-    if (!rsp)
-        goto out;
-    rsp->req = req;
-    rsp->bq = bq_init(PAGE);
-    if (req && (int)request_send(conn, req, rsp->bq) == -1)  {
-        goto err;
-    }
-
-    char *eptr = NULL;
-    do {
-        rsp->bq = bq_enlarge(rsp->bq, PAGE);
-        size_t rd = conn->co.read(conn, rsp->bq->w, rsp->bq->x - rsp->bq->w, NULL);
-        if (!rd) {
+    while (strstr(bq->r, HEADER_END) == NULL) {
+        bq_enlarge(bq, PAGE);
+        // Last byte is left as '\0' for strstr.
+        int rd = conn->co.read(conn, bq->w, bq->x - bq->w - 1, NULL);
+        if (rd == COF_AGAIN)
+            return rd;
+        if (rd <= 0) {
             PDEBUG("Failed to read from connection(%p),"
                    " connection closed.\n", conn);
-            return 0;
+            return COF_FAILED;
         }
 
-        rsp->bq->w += rd;
-    } while ((eptr = strstr(rsp->bq->r, HEADER_END)) == NULL);
+        bq->w += rd;
+    }
+
+    return 0;
+}
 
+/* Parses header read by response_read(), bq is owned by response then. */
+static const http_response* response_parse(const http_request* req,
+                                           byte_queue* bq)
+{
+    http_response* rsp = ZALLOC1(http_response);
+    rsp->req = req;
+    rsp->bq = bq;
+
+    char *eptr = strstr(rsp->bq->r, HEADER_END);
     static char buf[PAGE];
-    memcpy(buf, rsp->bq->r, eptr-rsp->bq->r);
-    buf[eptr-rsp->bq->r] = '\0';
+    size_t length = MIN(eptr - rsp->bq->r, PAGE - 1);
+    memcpy(buf, rsp->bq->r, length);
+    buf[length] = '\0';
     mlog(QUIET,
          "\n---response begin---\n%s\n---response end---\n", buf);
 
     rsp->stat = parse_respnse(rsp->bq, &rsp->ht);
     PDEBUG("stat: %d, description: %s\n",
            rsp->stat, (char *) hash_table_entry_get(rsp->ht, "status"));
+    return rsp;
+}
+
+// return http response if success, or NULL if failed.
+const http_response* get_response(connection* conn, const http_request* req)
+{
+    PDEBUG("enter\n");
 
-    goto out;
+    if (!conn)
+        return NULL;
 
-err:
-    FIF(rsp);
-out:
-    return rsp;
+    byte_queue* bq = bq_init(PAGE);
+    if ((req && (int)request_send(conn, req, bq) == -1) ||
+        response_read(conn, bq)) {
+        bq_destroy(bq);
+        return NULL;
+    }
+
+    return response_parse(req, bq);
 }
 
 
@@ -634,6 +745,20 @@ uint64 get_remote_file_size(url_info* ui,
             uint64 s, e;
             num = sscanf(ptr, "bytes %" PRIu64 "-%" PRIu64 "/%" PRIu64,
                          &s, &e, &t);
+
+            // Rest of body is read, so that connection can be put into pool
+            // clean.
+            char body[2];
+            size_t got  = (*rsp)->bq->w - (*rsp)->bq->r;
+            size_t left = num == 3 && e - s < sizeof(body) ? e - s + 1 : 0;
+            left = left > got ? left - got : 0;
+            while (left) {
+                int rd = context->conn->co.read(context->conn, body, left,
+                                                NULL);
+                if (rd <= 0)
+                    break;
+                left -= rd;
+            }
             break;
         }
         case 301:
@@ -827,35 +952,46 @@ static mget_err receive_chunked_data(hcontext* context)
     return ME_OK;
 }
 
+/* Writes data left in bq (received along with header) to fd. */
+static bool save_buffered_data(hcontext* context, int fd, uint64 max)
+{
+    byte_queue* bq     = context->bq;
+    size_t      length = MIN((uint64) (bq->w - bq->r), max);
+    if (length > 0) {
+        if (!safe_write(fd, (char*)bq->r, length))
+            return false;
+        context->info->md->hd.current_size += length;
+    }
+    bq_reset(bq);
+    return true;
+}
+
+/* Body is saved by save_to_fd, so that it can be spliced to file without
+ * being copied through user space.
+ */
 static mget_err receive_limited_data(hcontext* context)
 {
-    PDEBUG ("enter.\n");
     uint64      pending = context->info->md->hd.package_size;
     int         fd      = fm_get_fd(context->info->fm_file);
-    byte_queue* bq      = context->bq;
     connection* conn    = context->conn;
-    size_t      length = 0;
-retry:
-    length = bq->w - bq->r;
-    PDEBUG ("enter, length; %u, pending: %d\n", length, pending);
-    if (length > 0) {
-        if (!safe_write(fd, (char*)bq->r, length))
-            return ME_RES_ERR;
-        bq_reset(bq);
-        pending -= length;
-    }
-    if (pending > 0) {
-        PDEBUG ("pending: %d\n", pending);
-        int rd = conn->co.read(conn, (char*)bq->w, PAGE, NULL);
-        length = rd;
-        context->info->md->hd.current_size += length;
+
+    PDEBUG ("enter, pending: %llu\n", pending);
+    uint64 length = context->bq->w - context->bq->r;
+    if (!save_buffered_data(context, fd, pending))
+        return ME_RES_ERR;
+    pending -= MIN(length, pending);
+
+    while (pending > 0) {
+        int rd = conn->co.save_to_fd(conn, fd,
+                                     (uint32) MIN(pending, SAVE_SIZE));
+        if (rd == COF_AGAIN)
+            continue;
+        if (rd <= 0)
+            return rd == COF_ABORT ? ME_RES_ERR : ME_CONN_ERR;
+
+        pending -= rd;
+        context->info->md->hd.current_size += rd;
         CALLBACK(context);
-        if (rd > 0) {
-            bq->w += rd;
-            goto retry;
-        }
-        else
-            return ME_CONN_ERR;
     }
 
     PDEBUG ("return\n");
@@ -865,32 +1001,25 @@ retry:
 // receive until connection closed...
 static mget_err receive_unlimited_data(hcontext* context)
 {
-    PDEBUG ("enter..\n");
     PDEBUG ("md: %p, nr: %d--%d\n", context->info->md,
             context->info->md->hd.nr_user,    context->info->md->hd.nr_effective);
     int         fd      = fm_get_fd(context->info->fm_file);
-    byte_queue* bq      = context->bq;
     connection* conn    = context->conn;
-    size_t      length = bq->w - bq->r;
-retry:
-    if (length > 0) {
-        if (!safe_write(fd, (char*)bq->r, length))
-            return ME_RES_ERR;
-    }
-    bq_reset(bq);
-    int rd = conn->co.read(conn, (char*)bq->w, PAGE, NULL);
-    length = rd;
-    context->info->md->hd.current_size += length;
-    CALLBACK(context);
-    PDEBUG ("md: %p, nr: %d--%d\n", context->info->md,
-            context->info->md->hd.nr_user,    context->info->md->hd.nr_effective);
-    PDEBUG ("rd: %d\n", rd);
-    if (rd > 0) {
-        bq->w += rd;
-        goto retry;
+
+    if (!save_buffered_data(context, fd, (uint64) -1))
+        return ME_RES_ERR;
+
+    while (true) {
+        int rd = conn->co.save_to_fd(conn, fd, SAVE_SIZE);
+        PDEBUG ("rd: %d\n", rd);
+        if (rd == COF_AGAIN)
+            continue;
+        if (rd <= 0)
+            return rd == COF_CLOSED ? ME_OK : ME_RES_ERR;
+
+        context->info->md->hd.current_size += rd;
+        CALLBACK(context);
     }
-    else
-        return rd == 0 ? ME_OK : ME_RES_ERR;
 }
 
 mget_err process_request_single_form(hcontext* context)
@@ -1000,6 +1129,9 @@ mget_err process_request_multi_form(hcontext* ctx)
             err = ME_RES_ERR; // @todo: clean up resource..
             goto ret;
         }
+        connection_allow_early_data(conn);  // ranged GET is idempotent.
+        connection_set_file(conn, fm_get_fd(info->fm_file),
+                            info->fm_file->addr);
 
         co_param *param = ZALLOC1(co_param);
 
@@ -1014,8 +1146,13 @@ mget_err process_request_multi_form(hcontext* ctx)
 
         conn->recv_data  = http_read_sock;
         conn->write_data = http_write_sock;
+        conn->get_buffer = http_get_buffer;
+        conn->recv_done  = http_recv_done;
         conn->priv       = param;
 
+        if (ctx->can_split)
+            conn->connection_reschedule_func = http_reschedule;
+
         connection_add_to_group(sg, conn);
     }
 
@@ -0,0 +1,285 @@
+/** resolver.c --- implementation of asynchronous host name resolver.
+ *
+ * Copyright (C) 2014 Yang,Ying-chao
+ *
+ * Author: Yang,Ying-chao <yangyingchao@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "resolver.h"
+#include "logutils.h"
+#include "mget_macros.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RESOLVER_THREADS   4    // max number of worker threads.
+
+struct _dns_waiter {
+    dns_waiter *next;
+    resolver_callback cb;
+    void *user_data;
+};
+
+typedef struct _dns_query {
+    struct _dns_query *next;    // next query in g_queries.
+    struct _dns_query *qnext;   // next query waiting for a worker.
+    char *host;
+    char *service;
+    int family;
+    uint32 gen;                 // generation, query is dropped if changed.
+    bool running;
+    bool done;
+    int err;
+    struct addrinfo *infos;
+    dns_waiter *waiters;
+} dns_query;
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+static dns_query *g_queries = NULL;     // queries not dispatched yet.
+static dns_query *g_qhead = NULL;       // queries waiting for a worker.
+static dns_query **g_qtail = &g_qhead;
+static int g_threads = 0;
+static int g_idle = 0;
+static uint32 g_gen = 0;
+static int g_pipe[2] = { -1, -1 };
+
+static void dns_query_destroy(dns_query * q)
+{
+    if (!q)
+        return;
+
+    dns_waiter *w = q->waiters;
+    while (w) {
+        dns_waiter *n = w->next;
+        FIF(w);
+        w = n;
+    }
+    if (q->infos)
+        freeaddrinfo(q->infos);
+    FIF(q->host);
+    FIF(q->service);
+    FIF(q);
+}
+
+static void *resolver_thread(void *arg)
+{
+    pthread_mutex_lock(&g_lock);
+    while (true) {
+        while (!g_qhead) {
+            g_idle++;
+            pthread_cond_wait(&g_cond, &g_lock);
+            g_idle--;
+        }
+
+        dns_query *q = g_qhead;
+        g_qhead = q->qnext;
+        if (!g_qhead)
+            g_qtail = &g_qhead;
+        q->running = true;
+        pthread_mutex_unlock(&g_lock);
+
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = q->family;
+        hints.ai_socktype = SOCK_STREAM;
+        PDEBUG("resolving %s:%s\n", q->host, q->service);
+        q->err = getaddrinfo(q->host, q->service, &hints, &q->infos);
+
+        pthread_mutex_lock(&g_lock);
+        if (q->gen != g_gen) {  // resolver was cleaned up.
+            dns_query_destroy(q);
+            continue;
+        }
+
+        q->done = true;
+        if (write(g_pipe[1], "", 1) == -1 && errno != EAGAIN)
+            mlog(ALWAYS, "Failed to notify resolver: %s\n", strerror(errno));
+    }
+
+    pthread_mutex_unlock(&g_lock);
+    return NULL;
+}
+
+static bool resolver_init()
+{
+    if (g_pipe[0] != -1)
+        return true;
+
+    if (pipe(g_pipe) == -1) {
+        mlog(ALWAYS, "Failed to create pipe: %s\n", strerror(errno));
+        return false;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        fcntl(g_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(g_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    return true;
+}
+
+dns_waiter *resolver_lookup(const char *host, const char *service,
+                            int family, resolver_callback cb,
+                            void *user_data)
+{
+    if (!host || !service || !cb)
+        return NULL;
+
+    dns_waiter *w = NULL;
+    pthread_mutex_lock(&g_lock);
+    if (!resolver_init())
+        goto ret;
+
+    dns_query *q = g_queries;
+    for (; q; q = q->next) {
+        if (q->family == family && !strcmp(q->host, host) &&
+            !strcmp(q->service, service))
+            break;
+    }
+
+    if (!q) {
+        q = ZALLOC1(dns_query);
+        q->host = strdup(host);
+        q->service = strdup(service);
+        q->family = family;
+        q->gen = g_gen;
+        q->next = g_queries;
+        g_queries = q;
+
+        *g_qtail = q;
+        g_qtail = &q->qnext;
+
+        if (!g_idle && g_threads < RESOLVER_THREADS) {
+            pthread_t tid;
+            if (!pthread_create(&tid, NULL, resolver_thread, NULL)) {
+                pthread_detach(tid);
+                g_threads++;
+            } else if (!g_threads) {
+                mlog(ALWAYS, "Failed to create resolver thread.\n");
+            }
+        }
+        pthread_cond_signal(&g_cond);
+    } else {
+        PDEBUG("Joined query of %s:%s\n", host, service);
+    }
+
+    w = ZALLOC1(dns_waiter);
+    w->cb = cb;
+    w->user_data = user_data;
+    w->next = q->waiters;
+    q->waiters = w;
+
+ret:
+    pthread_mutex_unlock(&g_lock);
+    return w;
+}
+
+void resolver_cancel(dns_waiter * waiter)
+{
+    if (waiter)
+        waiter->cb = NULL;
+}
+
+int resolver_fd()
+{
+    // Created before lookups are started, so that event loops can watch it
+    // for lookups started later.
+    pthread_mutex_lock(&g_lock);
+    resolver_init();
+    pthread_mutex_unlock(&g_lock);
+    return g_pipe[0];
+}
+
+int resolver_dispatch()
+{
+    char buf[64];
+    while (read(g_pipe[0], buf, sizeof(buf)) > 0);
+
+    // Take finished queries out of list, and call back without lock held:
+    // callbacks may start new lookups.
+    dns_query *done = NULL;
+    pthread_mutex_lock(&g_lock);
+    dns_query **pp = &g_queries;
+    while (*pp) {
+        dns_query *q = *pp;
+        if (q->done) {
+            *pp = q->next;
+            q->next = done;
+            done = q;
+        } else {
+            pp = &q->next;
+        }
+    }
+    pthread_mutex_unlock(&g_lock);
+
+    int n = 0;
+    while (done) {
+        dns_query *q = done;
+        done = q->next;
+        for (dns_waiter * w = q->waiters; w; w = w->next) {
+            if (w->cb) {
+                w->cb(q->err ? NULL : q->infos, q->err, w->user_data);
+                n++;
+            }
+        }
+        dns_query_destroy(q);
+    }
+
+    return n;
+}
+
+void resolver_cleanup()
+{
+    pthread_mutex_lock(&g_lock);
+
+    // Queries being resolved are dropped by workers.
+    g_gen++;
+    dns_query *q = g_queries;
+    while (q) {
+        dns_query *n = q->next;
+        if (!q->running || q->done)
+            dns_query_destroy(q);
+        q = n;
+    }
+    g_queries = NULL;
+    g_qhead = NULL;
+    g_qtail = &g_qhead;
+
+    if (g_pipe[0] != -1) {
+        close(g_pipe[0]);
+        close(g_pipe[1]);
+        g_pipe[0] = g_pipe[1] = -1;
+    }
+    pthread_mutex_unlock(&g_lock);
+}
+
+/*
+ * Editor modelines
+ *
+ * Local Variables:
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * fill-column: 78
+ * End:
+ *
+ * vim: set noet ts=4 sw=4:
+ */
@@ -0,0 +1,84 @@
+/** resolver.h --- asynchronous host name resolver, used internally by libmget.
+ *
+ * Copyright (C) 2014 Yang,Ying-chao
+ *
+ * Author: Yang,Ying-chao <yangyingchao@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _RESOLVER_H_
+#define _RESOLVER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mget_types.h"
+#include <netdb.h>
+
+typedef struct _dns_waiter dns_waiter;
+
+/* Called by resolver_dispatch() when lookup finished, err is the value
+ * returned by getaddrinfo(), infos is freed after callback returns.
+ */
+typedef void (*resolver_callback) (struct addrinfo * infos, int err,
+                                   void *user_data);
+
+/**
+ * @name resolver_lookup - Resolves host in background threads.
+ * @param host - host name
+ * @param service - port
+ * @param family - AF_INET, AF_INET6 or AF_UNSPEC
+ * @param cb - callback
+ * @param user_data - passed to cb.
+ * @return dns_waiter*, which can be cancelled before cb is called.
+ *
+ * Lookups of same host, service and family that are in flight share a single
+ * query.
+ */
+dns_waiter *resolver_lookup(const char *host, const char *service,
+                            int family, resolver_callback cb,
+                            void *user_data);
+
+/** Cancels a lookup, its callback will not be called. */
+void resolver_cancel(dns_waiter * waiter);
+
+/** Returns fd which becomes readable when lookups finished, or -1 if it
+ *  can't be created. */
+int resolver_fd();
+
+/** Invokes callbacks of finished lookups, returns number of callbacks. */
+int resolver_dispatch();
+
+void resolver_cleanup();
+
+#ifdef __cplusplus
+}
+#endif
+#endif				/* _RESOLVER_H_ */
+/*
+ * Editor modelines
+ *
+ * Local Variables:
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * fill-column: 78
+ * End:
+ *
+ * vim: set noet ts=4 sw=4:
+ */
@@ -0,0 +1,191 @@
+/** scavenger.c --- implementation of scavenger mode.
+ *
+ * Copyright (C) 2014 Yang,Ying-chao
+ *
+ * Author: Yang,Ying-chao <yangyingchao@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Scavenger mode, in the spirit of LEDBAT: queueing delay is rtt of
+ * connections over the lowest rtt seen (base rtt). Delay above target means
+ * others are queued behind data of ours: rate of scavenger bucket is cut in
+ * proportion, and connections finishing their chunks are not given new
+ * ones. Rate grows with the headroom left otherwise.
+ */
+
+#include "scavenger.h"
+#include "connection.h"
+#include "logutils.h"
+#include "mget_macros.h"
+#include "mget_utils.h"
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define SCAV_TARGET_US      100000  // target queueing delay, as LEDBAT.
+#define SCAV_SAMPLE_MS      200     // interval to adjust rate.
+#define SCAV_BASE_MS        60000   // base rtt is forgotten after 2 of these.
+#define SCAV_MIN_RATE       (16 * K)
+#define SCAV_MIN_BURST      (4 * K)
+
+typedef struct _scavenger {
+    bool enabled;
+    int64 rate;                 // bytes per second, 0 until first sample.
+    int64 tokens;
+    uint32 last;                // last refilled, in ms.
+    uint32 base[2];             // lowest rtt of current/last period, in us.
+    uint32 base_since;          // when current period started, in ms.
+    uint32 rtt;                 // lowest rtt in current sample, in us.
+    uint32 delay;               // queueing delay of last sample, in us.
+    uint64 bytes;               // received in current sample.
+    uint32 since;               // when current sample started, in ms.
+    uint32 retired;             // connections not given new chunks.
+} scavenger;
+
+static scavenger g_scav;
+
+void set_scavenger_mode(bool enable)
+{
+    XZERO(g_scav);
+    g_scav.enabled = enable;
+    g_scav.base[0] = g_scav.base[1] = g_scav.rtt = UINT32_MAX;
+    g_scav.base_since = g_scav.since = (uint32) get_monotonic_ms();
+}
+
+bool scavenger_limited()
+{
+    return g_scav.rate != 0;
+}
+
+int64 scavenger_tokens()
+{
+    if (!g_scav.rate)
+        return INT64_MAX;
+
+    uint32 now = (uint32) get_monotonic_ms();
+    int64 add = g_scav.rate * (uint32) (now - g_scav.last) / 1000;
+    if (add > 0) {
+        int64 burst = MAX(g_scav.rate / 4, SCAV_MIN_BURST);
+        g_scav.tokens = MIN(g_scav.tokens + add, burst);
+        g_scav.last = now;
+    }
+    return g_scav.tokens;
+}
+
+void scavenger_consume(int size)
+{
+    if (g_scav.rate && size > 0)
+        g_scav.tokens -= size;
+}
+
+void scavenger_sample(int sock, uint32* sampled_at, int size)
+{
+#ifdef TCP_INFO
+    if (!g_scav.enabled || size <= 0)
+        return;
+
+    uint32 now = (uint32) get_monotonic_ms();
+    g_scav.bytes += size;
+    if (now - *sampled_at >= SCAV_SAMPLE_MS) {
+        struct tcp_info ti;
+        socklen_t len = sizeof(ti);
+        XZERO(ti);
+        *sampled_at = now;
+        if (!getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &len)) {
+            // Receiver gets little acked, rtt measured from data is better.
+            uint32 rtt = ti.tcpi_rcv_rtt ? ti.tcpi_rcv_rtt : ti.tcpi_rtt;
+            if (rtt) {
+                g_scav.rtt = MIN(g_scav.rtt, rtt);
+                g_scav.base[0] = MIN(g_scav.base[0], rtt);
+            }
+        }
+    }
+
+    uint32 elapsed = now - g_scav.since;
+    if (elapsed < SCAV_SAMPLE_MS)
+        return;
+
+    // Routes may change, base is the lowest of last two periods.
+    if (now - g_scav.base_since >= SCAV_BASE_MS) {
+        g_scav.base[1] = g_scav.base[0];
+        g_scav.base[0] = UINT32_MAX;
+        g_scav.base_since = now;
+    }
+
+    uint32 base = MIN(g_scav.base[0], g_scav.base[1]);
+    if (g_scav.rtt != UINT32_MAX && base != UINT32_MAX) {
+        int64 measured = (int64) (g_scav.bytes * 1000 / elapsed);
+        int64 rate = g_scav.rate ? g_scav.rate :
+            MAX(measured, SCAV_MIN_RATE);
+        g_scav.delay = g_scav.rtt - base;
+
+        // Up to a quarter more or less per sample, as delay is below or
+        // above target. Rate not used is not grown further.
+        int64 off = SCAV_TARGET_US - (int64) g_scav.delay;
+        off = MAX(off, -SCAV_TARGET_US);
+        rate += rate * off / SCAV_TARGET_US / 4;
+        rate = MIN(rate, measured * 2 + SCAV_MIN_RATE);
+        rate = MAX(rate, SCAV_MIN_RATE);
+        if (!g_scav.rate) {
+            g_scav.tokens = 0;
+            g_scav.last = now;
+        }
+        g_scav.rate = rate;
+        PDEBUG("Scavenger: rtt %u us, base %u us, rate %lld bytes/s\n",
+               g_scav.rtt, base, (long long) rate);
+    }
+
+    g_scav.rtt = UINT32_MAX;
+    g_scav.bytes = 0;
+    g_scav.since = now;
+#endif
+}
+
+bool scavenger_retire(int live)
+{
+    if (!g_scav.enabled || g_scav.delay <= SCAV_TARGET_US || live <= 1)
+        return false;
+
+    mlog(VERBOSE, "Scavenger mode: connection retired, queueing delay "
+         "%u ms.\n", g_scav.delay / 1000);
+    g_scav.retired++;
+    return true;
+}
+
+void scavenger_report()
+{
+    if (g_scav.retired) {
+        mlog(VERBOSE, "Scavenger mode: %u connections retired early.\n",
+             g_scav.retired);
+        g_scav.retired = 0;
+    }
+}
+
+/*
+ * Editor modelines
+ *
+ * Local Variables:
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * fill-column: 78
+ * End:
+ *
+ * vim: set noet ts=4 sw=4:
+ */
@@ -0,0 +1,74 @@
+/** scavenger.h --- scavenger mode, used internally by libmget.
+ *
+ * Copyright (C) 2014 Yang,Ying-chao
+ *
+ * Author: Yang,Ying-chao <yangyingchao@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _SCAVENGER_H_
+#define _SCAVENGER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mget_types.h"
+
+/** Returns true if reads are paced by scavenger mode. */
+bool scavenger_limited();
+
+/** Returns bytes that may be received now, INT64_MAX if not limited. */
+int64 scavenger_tokens();
+
+/** Takes size bytes received from scavenger bucket. */
+void scavenger_consume(int size);
+
+/**
+ * @name scavenger_sample - Accounts size bytes received from sock.
+ * @param sampled_at - when rtt of sock was sampled last, in ms, updated.
+ *
+ * rtt of sock is sampled at most once per sample period, rate of bucket is
+ * adjusted once all connections had chance to be sampled.
+ */
+void scavenger_sample(int sock, uint32 * sampled_at, int size);
+
+/** Returns true if a connection that finished its chunk should not get a
+ *  new one, as queueing delay is above target. One of live connections of
+ *  a group is always kept.
+ */
+bool scavenger_retire(int live);
+
+/** Reports connections retired. */
+void scavenger_report();
+
+#ifdef __cplusplus
+}
+#endif
+#endif				/* _SCAVENGER_H_ */
+/*
+ * Editor modelines
+ *
+ * Local Variables:
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * fill-column: 78
+ * End:
+ *
+ * vim: set noet ts=4 sw=4:
+ */
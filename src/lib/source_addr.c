@@ -0,0 +1,308 @@
+/** source_addr.c --- implementation of source addresses.
+ *
+ * Copyright (C) 2014 Yang,Ying-chao
+ *
+ * Author: Yang,Ying-chao <yangyingchao@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Source addresses set by set_source_addresses(): new sockets are bound to
+ * them in turn, by stride scheduling weighted by the throughput a connection
+ * gets from each of them, so that more connections go out of faster links.
+ */
+
+#include "source_addr.h"
+#include "connection.h"
+#include "logutils.h"
+#include "mget_macros.h"
+#include "mget_utils.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define SOURCE_MAX          8    // max number of source addresses.
+#define SOURCE_SAMPLE_MS    1000 // interval to sample throughput.
+
+struct _source_addr {
+    char name[IFNAMSIZ + INET6_ADDRSTRLEN];    // as given by user.
+    char device[IFNAMSIZ];      // bound to with SO_BINDTODEVICE, if any.
+    struct sockaddr_storage v4; // family is AF_UNSPEC if it has none.
+    struct sockaddr_storage v6;
+    bool failed;                // failed to bind, not picked any more.
+    double pass;                // stride scheduling, smallest is picked.
+    uint32 picks;               // sockets bound to it.
+    int conns;                  // established connections on it.
+    uint64 bytes;               // received in current sample.
+    uint64 total;               // received in all.
+    uint32 since;               // when current sample started, in ms.
+    uint32 rate;                // bytes per second of one connection.
+};
+
+static source_addr g_sources[SOURCE_MAX];
+static int g_nsource = 0;
+
+static bool source_parse(source_addr * src, const char *name);
+static struct sockaddr_storage *source_sockaddr(source_addr * src,
+                                                int family);
+static double source_weight(const source_addr * src, double avg);
+
+/* Fills addresses of src from name: an IP address, or an interface whose
+ * addresses are used and which sockets are bound to as well.
+ */
+static bool source_parse(source_addr* src, const char* name)
+{
+    memset(src, 0, sizeof(*src));
+    snprintf(src->name, sizeof(src->name), "%s", name);
+    src->v4.ss_family = src->v6.ss_family = AF_UNSPEC;
+
+    struct sockaddr_in *v4 = (struct sockaddr_in *) &src->v4;
+    struct sockaddr_in6 *v6 = (struct sockaddr_in6 *) &src->v6;
+    if (inet_pton(AF_INET, name, &v4->sin_addr) == 1) {
+        v4->sin_family = AF_INET;
+        return true;
+    }
+    if (inet_pton(AF_INET6, name, &v6->sin6_addr) == 1) {
+        v6->sin6_family = AF_INET6;
+        return true;
+    }
+
+    struct ifaddrs *ifs = NULL;
+    if (strlen(name) >= IFNAMSIZ || getifaddrs(&ifs) == -1)
+        return false;
+
+    for (struct ifaddrs * p = ifs; p; p = p->ifa_next) {
+        if (!p->ifa_addr || strcmp(p->ifa_name, name))
+            continue;
+
+        int family = p->ifa_addr->sa_family;
+        if (family == AF_INET && src->v4.ss_family == AF_UNSPEC) {
+            memcpy(&src->v4, p->ifa_addr, sizeof(struct sockaddr_in));
+        } else if (family == AF_INET6 && src->v6.ss_family == AF_UNSPEC) {
+            struct sockaddr_in6 *a = (struct sockaddr_in6 *) p->ifa_addr;
+            // Link local addresses can't reach other networks.
+            if (!IN6_IS_ADDR_LINKLOCAL(&a->sin6_addr))
+                memcpy(&src->v6, a, sizeof(struct sockaddr_in6));
+        }
+    }
+    freeifaddrs(ifs);
+
+    if (src->v4.ss_family == AF_UNSPEC && src->v6.ss_family == AF_UNSPEC)
+        return false;
+
+    strcpy(src->device, name);
+    return true;
+}
+
+void set_source_addresses(const char* list)
+{
+    g_nsource = 0;
+    if (!list || !*list)
+        return;
+
+    char *dup = strdup(list);
+    char *save = NULL;
+    for (char *name = strtok_r(dup, ", ", &save); name;
+         name = strtok_r(NULL, ", ", &save)) {
+        if (g_nsource == SOURCE_MAX) {
+            mlog(ALWAYS, "Too many source addresses, only first %d are "
+                 "used.\n", SOURCE_MAX);
+            break;
+        }
+        if (!source_parse(&g_sources[g_nsource], name)) {
+            mlog(ALWAYS, "Invalid source address or interface: %s\n",
+                 name);
+            continue;
+        }
+        g_nsource++;
+    }
+    FIF(dup);
+}
+
+static struct sockaddr_storage *source_sockaddr(source_addr* src,
+                                                int family)
+{
+    return family == AF_INET ? &src->v4 : family == AF_INET6 ? &src->v6 :
+        NULL;
+}
+
+/* Weight of src in stride scheduling: throughput of one connection on it.
+ * Sources not measured yet get the average of measured ones, so that they
+ * are tried as much as others.
+ */
+static double source_weight(const source_addr* src, double avg)
+{
+    return src->rate ? (double) src->rate : avg;
+}
+
+void source_bind(int sock, int family)
+{
+    if (!g_nsource)
+        return;
+
+    uint64 sum = 0;
+    int measured = 0;
+    for (int i = 0; i < g_nsource; i++) {
+        if (g_sources[i].rate) {
+            sum += g_sources[i].rate;
+            measured++;
+        }
+    }
+    double avg = measured ? (double) sum / measured : 1;
+
+    while (true) {
+        source_addr *best = NULL;
+        for (int i = 0; i < g_nsource; i++) {
+            source_addr *src = &g_sources[i];
+            struct sockaddr_storage *ss = source_sockaddr(src, family);
+            if (!src->failed && ss && ss->ss_family == family &&
+                (!best || src->pass < best->pass))
+                best = src;
+        }
+        if (!best)
+            return;
+
+        best->pass += avg / source_weight(best, avg);
+
+        if (best->device[0] &&
+            setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, best->device,
+                       strlen(best->device)) == -1) {
+            // Needs CAP_NET_RAW, the source address still picks a route
+            // if policy routing is set up.
+            mlog(VERBOSE, "Failed to bind to device %s: %s\n",
+                 best->device, strerror(errno));
+            best->device[0] = '\0';
+        }
+
+#ifdef IP_BIND_ADDRESS_NO_PORT
+        // Port is chosen at connect, so that one port can be used for
+        // different destinations.
+        int on = 1;
+        setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on,
+                   sizeof(on));
+#endif
+        struct sockaddr_storage *ss = source_sockaddr(best, family);
+        socklen_t len = family == AF_INET ? sizeof(struct sockaddr_in) :
+            sizeof(struct sockaddr_in6);
+        if (bind(sock, (struct sockaddr *) ss, len) == 0) {
+            best->picks++;
+            PDEBUG("Socket %d is bound to %s\n", sock, best->name);
+            return;
+        }
+
+        mlog(ALWAYS, "Failed to bind to %s: %s, not used any more.\n",
+             best->name, strerror(errno));
+        best->failed = true;
+    }
+}
+
+void source_attach(source_addr** ref, int sock)
+{
+    if (!g_nsource || *ref || sock == -1)
+        return;
+
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    if (getsockname(sock, (struct sockaddr *) &ss, &len) == -1)
+        return;
+
+    for (int i = 0; i < g_nsource; i++) {
+        source_addr *src = &g_sources[i];
+        bool match = false;
+        if (ss.ss_family == AF_INET && src->v4.ss_family == AF_INET) {
+            match = !memcmp(&((struct sockaddr_in *) &ss)->sin_addr,
+                            &((struct sockaddr_in *) &src->v4)->sin_addr,
+                            sizeof(struct in_addr));
+        } else if (ss.ss_family == AF_INET6 &&
+                   src->v6.ss_family == AF_INET6) {
+            match = !memcmp(&((struct sockaddr_in6 *) &ss)->sin6_addr,
+                            &((struct sockaddr_in6 *) &src->v6)->sin6_addr,
+                            sizeof(struct in6_addr));
+        }
+        if (!match)
+            continue;
+
+        if (!src->conns) {      // start a new sample.
+            src->bytes = 0;
+            src->since = (uint32) get_monotonic_ms();
+        }
+        src->conns++;
+        *ref = src;
+        return;
+    }
+}
+
+void source_detach(source_addr** ref)
+{
+    if (ref && *ref) {
+        (*ref)->conns--;
+        *ref = NULL;
+    }
+}
+
+/* Samples bytes per second a single connection of src gets. */
+void source_account(source_addr* src, int size)
+{
+    if (!src || size <= 0)
+        return;
+
+    src->bytes += size;
+    src->total += size;
+    uint32 now = (uint32) get_monotonic_ms();
+    uint32 elapsed = now - src->since;
+    if (elapsed < SOURCE_SAMPLE_MS)
+        return;
+
+    uint64 rate = src->bytes * 1000 / elapsed / MAX(src->conns, 1);
+    rate = MIN(rate, UINT32_MAX);
+    src->rate  = src->rate ? (uint32) ((src->rate * 3ULL + rate) / 4) :
+                 (uint32) rate;
+    src->bytes = 0;
+    src->since = now;
+}
+
+void source_report()
+{
+    for (int i = 0; i < g_nsource; i++) {
+        source_addr *src = &g_sources[i];
+        if (src->picks) {
+            mlog(VERBOSE, "Source %s: %u connections, %llu bytes, "
+                 "%u bytes/s per connection.\n", src->name, src->picks,
+                 (unsigned long long) src->total, src->rate);
+        }
+        src->picks = 0;
+        src->total = 0;
+    }
+}
+
+/*
+ * Editor modelines
+ *
+ * Local Variables:
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * fill-column: 78
+ * End:
+ *
+ * vim: set noet ts=4 sw=4:
+ */
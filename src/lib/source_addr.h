@@ -0,0 +1,65 @@
+/** source_addr.h --- source addresses, used internally by libmget.
+ *
+ * Copyright (C) 2014 Yang,Ying-chao
+ *
+ * Author: Yang,Ying-chao <yangyingchao@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _SOURCE_ADDR_H_
+#define _SOURCE_ADDR_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mget_types.h"
+
+typedef struct _source_addr source_addr;
+
+/** Binds sock of family to the source address whose turn comes first, if
+ *  source addresses are set by set_source_addresses().
+ */
+void source_bind(int sock, int family);
+
+/** Attaches *ref to the source sock is bound to, if not attached yet. */
+void source_attach(source_addr ** ref, int sock);
+
+void source_detach(source_addr ** ref);
+
+/** Samples throughput of src, size bytes were received. */
+void source_account(source_addr * src, int size);
+
+/** Reports what each source was used for, and resets the counters. */
+void source_report();
+
+#ifdef __cplusplus
+}
+#endif
+#endif				/* _SOURCE_ADDR_H_ */
+/*
+ * Editor modelines
+ *
+ * Local Variables:
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * fill-column: 78
+ * End:
+ *
+ * vim: set noet ts=4 sw=4:
+ */
@@ -0,0 +1,290 @@
+/** spread.c --- implementation of spread mode.
+ *
+ * Copyright (C) 2014 Yang,Ying-chao
+ *
+ * Author: Yang,Ying-chao <yangyingchao@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Spread mode: connections of a host are distributed over all addresses
+ * (nodes) it resolves to. Nodes keep the throughput their connections get,
+ * connections on a node much slower than the fastest one are moved there.
+ * Nodes are only appended, so connections can keep pointers to them.
+ */
+
+#include "spread.h"
+#include "connection.h"
+#include "data_utlis.h"
+#include "dns_cache.h"
+#include "logutils.h"
+#include "mget_macros.h"
+#include "mget_utils.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SPREAD_SAMPLE_MS    1000 // interval to sample throughput of nodes.
+#define SPREAD_HOLD_MS      3000 // min time a connection stays on a node.
+#define SPREAD_SLOW_RATIO   2    // node is slow if the best is that faster.
+
+struct _spread_node {
+    struct sockaddr_storage addr;
+    socklen_t len;
+    int conns;                  // connections attached to this node.
+    bool failed;                // failed to connect, not picked any more.
+    uint64 bytes;               // received in current sample.
+    uint32 since;               // when current sample started, in ms.
+    uint32 rate;                // bytes per second of one connection.
+};
+
+typedef struct _spread_host {
+    int naddr;
+    spread_node nodes[DNS_CACHE_ADDRS];
+} spread_host;
+
+static bool g_spread = false;   // spread connections over addresses.
+static hash_table *g_spread_hosts = NULL;  // host:port -> spread_host.
+static uint32 g_spread_moves = 0;
+
+static spread_host *spread_host_get(const char *host, int port,
+                                    bool create);
+static spread_node *spread_find(spread_host * sh, const struct sockaddr *sa,
+                                socklen_t len);
+static void spread_attach_node(spread_ref * ref, spread_host * sh,
+                               spread_node * node);
+
+void set_spread_mode(bool enable)
+{
+    g_spread = enable;
+}
+
+static spread_host *spread_host_get(const char* host, int port,
+                                    bool create)
+{
+    if (!g_spread_hosts) {
+        if (!create)
+            return NULL;
+        g_spread_hosts = hash_table_create(32, free);
+    }
+
+    char *key = get_host_key(host, port);
+    spread_host *sh = HASH_ENTRY_GET(spread_host, g_spread_hosts, key);
+    if (!sh && create) {
+        sh = ZALLOC1(spread_host);
+        if (!HASH_TABLE_INSERT(g_spread_hosts, key, sh, sizeof(*sh))) {
+            FIF(sh);
+            sh = NULL;
+        }
+    }
+    FIF(key);
+    return sh;
+}
+
+static spread_node *spread_find(spread_host* sh, const struct sockaddr* sa,
+                                socklen_t len)
+{
+    for (int i = 0; sh && i < sh->naddr; i++) {
+        spread_node *node = &sh->nodes[i];
+        if (node->len == len && !memcmp(&node->addr, sa, len))
+            return node;
+    }
+    return NULL;
+}
+
+void spread_update(const char* host, int port, const struct addrinfo* infos)
+{
+    spread_host *sh = g_spread ? spread_host_get(host, port, true) : NULL;
+    for (const struct addrinfo *rp = infos; sh && rp &&
+             sh->naddr < DNS_CACHE_ADDRS; rp = rp->ai_next) {
+        if (rp->ai_socktype != SOCK_STREAM ||
+            rp->ai_addrlen > sizeof(struct sockaddr_storage) ||
+            spread_find(sh, rp->ai_addr, rp->ai_addrlen))
+            continue;
+
+        spread_node *node = &sh->nodes[sh->naddr++];
+        memcpy(&node->addr, rp->ai_addr, rp->ai_addrlen);
+        node->len = rp->ai_addrlen;
+    }
+}
+
+static void spread_attach_node(spread_ref* ref, spread_host* sh,
+                               spread_node* node)
+{
+    uint32 now = (uint32) get_monotonic_ms();
+    spread_detach(ref);
+    if (!node->conns) {         // start a new sample.
+        node->bytes = 0;
+        node->since = now;
+    }
+    node->conns++;
+    ref->host = sh;
+    ref->node = node;
+    ref->since = now;
+}
+
+int spread_pick(spread_ref* ref, const char* host, int port,
+                spread_node** nodes, int max)
+{
+    spread_host *sh = g_spread ? spread_host_get(host, port, false) : NULL;
+    spread_node *best = NULL;
+    for (int i = 0; sh && sh->naddr > 1 && i < sh->naddr; i++) {
+        spread_node *node = &sh->nodes[i];
+        if (!node->failed &&
+            (!best || node->conns < best->conns ||
+             (node->conns == best->conns && node->rate > best->rate)))
+            best = node;
+    }
+
+    if (!best || max < 1)
+        return 0;
+
+    // Others are kept as fallback, failed ones come last.
+    int n = 0;
+    nodes[n++] = best;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < sh->naddr && n < max; i++) {
+            spread_node *node = &sh->nodes[i];
+            if (node == best || node->failed != (pass == 1))
+                continue;
+            nodes[n++] = node;
+        }
+    }
+
+    PDEBUG("picked node #%d of %s\n", (int) (best - sh->nodes), host);
+    spread_attach_node(ref, sh, best);
+    return n;
+}
+
+const struct sockaddr *spread_node_addr(const spread_node* node,
+                                        socklen_t* len)
+{
+    *len = node->len;
+    return (const struct sockaddr *) &node->addr;
+}
+
+void spread_attach(spread_ref* ref, const char* host, int port,
+                   const struct addrinfo* addr)
+{
+    if (!g_spread || !addr || !host)
+        return;
+
+    spread_host *sh = spread_host_get(host, port, false);
+    spread_node *node = spread_find(sh, addr->ai_addr, addr->ai_addrlen);
+    if (!node)
+        spread_detach(ref);
+    else if (node != ref->node)
+        spread_attach_node(ref, sh, node);
+}
+
+void spread_detach(spread_ref* ref)
+{
+    if (ref && ref->node) {
+        ref->node->conns--;
+        ref->node = NULL;
+    }
+}
+
+void spread_fail(spread_ref* ref, const struct addrinfo* addr)
+{
+    if (!ref->host || !addr)
+        return;
+
+    spread_node *node = spread_find(ref->host, addr->ai_addr,
+                                    addr->ai_addrlen);
+    if (node)
+        node->failed = true;
+    spread_detach(ref);
+}
+
+/* Samples bytes per second a single connection of node gets. */
+void spread_account(spread_ref* ref, int size)
+{
+    spread_node *node = ref->node;
+    if (!node || size <= 0)
+        return;
+
+    node->bytes += size;
+    uint32 now = (uint32) get_monotonic_ms();
+    uint32 elapsed = now - node->since;
+    if (elapsed < SPREAD_SAMPLE_MS)
+        return;
+
+    uint64 rate = node->bytes * 1000 / elapsed / MAX(node->conns, 1);
+    rate = MIN(rate, UINT32_MAX);
+    node->rate  = node->rate ? (uint32) ((node->rate * 3ULL + rate) / 4) :
+                  (uint32) rate;
+    node->bytes = 0;
+    node->since = now;
+}
+
+spread_node *spread_faster(const spread_ref* ref)
+{
+    spread_node *node = ref->node;
+    if (!node || !node->rate ||
+        (uint32) get_monotonic_ms() - ref->since < SPREAD_HOLD_MS)
+        return NULL;
+
+    spread_host *sh = ref->host;
+    spread_node *best = node;
+    for (int i = 0; i < sh->naddr; i++) {
+        if (!sh->nodes[i].failed && sh->nodes[i].rate > best->rate)
+            best = &sh->nodes[i];
+    }
+
+    if ((uint64) node->rate * SPREAD_SLOW_RATIO > best->rate)
+        return NULL;
+    return best;
+}
+
+void spread_move(spread_ref* ref, spread_node* node, const char* host,
+                 bool ok)
+{
+    if (!ok) {
+        node->failed = true;
+        return;
+    }
+
+    mlog(VERBOSE, "Moving connection of %s to a faster address "
+         "(%u vs %u bytes/s).\n", host, node->rate,
+         ref->node ? ref->node->rate : 0);
+    spread_attach_node(ref, ref->host, node);
+    g_spread_moves++;
+}
+
+void spread_cleanup()
+{
+    if (g_spread_moves) {
+        mlog(VERBOSE, "Spread mode: %u connections moved to faster "
+             "addresses.\n", g_spread_moves);
+        g_spread_moves = 0;
+    }
+    hash_table_destroy(g_spread_hosts);
+    g_spread_hosts = NULL;
+}
+
+/*
+ * Editor modelines
+ *
+ * Local Variables:
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * fill-column: 78
+ * End:
+ *
+ * vim: set noet ts=4 sw=4:
+ */
@@ -0,0 +1,105 @@
+/** spread.h --- spread mode, used internally by libmget.
+ *
+ * Copyright (C) 2014 Yang,Ying-chao
+ *
+ * Author: Yang,Ying-chao <yangyingchao@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _SPREAD_H_
+#define _SPREAD_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mget_types.h"
+#include <netdb.h>
+#include <sys/socket.h>
+
+typedef struct _spread_node spread_node;
+
+/* Where a connection is in spread mode, kept by connection. */
+typedef struct _spread_ref {
+    struct _spread_host *host;  // addresses of host.
+    spread_node *node;          // address it is connected to, if counted.
+    uint32 since;               // when it was attached to node, in ms.
+} spread_ref;
+
+/** Adds resolved addresses of host as nodes, if spread mode is on. */
+void spread_update(const char *host, int port, const struct addrinfo *infos);
+
+/**
+ * @name spread_pick - Picks address of host for a new connection.
+ * @param ref - where connection is, attached to node picked.
+ * @param nodes - filled with nodes to try, picked one (fewest connections,
+ *                fastest if tied) first, failed ones last.
+ * @param max - size of nodes.
+ * @return number of nodes, 0 if spread mode is off or host has less than two
+ *         addresses.
+ */
+int spread_pick(spread_ref *ref, const char *host, int port,
+                spread_node **nodes, int max);
+
+/** Returns address of node, and its length in len. */
+const struct sockaddr *spread_node_addr(const spread_node *node,
+                                        socklen_t *len);
+
+/** Attaches ref to node of addr, once connection is made. */
+void spread_attach(spread_ref *ref, const char *host, int port,
+                   const struct addrinfo *addr);
+
+void spread_detach(spread_ref *ref);
+
+/** Marks node of addr failed to connect to, it is not picked any more. */
+void spread_fail(spread_ref *ref, const struct addrinfo *addr);
+
+/** Samples throughput of node of ref, size bytes were received. */
+void spread_account(spread_ref *ref, int size);
+
+/**
+ * @name spread_faster - Finds node connection should move to.
+ * @return fastest node of host if node of ref is much slower and connection
+ *         has stayed on it long enough, NULL otherwise.
+ */
+spread_node *spread_faster(const spread_ref *ref);
+
+/** Attaches ref to node connection of host was moved to, or marks node
+ *  failed if connection to it couldn't be made (ok is false).
+ */
+void spread_move(spread_ref *ref, spread_node *node, const char *host,
+                 bool ok);
+
+/** Reports moves and forgets all hosts. */
+void spread_cleanup();
+
+#ifdef __cplusplus
+}
+#endif
+#endif				/* _SPREAD_H_ */
+/*
+ * Editor modelines
+ *
+ * Local Variables:
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * fill-column: 78
+ * End:
+ *
+ * vim: set noet ts=4 sw=4:
+ */
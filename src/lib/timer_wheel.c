@@ -0,0 +1,213 @@
+/** timer_wheel.c --- implementation of hierarchical timer wheel.
+ *
+ * Copyright (C) 2014 Yang,Ying-chao
+ *
+ * Author: Yang,Ying-chao <yangyingchao@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Slots of level 0 are one tick each, a slot of level n spans all slots of
+ * level n - 1. Timers are moved down a level when time reaches their slot,
+ * and fire at level 0. Owners only push deadline forward, a timer reaching
+ * its slot before the deadline is re-inserted, so that activity doesn't have
+ * to touch the wheel.
+ */
+
+#include "timer_wheel.h"
+#include "mget_macros.h"
+#include "mget_utils.h"
+#include <stdint.h>
+
+#define TW_BITS         6
+#define TW_SLOTS        (1 << TW_BITS)
+#define TW_MASK         (TW_SLOTS - 1)
+#define TW_LEVELS       4       // about 46 hours with 10ms ticks.
+
+struct _timer_wheel {
+    uint64 now;                 // last tick processed.
+    int count;                  // number of timers.
+    timer_check check;
+    timer_node expired;         // timed out ones, not yet taken.
+    timer_node slots[TW_LEVELS][TW_SLOTS];
+};
+
+static inline void tnode_init(timer_node* head)
+{
+    head->prev = head->next = head;
+}
+
+static inline void tnode_add(timer_node* head, timer_node* n)
+{
+    n->prev = head;
+    n->next = head->next;
+    head->next->prev = n;
+    head->next = n;
+}
+
+static inline void tnode_del(timer_node* n)
+{
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+    n->prev = n->next = NULL;
+}
+
+static inline uint64 deadline_tick(uint64 deadline)
+{
+    return (deadline + TW_TICK_MS - 1) / TW_TICK_MS;
+}
+
+timer_wheel *timer_wheel_create(timer_check check)
+{
+    timer_wheel *tw = ZALLOC1(timer_wheel);
+    tw->now = get_monotonic_ms() / TW_TICK_MS;
+    tw->check = check;
+    tnode_init(&tw->expired);
+    for (int l = 0; l < TW_LEVELS; l++) {
+        for (int i = 0; i < TW_SLOTS; i++)
+            tnode_init(&tw->slots[l][i]);
+    }
+    return tw;
+}
+
+void timer_wheel_destroy(timer_wheel* tw)
+{
+    FIF(tw);
+}
+
+/* Links node into slot of the tick its deadline falls in. */
+static void timer_wheel_add(timer_wheel* tw, timer_node* node)
+{
+    uint64 tick = deadline_tick(node->deadline);
+    tick = MAX(tick, tw->now + 1);
+    tick = MIN(tick, tw->now + (1ULL << (TW_BITS * TW_LEVELS)) - 1);
+
+    int level = 0;
+    while (tick - tw->now >= (1ULL << (TW_BITS * (level + 1))))
+        level++;
+
+    node->tick = tick;
+    tnode_add(&tw->slots[level][(tick >> (TW_BITS * level)) & TW_MASK], node);
+    tw->count++;
+}
+
+void timer_wheel_schedule(timer_wheel* tw, timer_node* node)
+{
+    if (node->tick && node->tick <= deadline_tick(node->deadline))
+        return;
+
+    timer_wheel_remove(tw, node);
+    timer_wheel_add(tw, node);
+}
+
+void timer_wheel_remove(timer_wheel* tw, timer_node* node)
+{
+    if (!node->next)
+        return;
+
+    tnode_del(node);
+    if (node->tick && tw)
+        tw->count--;
+    node->tick = 0;
+}
+
+/* Takes timers out of slot, they are inserted again unless they expired. */
+static void timer_wheel_requeue(timer_wheel* tw, timer_node* slot, uint64 now)
+{
+    while (slot->next != slot) {
+        timer_node *node = slot->next;
+        tnode_del(node);
+        node->tick = 0;
+        tw->count--;
+
+        switch (tw->check(node, now)) {
+            case tv_requeue:
+                timer_wheel_add(tw, node);
+                break;
+            case tv_expire:
+                tnode_add(&tw->expired, node);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void timer_wheel_advance(timer_wheel* tw, uint64 now)
+{
+    uint64 target = now / TW_TICK_MS;
+    if (!tw->count) {
+        tw->now = MAX(tw->now, target);
+        return;
+    }
+
+    while (tw->now < target) {
+        uint64 t = ++tw->now;
+        for (int l = 1; l < TW_LEVELS &&
+                 !(t & ((1ULL << (TW_BITS * l)) - 1)); l++)
+            timer_wheel_requeue(tw, &tw->slots[l][(t >> (TW_BITS * l)) &
+                                                  TW_MASK], now);
+        timer_wheel_requeue(tw, &tw->slots[0][t & TW_MASK], now);
+    }
+}
+
+int timer_wheel_wait(timer_wheel* tw, uint64 now)
+{
+    if (tw->expired.next != &tw->expired)
+        return 0;
+    if (!tw->count)
+        return -1;
+
+    uint64 first = UINT64_MAX;
+    for (int l = 0; l < TW_LEVELS; l++) {
+        uint64 base = tw->now >> (TW_BITS * l);
+        for (int d = 1; d <= TW_SLOTS; d++) {
+            timer_node *slot = &tw->slots[l][(base + d) & TW_MASK];
+            if (slot->next != slot) {
+                first = MIN(first, (base + d) << (TW_BITS * l));
+                break;
+            }
+        }
+    }
+
+    if (first == UINT64_MAX)
+        return -1;
+    uint64 at = first * TW_TICK_MS;
+    return at > now ? (int) MIN(at - now, (uint64) INT32_MAX) : 0;
+}
+
+timer_node *timer_wheel_expired(timer_wheel* tw)
+{
+    if (tw->expired.next == &tw->expired)
+        return NULL;
+
+    timer_node *node = tw->expired.prev;
+    tnode_del(node);
+    return node;
+}
+
+/*
+ * Editor modelines
+ *
+ * Local Variables:
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * fill-column: 78
+ * End:
+ *
+ * vim: set noet ts=4 sw=4:
+ */
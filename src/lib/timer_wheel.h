@@ -0,0 +1,92 @@
+/** timer_wheel.h --- hierarchical timer wheel, used internally by libmget.
+ *
+ * Copyright (C) 2014 Yang,Ying-chao
+ *
+ * Author: Yang,Ying-chao <yangyingchao@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mget_types.h"
+
+#define TW_TICK_MS      10
+
+typedef struct _timer_wheel timer_wheel;
+
+/* Timer embedded by its owner, zero filled if not in any wheel. */
+typedef struct _timer_node {
+    struct _timer_node *prev;
+    struct _timer_node *next;   // NULL if not linked.
+    uint64 tick;                // tick of slot it is in, 0 if none.
+    uint64 deadline;            // when it times out, in ms.
+} timer_node;
+
+typedef enum _timer_verdict {
+    tv_drop,                    // taken out of wheel.
+    tv_requeue,                 // inserted again, at its deadline.
+    tv_expire,                  // put to expired ones.
+} timer_verdict;
+
+/**
+ * Called when node reaches its slot, before or after its deadline: owner
+ * only pushes deadline forward on activity, and may do so here as well.
+ */
+typedef timer_verdict (*timer_check)(timer_node * node, uint64 now);
+
+timer_wheel *timer_wheel_create(timer_check check);
+
+void timer_wheel_destroy(timer_wheel * tw);
+
+/** Puts node at its deadline, unless its slot is reached before that
+ *  already.
+ */
+void timer_wheel_schedule(timer_wheel * tw, timer_node * node);
+
+/** Takes node out of tw, or out of expired ones. tw may be NULL. */
+void timer_wheel_remove(timer_wheel * tw, timer_node * node);
+
+/** Moves wheel to now (in ms), checking nodes whose slots are reached. */
+void timer_wheel_advance(timer_wheel * tw, uint64 now);
+
+/** Returns ms until the first non-empty slot is reached, -1 if none. */
+int timer_wheel_wait(timer_wheel * tw, uint64 now);
+
+/** Takes an expired node out of tw, returns NULL if none. */
+timer_node *timer_wheel_expired(timer_wheel * tw);
+
+#ifdef __cplusplus
+}
+#endif
+#endif				/* _TIMER_WHEEL_H_ */
+/*
+ * Editor modelines
+ *
+ * Local Variables:
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * fill-column: 78
+ * End:
+ *
+ * vim: set noet ts=4 sw=4:
+ */
@@ -0,0 +1,345 @@
+/** tls_cache.c --- implementation of TLS session cache kept on disk.
+ *
+ * Copyright (C) 2014 Yang,Ying-chao
+ *
+ * Author: Yang,Ying-chao <yangyingchao@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Sessions are kept in a file mapped by every mget process of the user, so
+ * that a process started later can resume session got by earlier ones. The
+ * layout is the same as dns cache: fixed size slots of an open addressing
+ * hash table, each protected by its own sequence lock. Sessions hold keys,
+ * so the file is readable by its owner only.
+ */
+
+#include "tls_cache.h"
+#include "fileutils.h"
+#include "logutils.h"
+#include "mget_macros.h"
+#include "mget_utils.h"
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TLS_CACHE_MAGIC    0x6d746c73   // "mtls"
+#define TLS_CACHE_VERSION  1            // bump when layout changes.
+#define TLS_HOST_MAX       240
+#define TLS_PROBE_MAX      8            // max slots checked for a host.
+#define TLS_READ_RETRIES   64
+#define TLS_STUCK_MS       1000         // writer is taken as dead after it.
+#define TLS_STUCK_MAX      4            // locked slots watched at a time.
+
+typedef struct _tls_slot {
+    uint32 seq;                 // odd while slot is being written.
+    uint32 hash;                // 0 if slot was never used.
+    int64 expires;              // seconds since epoch.
+    int32 port;
+    int32 size;                 // size of data.
+    char host[TLS_HOST_MAX];
+    uint8 data[TLS_CACHE_DATA];
+} tls_slot;
+
+typedef struct _tls_table {
+    uint32 magic;               // set after other fields are initialized.
+    uint32 version;
+    uint32 nslots;
+    uint32 reserved;
+    tls_slot slots[0];
+} tls_table;
+
+static tls_table *g_table = NULL;
+static size_t g_length = 0;
+static bool g_mapped = false;
+
+// Locked slots seen by this process, as dns cache does.
+static struct {
+    tls_slot *slot;
+    uint32 seq;
+    uint64 since;
+} g_stuck[TLS_STUCK_MAX];
+
+static uint32 tls_hash(const char *host, int port)
+{
+    uint32 h = 2166136261u;     // FNV-1a
+    for (const char *p = host; *p; p++) {
+        h ^= (uint8) * p;
+        h *= 16777619u;
+    }
+    h ^= (uint32) port;
+    h *= 16777619u;
+    return h ? h : 1;           // 0 marks empty slot.
+}
+
+static void slot_unlock(tls_slot * s, uint32 seq);
+
+/* Takes over slot s that stays locked with seq for TLS_STUCK_MS, its writer
+ * was killed. Session left there may be torn, it is dropped.
+ */
+static bool slot_reclaim(tls_slot * s, uint32 seq)
+{
+    uint64 now = get_monotonic_ms();
+    int i = (int) ((s - g_table->slots) % TLS_STUCK_MAX);
+    if (g_stuck[i].slot != s || g_stuck[i].seq != seq) {
+        g_stuck[i].slot = s;
+        g_stuck[i].seq = seq;
+        g_stuck[i].since = now;
+        return false;
+    }
+
+    uint32 locked = seq;
+    if (now - g_stuck[i].since < TLS_STUCK_MS ||
+        !__atomic_compare_exchange_n(&s->seq, &locked, seq + 2, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return false;
+
+    g_stuck[i].slot = NULL;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s->expires = 0;
+    s->size = 0;
+    s->host[0] = '\0';
+    slot_unlock(s, seq + 1);
+    return true;
+}
+
+/* Copies slot into out, returns false if it keeps being written. */
+static bool slot_read(tls_slot * s, tls_slot * out)
+{
+    uint32 seq = 0;
+    for (int i = 0; i < TLS_READ_RETRIES; i++) {
+        seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        memcpy(out, s, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) {
+            out->host[TLS_HOST_MAX - 1] = '\0';
+            out->size = MIN(MAX(out->size, 0), TLS_CACHE_DATA);
+            return true;
+        }
+    }
+
+    if ((seq & 1) && slot_reclaim(s, seq))
+        return slot_read(s, out);
+    return false;
+}
+
+static inline bool slot_match(const tls_slot * s, uint32 hash,
+                              const char *host, int port)
+{
+    return s->hash == hash && s->port == port && !strcmp(s->host, host);
+}
+
+/* Locks slot for writing, returns false if it is being written by others. */
+static bool slot_lock(tls_slot * s, uint32 * seq)
+{
+    *seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+    if ((*seq & 1) ||
+        !__atomic_compare_exchange_n(&s->seq, seq, *seq + 1, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return false;
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return true;
+}
+
+static void slot_unlock(tls_slot * s, uint32 seq)
+{
+    __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+#define SLOT(H, I)   (&g_table->slots[((H) + (I)) % g_table->nslots])
+
+const char *tls_cache_path()
+{
+    static char path[PATH_MAX] = { '\0' };
+    if (path[0])
+        return path;
+
+    const char *dir = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char base[PATH_MAX - 16];   // room for file name.
+    if (dir && *dir)
+        snprintf(base, sizeof(base), "%s/mget", dir);
+    else if (home && *home)
+        snprintf(base, sizeof(base), "%s/.cache/mget", home);
+    else
+        return NULL;
+
+    // Parent of base is created as well, as ~/.cache may not exist yet.
+    char *slash = strrchr(base, '/');
+    *slash = '\0';
+    mkdir(base, S_IRWXU);
+    *slash = '/';
+    if (mkdir(base, S_IRWXU) == -1 && errno != EEXIST) {
+        mlog(VERBOSE, "Failed to create %s: %s\n", base, strerror(errno));
+        return NULL;
+    }
+
+    snprintf(path, sizeof(path), "%s/tls_sessions", base);
+    return path;
+}
+
+bool tls_cache_open(const char *path, uint32 entries)
+{
+    if (g_table)
+        return g_mapped;
+
+    if (!entries)
+        entries = TLS_CACHE_ENTRIES;
+
+    g_length = sizeof(tls_table) + (size_t) entries * sizeof(tls_slot);
+    if (path) {
+        bool created = false;
+        size_t length = g_length;
+        tls_table *table = file_region_attach(path, &length, &created,
+                                              TLS_CACHE_MAGIC);
+        if (table && created) {
+            table->version = TLS_CACHE_VERSION;
+            table->nslots = entries;
+            __atomic_store_n(&table->magic, TLS_CACHE_MAGIC,
+                             __ATOMIC_RELEASE);
+        } else if (table) {
+            if (table->version != TLS_CACHE_VERSION || !table->nslots ||
+                length < sizeof(tls_table) +
+                (size_t) table->nslots * sizeof(tls_slot)) {
+                mlog(VERBOSE, "TLS session cache %s is not usable, "
+                     "using private one.\n", path);
+                shm_region_close(table, length);
+                table = NULL;
+            }
+        }
+
+        if (table) {
+            g_table = table;
+            g_length = length;
+            g_mapped = true;
+            return true;
+        }
+    }
+
+    g_table = (tls_table *) ZALLOC(char, g_length);
+    g_table->version = TLS_CACHE_VERSION;
+    g_table->nslots = entries;
+    g_table->magic = TLS_CACHE_MAGIC;
+    return false;
+}
+
+int tls_cache_get(const char *host, int port, void *buf, int size)
+{
+    if (!g_table || !host)
+        return 0;
+
+    uint32 hash = tls_hash(host, port);
+    int64 now = time(NULL);
+    tls_slot s;
+    for (int i = 0; i < TLS_PROBE_MAX; i++) {
+        if (!slot_read(SLOT(hash, i), &s))
+            continue;
+        if (!s.hash)            // end of probe sequence.
+            break;
+        if (!slot_match(&s, hash, host, port) || s.expires <= now ||
+            !s.size || s.size > size)
+            continue;
+
+        memcpy(buf, s.data, s.size);
+        return s.size;
+    }
+
+    return 0;
+}
+
+void tls_cache_put(const char *host, int port, const void *data, int size,
+                   int64 expires)
+{
+    if (!g_table || !host || strlen(host) >= TLS_HOST_MAX || size <= 0 ||
+        size > TLS_CACHE_DATA)
+        return;
+
+    // Use slot of this host if any, or the first empty one, or the first
+    // expired one, or the one expires first, in this order.
+    uint32 hash = tls_hash(host, port);
+    int64 now = time(NULL);
+    tls_slot *target = NULL;
+    tls_slot *expired = NULL;
+    tls_slot *oldest = NULL;
+    int64 oldest_expires = 0;
+    for (int i = 0; i < TLS_PROBE_MAX; i++) {
+        tls_slot *p = SLOT(hash, i);
+        uint32 h = __atomic_load_n(&p->hash, __ATOMIC_RELAXED);
+        int64 e = __atomic_load_n(&p->expires, __ATOMIC_RELAXED);
+        if (!h || (h == hash && p->port == port &&
+                   !strncmp(p->host, host, TLS_HOST_MAX))) {
+            target = p;
+            break;
+        }
+        if (!expired && e <= now)
+            expired = p;
+        if (!oldest || e < oldest_expires) {
+            oldest = p;
+            oldest_expires = e;
+        }
+    }
+
+    if (!target)
+        target = expired ? expired : oldest;
+
+    uint32 seq;
+    if (!target || !slot_lock(target, &seq))
+        return;
+
+    target->hash = hash;
+    target->port = port;
+    target->expires = expires;
+    target->size = size;
+    strcpy(target->host, host);
+    memcpy(target->data, data, size);
+    slot_unlock(target, seq);
+}
+
+void tls_cache_close()
+{
+    if (g_mapped)
+        shm_region_close(g_table, g_length);
+    else
+        FIF(g_table);
+
+    g_table = NULL;
+    g_mapped = false;
+}
+
+/*
+ * Editor modelines
+ *
+ * Local Variables:
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * fill-column: 78
+ * End:
+ *
+ * vim: set noet ts=4 sw=4:
+ */
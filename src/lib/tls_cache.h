@@ -0,0 +1,75 @@
+/** tls_cache.h --- TLS session cache kept on disk, used internally by libmget.
+ *
+ * Copyright (C) 2014 Yang,Ying-chao
+ *
+ * Author: Yang,Ying-chao <yangyingchao@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _TLS_CACHE_H_
+#define _TLS_CACHE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mget_types.h"
+
+#define TLS_CACHE_ENTRIES  128  // default number of hosts.
+#define TLS_CACHE_DATA     7936 // max size of a serialized session.
+
+/**
+ * @name tls_cache_open - Opens session cache.
+ * @param path - file to map, or NULL to use private memory.
+ * @param entries - number of hosts it can hold, used only if it is created.
+ * @return true if file is used.
+ *
+ * Private memory is used if file can't be opened, so that cache is always
+ * available after this call.
+ */
+bool tls_cache_open(const char *path, uint32 entries);
+
+/** Returns path of cache file of current user, its directory is created if
+ *  needed. Returns NULL if there is no home to keep it.
+ */
+const char *tls_cache_path();
+
+/** Copies unexpired session of host into buf, returns its size or 0. */
+int tls_cache_get(const char *host, int port, void *buf, int size);
+
+/** Replaces session of host, expires is in seconds since epoch. */
+void tls_cache_put(const char *host, int port, const void *data, int size,
+                   int64 expires);
+
+void tls_cache_close();
+
+#ifdef __cplusplus
+}
+#endif
+#endif				/* _TLS_CACHE_H_ */
+/*
+ * Editor modelines
+ *
+ * Local Variables:
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * fill-column: 78
+ * End:
+ *
+ * vim: set noet ts=4 sw=4:
+ */
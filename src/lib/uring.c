@@ -0,0 +1,249 @@
+/** uring.c --- implementation of io_uring wrapper.
+ *
+ * Copyright (C) 2014 Yang,Ying-chao
+ *
+ * Author: Yang,Ying-chao <yangyingchao@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+#include "logutils.h"
+#include "mget_macros.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// liburing is not required, rings are set up with raw system calls.
+
+struct _uring {
+    int fd;
+    uint32 features;
+
+    // submission queue.
+    void *sq_ptr;
+    size_t sq_size;
+    uint32 *sq_head;
+    uint32 *sq_tail;
+    uint32 *sq_mask;
+    uint32 *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    uint32 sqe_tail;            // local tail, published by uring_submit.
+    uint32 sqe_head;
+
+    // completion queue.
+    void *cq_ptr;
+    size_t cq_size;
+    uint32 *cq_head;
+    uint32 *cq_tail;
+    uint32 *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+#define LOAD_ACQUIRE(X)      __atomic_load_n((X), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(X, V)  __atomic_store_n((X), (V), __ATOMIC_RELEASE)
+
+uring *uring_create(uint32 entries)
+{
+    struct io_uring_params p;
+    XZERO(p);
+
+    int fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+    if (fd == -1) {
+        mlog(VERBOSE, "io_uring is not available: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    uring *ring = ZALLOC1(uring);
+    ring->fd = fd;
+    ring->features = p.features;
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(uint32);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_size = ring->cq_size = MAX(ring->sq_size, ring->cq_size);
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        ring->sq_ptr = NULL;
+        goto err;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            ring->cq_ptr = NULL;
+            goto err;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto err;
+    }
+
+    char *sq = (char *) ring->sq_ptr;
+    ring->sq_head = (uint32 *) (sq + p.sq_off.head);
+    ring->sq_tail = (uint32 *) (sq + p.sq_off.tail);
+    ring->sq_mask = (uint32 *) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (uint32 *) (sq + p.sq_off.array);
+
+    char *cq = (char *) ring->cq_ptr;
+    ring->cq_head = (uint32 *) (cq + p.cq_off.head);
+    ring->cq_tail = (uint32 *) (cq + p.cq_off.tail);
+    ring->cq_mask = (uint32 *) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    ring->sqe_head = ring->sqe_tail = *ring->sq_tail;
+
+    PDEBUG("ring: %p, fd: %d, sq: %u, cq: %u\n", ring, fd,
+           p.sq_entries, p.cq_entries);
+    return ring;
+
+err:
+    mlog(ALWAYS, "Failed to map io_uring: %s\n", strerror(errno));
+    uring_destroy(ring);
+    return NULL;
+}
+
+void uring_destroy(uring * ring)
+{
+    if (!ring)
+        return;
+
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr)
+        munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+    FIF(ring);
+}
+
+struct io_uring_sqe *uring_get_sqe(uring * ring)
+{
+    uint32 head = LOAD_ACQUIRE(ring->sq_head);
+    if (ring->sqe_tail - head > *ring->sq_mask)
+        return NULL;
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_submit(uring * ring, uint32 wait_nr)
+{
+    uint32 tail = *ring->sq_tail;
+    uint32 mask = *ring->sq_mask;
+    uint32 submitted = ring->sqe_tail - ring->sqe_head;
+
+    while (ring->sqe_head != ring->sqe_tail) {
+        ring->sq_array[tail & mask] = ring->sqe_head & mask;
+        tail++;
+        ring->sqe_head++;
+    }
+    STORE_RELEASE(ring->sq_tail, tail);
+
+    int ret = (int) syscall(__NR_io_uring_enter, ring->fd, submitted,
+                            wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0,
+                            NULL, 0);
+    return ret < 0 ? -errno : ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring * ring)
+{
+    uint32 head = *ring->cq_head;
+    if (head == LOAD_ACQUIRE(ring->cq_tail))
+        return NULL;
+
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(uring * ring)
+{
+    STORE_RELEASE(ring->cq_head, *ring->cq_head + 1);
+}
+
+void uring_prep_poll(struct io_uring_sqe *sqe, int fd, uint32 events,
+                     uint64 data)
+{
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    events = (events << 16) | (events >> 16); // kernel wants it word-reversed.
+#endif
+    sqe->poll32_events = events;
+    sqe->user_data = data;
+}
+
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, void *buf,
+                     uint32 len, uint64 data)
+{
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (uint64) (uintptr_t) buf;
+    sqe->len = len;
+    sqe->user_data = data;
+}
+
+void uring_prep_timeout(struct io_uring_sqe *sqe,
+                        struct __kernel_timespec *ts, uint64 data)
+{
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64) (uintptr_t) ts;
+    sqe->len = 1;
+    sqe->user_data = data;
+}
+
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64 target,
+                       uint64 data)
+{
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = data;
+}
+
+#endif                          /* HAVE_IO_URING */
+
+/*
+ * Editor modelines
+ *
+ * Local Variables:
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * fill-column: 78
+ * End:
+ *
+ * vim: set noet ts=4 sw=4:
+ */
@@ -0,0 +1,87 @@
+/** uring.h --- thin wrapper of io_uring, used internally by libmget.
+ *
+ * Copyright (C) 2014 Yang,Ying-chao
+ *
+ * Author: Yang,Ying-chao <yangyingchao@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mget_config.h"
+#include "mget_types.h"
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+
+typedef struct _uring uring;
+
+/**
+ * @name uring_create - Creates a ring.
+ * @param entries - Number of submission queue entries.
+ * @return uring*, or NULL if io_uring is not supported by kernel.
+ */
+uring *uring_create(uint32 entries);
+void uring_destroy(uring * ring);
+
+/** Returns a zeroed sqe, or NULL if submission queue is full. */
+struct io_uring_sqe *uring_get_sqe(uring * ring);
+
+/**
+ * @name uring_submit - Submits queued sqes and waits for completions.
+ * @param ring - ring
+ * @param wait_nr - Number of completions to wait for.
+ * @return number of sqes submitted, or -errno.
+ */
+int uring_submit(uring * ring, uint32 wait_nr);
+
+/** Returns next completion, or NULL if nothing completed. */
+struct io_uring_cqe *uring_peek_cqe(uring * ring);
+void uring_cqe_seen(uring * ring);
+
+void uring_prep_poll(struct io_uring_sqe *sqe, int fd, uint32 events,
+                     uint64 data);
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, void *buf,
+                     uint32 len, uint64 data);
+void uring_prep_timeout(struct io_uring_sqe *sqe,
+                        struct __kernel_timespec *ts, uint64 data);
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64 target,
+                       uint64 data);
+
+#endif                          /* HAVE_IO_URING */
+
+#ifdef __cplusplus
+}
+#endif
+#endif				/* _URING_H_ */
+/*
+ * Editor modelines
+ *
+ * Local Variables:
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * fill-column: 78
+ * End:
+ *
+ * vim: set noet ts=4 sw=4:
+ */
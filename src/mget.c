@@ -41,7 +41,7 @@ bool control_byte = false;
 static const int MAX_RETRY_TIMES = 3;
 
 void sigterm_handler2(int sig, siginfo_t *si, void *param) {
-    control_byte = true;
+    mget_request_stop(&control_byte);
     fprintf(stderr, "\nSaving temporary data...\n");
 }
 
@@ -72,21 +72,21 @@ void show_progress(metadata *md, void *user_data) {
 
     if (idx < REPORT_THREADHOLD - 1) {
         if (!ts) {
-            ts = get_time_ms();
+            ts = (uint32) get_monotonic_ms();
             rts = ts;
             if (!last_recv) {
                 last_recv = md->hd.current_size;
             }
             progress_report(p, idx, false, 0, 0, 0);
-        } else if ((get_time_ms() - ts) > interval) {
+        } else if (((uint32) get_monotonic_ms() - ts) > interval) {
             progress_report(p, idx++, false, 0, 0, 0);
-            ts = get_time_ms();
+            ts = (uint32) get_monotonic_ms();
         }
     } else {
         uint64 total = md->hd.package_size;
         uint64 recv = md->hd.current_size;
         uint64 diff_size = md->hd.current_size - last_recv;
-        uint32 c_time = get_time_ms();
+        uint32 c_time = (uint32) get_monotonic_ms();
         uint64 bps = (uint64)((double)(diff_size) * 1000 / (c_time - rts)) + 1;
 
         progress_report(p, idx, true, (double)recv / total * 100, bps,
@@ -117,7 +117,45 @@ void print_help() {
         "resolving host names.\n",
         "\t     'U': Update, get address from DNS server instead of "
         "from cache, but update cache after name resolved.\n",
-        "\t-L:  limit bandwidth.\n", "\t-h:  show this help.\n", "\n", NULL};
+        "\t-D:  set number of hosts kept in host cache, which is shared by "
+        "mget processes of same user.\n",
+        "\t     Use 4096,600 to keep addresses for 600 seconds as well.\n",
+        "\t-C:  cap connections to a host of all mget processes of same "
+        "user, use 16,10M to cap their bandwidth as well.\n",
+        "\t-S:  spread connections over all addresses of host, and move "
+        "them from slow addresses to faster ones.\n",
+        "\t-F:  use TCP Fast Open, request is sent along with SYN to "
+        "servers visited before.\n",
+        "\t-B:  bind connections to source addresses or interfaces, "
+        "separated by comma, more connections go out of faster ones.\n",
+        "\t-U:  connect to this unix socket (e.g. a local caching proxy) "
+        "instead of host in url.\n",
+        "\t-b:  background, back off when links get busy with other "
+        "traffic, and write to disk with idle priority.\n",
+        "\t-Z:  experimental and untested, receive plain HTTP with TCP "
+        "zero-copy receive where supported, pages mapped are still copied "
+        "into file once by kernel.\n",
+        "\t-Y:  report syscalls made per MB received when finished.\n",
+        "\t-T:  set socket tuning profile, can be one of 'd', 'n' or 'l':\n",
+        "\t     'd': Default, TCP_NODELAY and keepalive, buffers are "
+        "autotuned by kernel.\n",
+        "\t     'n': None, use kernel defaults.\n",
+        "\t     'l': Long fat network, receive buffer is sized from measured "
+        "bandwidth-delay product, and bbr is used if available.\n",
+        "\t     Use l,16M,cubic,120 to set receive buffer, congestion "
+        "control and keepalive idle seconds (0 disables) as well.\n",
+        "\t-E:  set io engine, can be one of 's', 'e' or 'u':\n",
+        "\t     's': select(2), available on all platforms.\n",
+        "\t     'e': epoll(7), default on Linux.\n",
+        "\t     'u': io_uring(7), receives data into target file directly, "
+        "falls back to default if not supported by kernel.\n",
+        "\t-L:  limit bandwidth, in bytes per second, suffix K, M or G "
+        "can be used, e.g. 10M.\n",
+        "\t     Use 10M,2M to limit every single host to 2M as well.\n",
+        "\t-k:  set max idle connections kept per host, 0 disables "
+        "keep-alive.\n",
+        "\t     Use 8,60 to keep them idle for 60 seconds at most.\n",
+        "\t-h:  show this help.\n", "\n", NULL};
 
     printf(
         "Mget %s, non-interactive network retriever "
@@ -131,6 +169,17 @@ void print_help() {
     }
 }
 
+/* Returns size in arg of option opt, exits if it is invalid. */
+static int size_arg(int opt, const char *arg) {
+    int size = integer_size(arg);
+    if (size < 0) {
+        fprintf(stderr, "Invalid size of -%c: %.*s\n",
+                opt, (int) strcspn(arg, ","), arg);
+        exit(-1);
+    }
+    return size;
+}
+
 int main(int argc, char *argv[]) {
     if (argc == 1) {
         print_help();
@@ -151,7 +200,7 @@ int main(int argc, char *argv[]) {
 
     memset(&fn, 0, sizeof(file_name));
 
-    while ((opt = getopt(argc, argv, "hIH:j:d:o:r:svu:p:l:L:P:")) != -1) {
+    while ((opt = getopt(argc, argv, "hIE:H:D:C:SFZYbB:U:T:j:d:o:r:svu:p:l:k:L:P:")) != -1) {
         switch (opt) {
             case 'h': {
                 print_help();
@@ -196,6 +245,99 @@ int main(int argc, char *argv[]) {
                 }
                 break;
             }
+            case 'D': {
+                opts.dns_entries = atoi(optarg);
+                char *ttl = strchr(optarg, ',');
+                if (ttl)
+                    opts.dns_ttl = atoi(ttl + 1);
+                break;
+            }
+            case 'C': {
+                opts.shared_conns = atoi(optarg);
+                char *limit = strchr(optarg, ',');
+                if (limit)
+                    opts.shared_limit = size_arg(opt, limit + 1);
+                break;
+            }
+            case 'S': {
+                opts.spread = true;
+                break;
+            }
+            case 'F': {
+                opts.fastopen = true;
+                break;
+            }
+            case 'B': {
+                opts.sources = strdup(optarg);
+                break;
+            }
+            case 'b': {
+                opts.background = true;
+                break;
+            }
+            case 'Z': {
+                opts.zerocopy = true;
+                break;
+            }
+            case 'Y': {
+                opts.io_stats = true;
+                break;
+            }
+            case 'U': {
+                opts.unix_socket = strdup(optarg);
+                break;
+            }
+            case 'T': {
+                switch (*optarg) {
+                    case 'n': {
+                        opts.profile = SP_NONE;
+                        break;
+                    }
+                    case 'l': {
+                        opts.profile = SP_LFN;
+                        break;
+                    }
+                    default: { opts.profile = SP_DEFAULT; }
+                }
+
+                // Optional fields: receive buffer, congestion, keepalive.
+                char *v = strchr(optarg, ',');
+                if (v) {
+                    opts.rcvbuf = size_arg(opt, v + 1);
+                    v = strchr(v + 1, ',');
+                }
+                if (v) {
+                    char *end = strchr(v + 1, ',');
+                    size_t len = end ? (size_t)(end - v - 1) : strlen(v + 1);
+                    if (len)
+                        opts.congestion = strndup(v + 1, len);
+                    v = end;
+                }
+                if (v) {
+                    opts.keepalive = atoi(v + 1);
+                    if (!opts.keepalive)
+                        opts.keepalive = -1;
+                }
+                break;
+            }
+            case 'E': {
+                switch (*optarg) {
+                    case 's': {
+                        opts.engine = IE_SELECT;
+                        break;
+                    }
+                    case 'e': {
+                        opts.engine = IE_EPOLL;
+                        break;
+                    }
+                    case 'u': {
+                        opts.engine = IE_URING;
+                        break;
+                    }
+                    default: { opts.engine = IE_DEFAULT; }
+                }
+                break;
+            }
             case 'u': {
                 opts.user = strdup(optarg);
                 break;
@@ -211,7 +353,19 @@ int main(int argc, char *argv[]) {
                 break;
             }
             case 'L': {
-                opts.limit = integer_size(optarg);
+                opts.limit = size_arg(opt, optarg);
+                char *hl = strchr(optarg, ',');
+                if (hl)
+                    opts.host_limit = size_arg(opt, hl + 1);
+                break;
+            }
+            case 'k': {
+                opts.pool_size = atoi(optarg);
+                if (!opts.pool_size)
+                    opts.pool_size = -1;
+                char *pt = strchr(optarg, ',');
+                if (pt)
+                    opts.pool_timeout = atoi(pt + 1);
                 break;
             }
             case 'o': {
@@ -308,6 +462,9 @@ int main(int argc, char *argv[]) {
     }
 
     free(opts.proxy.server);
+    free(opts.congestion);
+    free(opts.sources);
+    free(opts.unix_socket);
     mget_cleanup();
 
     return ret;